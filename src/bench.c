@@ -0,0 +1,692 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+
+#ifdef G_OS_WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#pragma comment (lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined (__GLIBC__) && !defined (BENCH_NO_ALLOC_HOOKS)
+#include <malloc.h>
+#define BENCH_ALLOC_HOOKS
+#endif
+
+#include "bench.h"
+#include "utils.h"
+
+static gint       bench_warmup = 1;
+static gint       bench_repetitions = 10;
+static gchar     *bench_json_file = NULL;
+static GPtrArray *bench_results = NULL;
+static GPtrArray *bench_metrics = NULL;
+
+static GOptionEntry bench_entries[] = {
+  { "warmup", 0, 0, G_OPTION_ARG_INT, &bench_warmup,
+    "Untimed repetitions before measuring (default 1)", "N" },
+  { "repetitions", 0, 0, G_OPTION_ARG_INT, &bench_repetitions,
+    "Timed repetitions of each benchmark (default 10)", "N" },
+  { "json", 0, 0, G_OPTION_ARG_FILENAME, &bench_json_file,
+    "Also write the results to FILE as JSON", "FILE" },
+  { NULL }
+};
+
+/* A single number that doesn't come from timing an operation, such as a
+ * throughput or a count */
+typedef struct {
+  gchar   *name;
+  gchar   *unit;
+  gdouble  value;
+} BenchMetric;
+
+static void
+bench_result_free (BenchResult *result)
+{
+  g_free (result->name);
+  g_slice_free (BenchResult, result);
+}
+
+static void
+bench_metric_free (BenchMetric *metric)
+{
+  g_free (metric->name);
+  g_free (metric->unit);
+  g_slice_free (BenchMetric, metric);
+}
+
+/* Must be called before g_test_init(), which would otherwise reject our
+ * options. @entries are extra options for the benchmark program itself. */
+void
+bench_init (int                 *argc,
+            char              ***argv,
+            const GOptionEntry  *entries)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, bench_entries, NULL);
+  if (entries != NULL)
+    g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_set_ignore_unknown_options (context, TRUE);
+  g_option_context_set_help_enabled (context, FALSE);
+
+  if (!g_option_context_parse (context, argc, argv, &error))
+    {
+      fprintf (stderr, "%s\n", error->message);
+      exit (1);
+    }
+
+  g_option_context_free (context);
+
+  bench_warmup = MAX (bench_warmup, 0);
+  bench_repetitions = MAX (bench_repetitions, 1);
+
+  bench_results = g_ptr_array_new_with_free_func ((GDestroyNotify) bench_result_free);
+  bench_metrics = g_ptr_array_new_with_free_func ((GDestroyNotify) bench_metric_free);
+
+  fprintf (stderr, "%-48s %12s %12s %12s %12s %12s %12s %10s %10s\n",
+           "Benchmark", "ns/op", "stddev", "p50", "p90", "p99", "max",
+           "allocs/op", "B/op");
+}
+
+static void
+append_json_string (GString     *json,
+                    const gchar *string)
+{
+  g_string_append_c (json, '"');
+  for (; *string != '\0'; string++)
+    {
+      if (*string == '"' || *string == '\\')
+        g_string_append_c (json, '\\');
+      g_string_append_c (json, *string);
+    }
+  g_string_append_c (json, '"');
+}
+
+static void
+write_json (const gchar *filename)
+{
+  GString *json;
+  GError *error = NULL;
+  guint i;
+
+  json = g_string_new ("{\n  \"benchmarks\": [");
+
+  for (i = 0; i < bench_results->len; i++)
+    {
+      BenchResult *result = g_ptr_array_index (bench_results, i);
+      gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+      g_string_append (json, i == 0 ? "\n    { \"name\": " : ",\n    { \"name\": ");
+      append_json_string (json, result->name);
+      g_string_append_printf (json, ", \"iterations\": %u, \"repetitions\": %u",
+                              result->iterations, result->repetitions);
+
+#define APPEND_FIELD(_n, _v)                                                 \
+      g_string_append_printf (json, ", \"%s\": %s", (_n),                   \
+                              g_ascii_dtostr (buffer, sizeof (buffer), (_v)))
+      APPEND_FIELD ("ns_per_op", result->ns_per_op);
+      APPEND_FIELD ("stddev_ns", result->stddev_ns);
+      APPEND_FIELD ("min_ns", result->min_ns);
+      APPEND_FIELD ("p50_ns", result->p50_ns);
+      APPEND_FIELD ("p90_ns", result->p90_ns);
+      APPEND_FIELD ("p99_ns", result->p99_ns);
+      APPEND_FIELD ("max_ns", result->max_ns);
+      if (result->allocs_per_op >= 0)
+        {
+          APPEND_FIELD ("allocs_per_op", result->allocs_per_op);
+          APPEND_FIELD ("bytes_per_op", result->bytes_per_op);
+        }
+#undef APPEND_FIELD
+
+      g_string_append (json, " }");
+    }
+
+  g_string_append (json, "\n  ],\n  \"metrics\": [");
+
+  for (i = 0; i < bench_metrics->len; i++)
+    {
+      BenchMetric *metric = g_ptr_array_index (bench_metrics, i);
+      gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+      g_string_append (json, i == 0 ? "\n    { \"name\": " : ",\n    { \"name\": ");
+      append_json_string (json, metric->name);
+      g_string_append (json, ", \"unit\": ");
+      append_json_string (json, metric->unit);
+      g_string_append_printf (json, ", \"value\": %s }",
+                              g_ascii_dtostr (buffer, sizeof (buffer), metric->value));
+    }
+
+  g_string_append (json, "\n  ]\n}\n");
+
+  if (!g_file_set_contents (filename, json->str, json->len, &error))
+    {
+      fprintf (stderr, "Could not write %s: %s\n", filename, error->message);
+      g_error_free (error);
+    }
+
+  g_string_free (json, TRUE);
+}
+
+void
+bench_finish (void)
+{
+  if (bench_json_file != NULL)
+    write_json (bench_json_file);
+
+  g_ptr_array_unref (bench_results);
+  bench_results = NULL;
+  g_ptr_array_unref (bench_metrics);
+  bench_metrics = NULL;
+  g_free (bench_json_file);
+  bench_json_file = NULL;
+}
+
+/* Results that are printed by the benchmark itself, recorded here so they
+ * end up in the JSON output too */
+void
+bench_record (const gchar *name,
+              const gchar *unit,
+              gdouble      value)
+{
+  BenchMetric *metric;
+
+  g_return_if_fail (bench_metrics != NULL);
+
+  metric = g_slice_new (BenchMetric);
+  metric->name = g_strdup (name);
+  metric->unit = g_strdup (unit);
+  metric->value = value;
+
+  g_ptr_array_add (bench_metrics, metric);
+}
+
+guint64
+bench_get_time_ns (void)
+{
+  return util_get_time_ns ();
+}
+
+#ifdef BENCH_ALLOC_HOOKS
+/* glibc lets the program replace malloc() and friends, and exports its
+ * own implementation under these names, so we can count every
+ * allocation made in the process, GLib's included, without LD_PRELOAD */
+extern void *__libc_malloc   (size_t size);
+extern void *__libc_calloc   (size_t n, size_t size);
+extern void *__libc_realloc  (void *ptr, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+extern void  __libc_free     (void *ptr);
+
+static guint64 alloc_n_allocations;
+static guint64 alloc_n_frees;
+static guint64 alloc_bytes_allocated;
+static gint64  alloc_bytes_live;
+
+static inline void *
+count_allocation (void *ptr)
+{
+  if (ptr != NULL)
+    {
+      size_t size = malloc_usable_size (ptr);
+
+      __atomic_add_fetch (&alloc_n_allocations, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch (&alloc_bytes_allocated, size, __ATOMIC_RELAXED);
+      __atomic_add_fetch (&alloc_bytes_live, size, __ATOMIC_RELAXED);
+    }
+
+  return ptr;
+}
+
+static inline void
+count_free (void *ptr)
+{
+  if (ptr != NULL)
+    {
+      __atomic_add_fetch (&alloc_n_frees, 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch (&alloc_bytes_live, malloc_usable_size (ptr), __ATOMIC_RELAXED);
+    }
+}
+
+void *
+malloc (size_t size)
+{
+  return count_allocation (__libc_malloc (size));
+}
+
+void *
+calloc (size_t n,
+        size_t size)
+{
+  return count_allocation (__libc_calloc (n, size));
+}
+
+/* Counted as a free and a new allocation */
+void *
+realloc (void   *ptr,
+         size_t  size)
+{
+  count_free (ptr);
+
+  return count_allocation (__libc_realloc (ptr, size));
+}
+
+void *
+memalign (size_t alignment,
+          size_t size)
+{
+  return count_allocation (__libc_memalign (alignment, size));
+}
+
+void *
+aligned_alloc (size_t alignment,
+               size_t size)
+{
+  return count_allocation (__libc_memalign (alignment, size));
+}
+
+int
+posix_memalign (void   **ptr,
+                size_t   alignment,
+                size_t   size)
+{
+  void *result = count_allocation (__libc_memalign (alignment, size));
+
+  if (result == NULL)
+    return ENOMEM;
+
+  *ptr = result;
+
+  return 0;
+}
+
+void
+free (void *ptr)
+{
+  count_free (ptr);
+  __libc_free (ptr);
+}
+#endif
+
+/* Returns FALSE, leaving @stats zeroed, if allocations are not being
+ * counted in this build */
+gboolean
+bench_get_alloc_stats (BenchAllocStats *stats)
+{
+#ifdef BENCH_ALLOC_HOOKS
+  stats->n_allocations = __atomic_load_n (&alloc_n_allocations, __ATOMIC_RELAXED);
+  stats->n_frees = __atomic_load_n (&alloc_n_frees, __ATOMIC_RELAXED);
+  stats->bytes_allocated = __atomic_load_n (&alloc_bytes_allocated, __ATOMIC_RELAXED);
+  stats->bytes_live = __atomic_load_n (&alloc_bytes_live, __ATOMIC_RELAXED);
+
+  return TRUE;
+#else
+  memset (stats, 0, sizeof (BenchAllocStats));
+
+  return FALSE;
+#endif
+}
+
+/* Resident set size of the process in bytes, or 0 if unknown */
+gsize
+bench_get_rss (void)
+{
+#ifdef G_OS_WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+
+  if (!GetProcessMemoryInfo (GetCurrentProcess (), &counters, sizeof (counters)))
+    return 0;
+
+  return counters.WorkingSetSize;
+#else
+  gchar *contents;
+  gulong size, resident = 0;
+
+  if (!g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL))
+    return 0;
+
+  if (sscanf (contents, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+
+  g_free (contents);
+
+  return (gsize) resident * sysconf (_SC_PAGESIZE);
+#endif
+}
+
+/* Processor time the process has used so far, user and system, in ns, or
+ * 0 if unknown */
+guint64
+bench_get_cpu_time_ns (void)
+{
+#ifdef G_OS_WIN32
+  FILETIME creation, exit, kernel, user;
+
+  if (!GetProcessTimes (GetCurrentProcess (), &creation, &exit, &kernel, &user))
+    return 0;
+
+  /* In units of 100 ns */
+  return ((((guint64) kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+          (((guint64) user.dwHighDateTime << 32) | user.dwLowDateTime)) * 100;
+#else
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+    return 0;
+
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_GUINT64_CONSTANT (1000000000) +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * G_GUINT64_CONSTANT (1000);
+#endif
+}
+
+/* Processor time the calling thread has used so far, user and system, in
+ * ns, or 0 if unknown */
+guint64
+bench_get_thread_cpu_time_ns (void)
+{
+#ifdef G_OS_WIN32
+  FILETIME creation, exit, kernel, user;
+
+  if (!GetThreadTimes (GetCurrentThread (), &creation, &exit, &kernel, &user))
+    return 0;
+
+  /* In units of 100 ns */
+  return ((((guint64) kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+          (((guint64) user.dwHighDateTime << 32) | user.dwLowDateTime)) * 100;
+#else
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return 0;
+
+  return (guint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Page faults the process has taken so far, minor and major, or 0 if
+ * unknown */
+guint64
+bench_get_page_faults (void)
+{
+#ifdef G_OS_WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+
+  if (!GetProcessMemoryInfo (GetCurrentProcess (), &counters, sizeof (counters)))
+    return 0;
+
+  return counters.PageFaultCount;
+#else
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+    return 0;
+
+  return usage.ru_minflt + usage.ru_majflt;
+#endif
+}
+
+static gint
+compare_samples (gconstpointer a,
+                 gconstpointer b)
+{
+  guint64 sa = *(const guint64 *) a, sb = *(const guint64 *) b;
+
+  return (sa > sb) - (sa < sb);
+}
+
+/* Nearest-rank percentile of a sorted array */
+static gdouble
+percentile (const guint64 *samples,
+            guint          n_samples,
+            gdouble        p)
+{
+  guint rank = (guint) ceil (p / 100.0 * n_samples);
+
+  return (gdouble) samples[CLAMP (rank, 1, n_samples) - 1];
+}
+
+static BenchResult *
+compute_result (const gchar *name,
+                guint64     *samples,
+                guint        n_samples)
+{
+  BenchResult *result;
+  gdouble sum = 0, sum_sq = 0, mean;
+  guint i;
+
+  result = g_slice_new0 (BenchResult);
+  result->name = g_strdup (name);
+  result->iterations = n_samples;
+  result->repetitions = bench_repetitions;
+  result->n_samples = n_samples;
+  result->allocs_per_op = -1;
+  result->bytes_per_op = -1;
+
+  if (n_samples > 0)
+    {
+      for (i = 0; i < n_samples; i++)
+        {
+          sum += samples[i];
+          sum_sq += (gdouble) samples[i] * samples[i];
+        }
+      mean = sum / n_samples;
+
+      qsort (samples, n_samples, sizeof (guint64), compare_samples);
+
+      result->ns_per_op = mean;
+      result->stddev_ns = sqrt (MAX (sum_sq / n_samples - mean * mean, 0.0));
+      result->min_ns = samples[0];
+      result->p50_ns = percentile (samples, n_samples, 50);
+      result->p90_ns = percentile (samples, n_samples, 90);
+      result->p99_ns = percentile (samples, n_samples, 99);
+      result->max_ns = samples[n_samples - 1];
+    }
+
+  return result;
+}
+
+/* Prints @result and keeps it for the JSON output */
+static void
+add_result (BenchResult *result)
+{
+  fprintf (stderr, "%-48s %12.0f %12.0f %12.0f %12.0f %12.0f %12.0f",
+           result->name, result->ns_per_op, result->stddev_ns,
+           result->p50_ns, result->p90_ns, result->p99_ns, result->max_ns);
+
+  if (result->allocs_per_op >= 0)
+    fprintf (stderr, " %10.1f %10.0f\n", result->allocs_per_op, result->bytes_per_op);
+  else
+    fprintf (stderr, " %10s %10s\n", "-", "-");
+
+  g_ptr_array_add (bench_results, result);
+}
+
+/* Computes and prints the statistics of @samples, which are sorted in
+ * place. For measurements that don't fit bench_run(), such as latencies
+ * observed from another thread. */
+BenchResult *
+bench_add_samples (const gchar *name,
+                   guint64     *samples,
+                   guint        n_samples)
+{
+  BenchResult *result;
+
+  g_return_val_if_fail (bench_results != NULL, NULL);
+
+  result = compute_result (name, samples, n_samples);
+  add_result (result);
+
+  return result;
+}
+
+/* Prints how many of @samples fall in each power-of-two bucket of
+ * microseconds */
+void
+bench_print_histogram (const guint64 *samples,
+                       guint          n_samples)
+{
+  guint buckets[32] = { 0, };
+  guint i, first = G_N_ELEMENTS (buckets), last = 0, largest = 0;
+
+  for (i = 0; i < n_samples; i++)
+    {
+      guint64 us = samples[i] / 1000;
+      guint bucket = 0;
+
+      while (us > 0 && bucket < G_N_ELEMENTS (buckets) - 1)
+        {
+          us >>= 1;
+          bucket++;
+        }
+
+      buckets[bucket]++;
+      first = MIN (first, bucket);
+      last = MAX (last, bucket);
+      largest = MAX (largest, buckets[bucket]);
+    }
+
+  for (i = first; i <= last && largest > 0; i++)
+    {
+      gchar *range, *bar;
+
+      if (i == 0)
+        range = g_strdup ("< 1 us");
+      else
+        range = g_strdup_printf ("%u - %u us", 1u << (i - 1), 1u << i);
+
+      bar = g_strnfill ((gsize) (50.0 * buckets[i] / largest + 0.5), '#');
+      fprintf (stderr, "  %20s %8u %s\n", range, buckets[i], bar);
+
+      g_free (bar);
+      g_free (range);
+    }
+}
+
+#define BENCH_CALIBRATION_SAMPLES 1001
+
+/* What timing an empty operation reads as: the median of a run of them,
+ * measured once */
+static guint64
+timer_overhead_ns (void)
+{
+  static guint64 overhead = G_MAXUINT64;
+
+  if (overhead == G_MAXUINT64)
+    {
+      guint64 samples[BENCH_CALIBRATION_SAMPLES];
+      guint i;
+
+      for (i = 0; i < BENCH_CALIBRATION_SAMPLES; i++)
+        {
+          guint64 start = bench_get_time_ns ();
+
+          samples[i] = bench_get_time_ns () - start;
+        }
+
+      qsort (samples, BENCH_CALIBRATION_SAMPLES, sizeof (guint64), compare_samples);
+      overhead = samples[BENCH_CALIBRATION_SAMPLES / 2];
+    }
+
+  return overhead;
+}
+
+/* Every operation is timed on its own, so the percentiles describe the
+ * latency of single calls rather than of whole repetitions; the cost of
+ * reading the clock is taken off each. @setup, if given, runs untimed
+ * before each operation with the same iteration number. Allocations are
+ * counted over the timed calls only, and include any made by other
+ * threads meanwhile. */
+const BenchResult *
+bench_run_with_setup (const gchar *name,
+                      guint        iterations,
+                      BenchFunc    setup,
+                      BenchFunc    func,
+                      gpointer     user_data)
+{
+  BenchResult *result;
+  BenchAllocStats before, after;
+  guint64 *samples, n_allocations = 0, bytes_allocated = 0, overhead;
+  guint n_samples, iteration = 0, i, r;
+  gboolean have_alloc_stats;
+
+  g_return_val_if_fail (bench_results != NULL, NULL);
+  g_return_val_if_fail (iterations > 0, NULL);
+
+  for (r = 0; r < (guint) bench_warmup; r++)
+    for (i = 0; i < iterations; i++)
+      {
+        if (setup != NULL)
+          setup (iteration, user_data);
+        func (iteration++, user_data);
+      }
+
+  n_samples = iterations * bench_repetitions;
+  samples = g_new (guint64, n_samples);
+
+  overhead = timer_overhead_ns ();
+  have_alloc_stats = bench_get_alloc_stats (&before);
+
+  for (r = 0; r < (guint) bench_repetitions; r++)
+    for (i = 0; i < iterations; i++)
+      {
+        guint64 start, elapsed;
+
+        if (setup != NULL)
+          setup (iteration, user_data);
+
+        bench_get_alloc_stats (&before);
+        start = bench_get_time_ns ();
+        func (iteration++, user_data);
+        elapsed = bench_get_time_ns () - start;
+        samples[r * iterations + i] = elapsed > overhead ? elapsed - overhead : 0;
+        bench_get_alloc_stats (&after);
+
+        n_allocations += after.n_allocations - before.n_allocations;
+        bytes_allocated += after.bytes_allocated - before.bytes_allocated;
+      }
+
+  result = compute_result (name, samples, n_samples);
+  result->iterations = iterations;
+
+  if (have_alloc_stats)
+    {
+      result->allocs_per_op = (gdouble) n_allocations / n_samples;
+      result->bytes_per_op = (gdouble) bytes_allocated / n_samples;
+    }
+
+  add_result (result);
+
+  g_free (samples);
+
+  return result;
+}
+
+const BenchResult *
+bench_run (const gchar *name,
+           guint        iterations,
+           BenchFunc    func,
+           gpointer     user_data)
+{
+  return bench_run_with_setup (name, iterations, NULL, func, user_data);
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <glib.h>
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+G_BEGIN_DECLS
+
+/* Runs one operation of a benchmark; @iteration counts up from 0 across
+ * warmup and measured repetitions */
+typedef void (*BenchFunc) (guint    iteration,
+                           gpointer user_data);
+
+typedef struct {
+  gchar   *name;
+  guint    iterations;
+  guint    repetitions;
+  guint    n_samples;
+
+  gdouble  ns_per_op;
+  gdouble  stddev_ns;
+  gdouble  min_ns;
+  gdouble  p50_ns;
+  gdouble  p90_ns;
+  gdouble  p99_ns;
+  gdouble  max_ns;
+
+  /* Negative when allocations were not counted */
+  gdouble  allocs_per_op;
+  gdouble  bytes_per_op;
+} BenchResult;
+
+void               bench_init            (int                 *argc,
+                                          char              ***argv,
+                                          const GOptionEntry  *entries);
+void               bench_finish          (void);
+
+const BenchResult *bench_run             (const gchar   *name,
+                                          guint          iterations,
+                                          BenchFunc      func,
+                                          gpointer       user_data);
+const BenchResult *bench_run_with_setup  (const gchar   *name,
+                                          guint          iterations,
+                                          BenchFunc      setup,
+                                          BenchFunc      func,
+                                          gpointer       user_data);
+
+BenchResult       *bench_add_samples     (const gchar   *name,
+                                          guint64       *samples,
+                                          guint          n_samples);
+void               bench_print_histogram (const guint64 *samples,
+                                          guint          n_samples);
+
+void               bench_record          (const gchar   *name,
+                                          const gchar   *unit,
+                                          gdouble        value);
+
+guint64            bench_get_time_ns     (void);
+
+/* Heap usage as seen by malloc(). Only available where the harness can
+ * interpose the allocator, see bench_get_alloc_stats(). */
+typedef struct {
+  guint64  n_allocations;   /* calls that returned memory */
+  guint64  n_frees;
+  guint64  bytes_allocated; /* usable size of everything allocated */
+  gint64   bytes_live;      /* allocated but not yet freed */
+} BenchAllocStats;
+
+gboolean           bench_get_alloc_stats (BenchAllocStats *stats);
+gsize              bench_get_rss         (void);
+guint64            bench_get_page_faults (void);
+guint64            bench_get_cpu_time_ns (void);
+guint64            bench_get_thread_cpu_time_ns (void);
+
+G_END_DECLS
+
+#endif /* __BENCH_H__ */
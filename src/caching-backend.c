@@ -0,0 +1,341 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <string.h>
+
+#define G_SETTINGS_ENABLE_BACKEND
+#include <gio/gsettingsbackend.h>
+
+#include "caching-backend.h"
+#include "emulated-registry-backend.h"
+
+typedef struct _CachingBackend CachingBackend;
+
+struct _CachingBackend {
+  GSettingsBackend  parent_instance;
+
+  GSettingsBackend *backend;
+
+  GMutex            lock;
+  GHashTable       *cache;        /* key -> GVariant, or NULL if unset */
+  guint             generation;   /* bumped by every invalidation */
+
+  guint             changed_id;   /* our listener on an emulated backend */
+  GHashTable       *subscribed;   /* path -> number of subscriptions */
+};
+
+typedef GSettingsBackendClass CachingBackendClass;
+
+G_DEFINE_TYPE (CachingBackend, caching_backend, G_TYPE_SETTINGS_BACKEND)
+
+#define BACKEND_CLASS(_b)  G_SETTINGS_BACKEND_GET_CLASS (_b)
+
+static void
+variant_unref0 (gpointer value)
+{
+  if (value != NULL)
+    g_variant_unref (value);
+}
+
+static gboolean
+key_has_prefix (gpointer key,
+                gpointer value,
+                gpointer user_data)
+{
+  return g_str_has_prefix (key, user_data);
+}
+
+/* Must be called with the lock held */
+static void
+invalidate_locked (CachingBackend *self,
+                   const gchar    *path_or_key)
+{
+  if (g_str_has_suffix (path_or_key, "/"))
+    g_hash_table_foreach_remove (self->cache, key_has_prefix, (gpointer) path_or_key);
+  else
+    g_hash_table_remove (self->cache, path_or_key);
+
+  self->generation++;
+}
+
+void
+caching_backend_invalidate (GSettingsBackend *backend,
+                            const gchar      *path_or_key)
+{
+  CachingBackend *self = (CachingBackend *) backend;
+
+  g_return_if_fail (G_TYPE_CHECK_INSTANCE_TYPE (backend, CACHING_TYPE_BACKEND));
+
+  g_mutex_lock (&self->lock);
+  invalidate_locked (self, path_or_key);
+  g_mutex_unlock (&self->lock);
+}
+
+/* Must be called with the lock held. A backend that tells us about
+ * external changes only does so for subscribed paths, so nothing else may
+ * be kept. */
+static gboolean
+is_watched_locked (CachingBackend *self,
+                   const gchar    *key)
+{
+  gchar *path;
+  gboolean watched;
+
+  if (self->changed_id == 0)
+    return TRUE;
+
+  path = g_strndup (key, strrchr (key, '/') + 1 - key);
+  watched = g_hash_table_contains (self->subscribed, path);
+  g_free (path);
+
+  return watched;
+}
+
+static GVariant *
+caching_backend_read (GSettingsBackend   *backend,
+                      const gchar        *key,
+                      const GVariantType *expected_type,
+                      gboolean            default_value)
+{
+  CachingBackend *self = (CachingBackend *) backend;
+  gpointer value;
+  guint generation;
+
+  if (default_value)
+    return BACKEND_CLASS (self->backend)->read (self->backend, key, expected_type, TRUE);
+
+  g_mutex_lock (&self->lock);
+
+  if (g_hash_table_lookup_extended (self->cache, key, NULL, &value) &&
+      (value == NULL || g_variant_is_of_type (value, expected_type)))
+    {
+      if (value != NULL)
+        g_variant_ref (value);
+      g_mutex_unlock (&self->lock);
+
+      return value;
+    }
+
+  generation = self->generation;
+  g_mutex_unlock (&self->lock);
+
+  value = BACKEND_CLASS (self->backend)->read (self->backend, key, expected_type, FALSE);
+  if (value != NULL)
+    g_variant_ref_sink (value);
+
+  /* If anything was invalidated meanwhile, what we read may be stale
+   * already, so don't keep it */
+  g_mutex_lock (&self->lock);
+  if (generation == self->generation && is_watched_locked (self, key))
+    g_hash_table_insert (self->cache, g_strdup (key),
+                         value != NULL ? g_variant_ref (value) : NULL);
+  g_mutex_unlock (&self->lock);
+
+  return value;
+}
+
+static gboolean
+caching_backend_write (GSettingsBackend *backend,
+                       const gchar      *key,
+                       GVariant         *value,
+                       gpointer          origin_tag)
+{
+  CachingBackend *self = (CachingBackend *) backend;
+  gboolean success;
+
+  /* Invalidating afterwards also stops a read that overlapped the write
+   * from caching the old value */
+  success = BACKEND_CLASS (self->backend)->write (self->backend, key, value, origin_tag);
+  caching_backend_invalidate (backend, key);
+
+  if (success)
+    g_settings_backend_changed (backend, key, origin_tag);
+
+  return success;
+}
+
+static gboolean
+invalidate_func (gpointer key,
+                 gpointer value,
+                 gpointer user_data)
+{
+  invalidate_locked (user_data, key);
+
+  return FALSE;
+}
+
+static gboolean
+caching_backend_write_tree (GSettingsBackend *backend,
+                            GTree            *tree,
+                            gpointer          origin_tag)
+{
+  CachingBackend *self = (CachingBackend *) backend;
+  gboolean success;
+
+  success = BACKEND_CLASS (self->backend)->write_tree (self->backend, tree, origin_tag);
+
+  g_mutex_lock (&self->lock);
+  g_tree_foreach (tree, invalidate_func, self);
+  g_mutex_unlock (&self->lock);
+
+  g_settings_backend_changed_tree (backend, tree, origin_tag);
+
+  return success;
+}
+
+static void
+caching_backend_reset (GSettingsBackend *backend,
+                       const gchar      *key,
+                       gpointer          origin_tag)
+{
+  CachingBackend *self = (CachingBackend *) backend;
+
+  BACKEND_CLASS (self->backend)->reset (self->backend, key, origin_tag);
+  caching_backend_invalidate (backend, key);
+
+  g_settings_backend_changed (backend, key, origin_tag);
+}
+
+static gboolean
+caching_backend_get_writable (GSettingsBackend *backend,
+                              const gchar      *key)
+{
+  CachingBackend *self = (CachingBackend *) backend;
+
+  return BACKEND_CLASS (self->backend)->get_writable (self->backend, key);
+}
+
+static void
+caching_backend_subscribe (GSettingsBackend *backend,
+                           const gchar      *name)
+{
+  CachingBackend *self = (CachingBackend *) backend;
+  guint count;
+
+  g_mutex_lock (&self->lock);
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (self->subscribed, name));
+  g_hash_table_insert (self->subscribed, g_strdup (name), GUINT_TO_POINTER (count + 1));
+  g_mutex_unlock (&self->lock);
+
+  BACKEND_CLASS (self->backend)->subscribe (self->backend, name);
+}
+
+static void
+caching_backend_unsubscribe (GSettingsBackend *backend,
+                             const gchar      *name)
+{
+  CachingBackend *self = (CachingBackend *) backend;
+  guint count;
+
+  /* Once nothing watches the path we would not hear of changes to it */
+  g_mutex_lock (&self->lock);
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (self->subscribed, name));
+  if (count > 1)
+    g_hash_table_insert (self->subscribed, g_strdup (name), GUINT_TO_POINTER (count - 1));
+  else
+    {
+      g_hash_table_remove (self->subscribed, name);
+      invalidate_locked (self, name);
+    }
+  g_mutex_unlock (&self->lock);
+
+  BACKEND_CLASS (self->backend)->unsubscribe (self->backend, name);
+}
+
+static void
+caching_backend_sync (GSettingsBackend *backend)
+{
+  CachingBackend *self = (CachingBackend *) backend;
+
+  if (BACKEND_CLASS (self->backend)->sync != NULL)
+    BACKEND_CLASS (self->backend)->sync (self->backend);
+}
+
+#ifndef G_OS_WIN32
+/* Someone changed the registry behind our back */
+static void
+backend_changed (GSettingsBackend *backend,
+                 const gchar      *path_or_key,
+                 gpointer          user_data)
+{
+  GSettingsBackend *cache = user_data;
+
+  caching_backend_invalidate (cache, path_or_key);
+
+  if (g_str_has_suffix (path_or_key, "/"))
+    g_settings_backend_path_changed (cache, path_or_key, NULL);
+  else
+    g_settings_backend_changed (cache, path_or_key, NULL);
+}
+#endif
+
+static void
+caching_backend_finalize (GObject *object)
+{
+  CachingBackend *self = (CachingBackend *) object;
+
+#ifndef G_OS_WIN32
+  if (self->changed_id != 0)
+    emulated_registry_backend_remove_changed_func (self->backend, self->changed_id);
+#endif
+
+  g_hash_table_unref (self->subscribed);
+  g_hash_table_unref (self->cache);
+  g_object_unref (self->backend);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (caching_backend_parent_class)->finalize (object);
+}
+
+static void
+caching_backend_init (CachingBackend *self)
+{
+  g_mutex_init (&self->lock);
+  self->cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, variant_unref0);
+  self->subscribed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static void
+caching_backend_class_init (CachingBackendClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+
+  object_class->finalize = caching_backend_finalize;
+
+  class->read = caching_backend_read;
+  class->write = caching_backend_write;
+  class->write_tree = caching_backend_write_tree;
+  class->reset = caching_backend_reset;
+  class->get_writable = caching_backend_get_writable;
+  class->subscribe = caching_backend_subscribe;
+  class->unsubscribe = caching_backend_unsubscribe;
+  class->sync = caching_backend_sync;
+}
+
+GSettingsBackend *
+caching_backend_new (GSettingsBackend *backend)
+{
+  CachingBackend *self;
+
+  g_return_val_if_fail (G_IS_SETTINGS_BACKEND (backend), NULL);
+
+  self = g_object_new (CACHING_TYPE_BACKEND, NULL);
+  self->backend = g_object_ref (backend);
+
+#ifndef G_OS_WIN32
+  if (G_TYPE_CHECK_INSTANCE_TYPE (backend, EMULATED_TYPE_REGISTRY_BACKEND))
+    self->changed_id = emulated_registry_backend_add_changed_func (backend, backend_changed, self);
+#endif
+
+  return G_SETTINGS_BACKEND (self);
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <gio/gio.h>
+
+#ifndef __CACHING_BACKEND_H__
+#define __CACHING_BACKEND_H__
+
+G_BEGIN_DECLS
+
+#define CACHING_TYPE_BACKEND  (caching_backend_get_type ())
+
+GType             caching_backend_get_type   (void);
+
+/* A GSettingsBackend which remembers every value it reads from @backend,
+ * so that reading a key again does not go to storage or parse anything.
+ *
+ * Entries are dropped when the key is written through the cache, and when
+ * @backend is an emulated registry backend, also when the registry is
+ * changed from outside. That backend only reports changes to paths some
+ * GSettings is subscribed to, so for it only keys on those paths are kept.
+ * Other backends give us no way to hear about external changes, so call
+ * caching_backend_invalidate() for those. */
+GSettingsBackend *caching_backend_new        (GSettingsBackend *backend);
+
+/* @path_or_key is either a key, or a path ending in '/' to drop everything
+ * below it */
+void              caching_backend_invalidate (GSettingsBackend *backend,
+                                              const gchar      *path_or_key);
+
+G_END_DECLS
+
+#endif /* __CACHING_BACKEND_H__ */
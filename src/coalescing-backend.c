@@ -0,0 +1,300 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <string.h>
+
+#define G_SETTINGS_ENABLE_BACKEND
+#include <gio/gsettingsbackend.h>
+
+#include "coalescing-backend.h"
+
+typedef struct _CoalescingBackend CoalescingBackend;
+
+struct _CoalescingBackend {
+  GSettingsBackend  parent_instance;
+
+  GSettingsBackend *backend;
+  guint             flush_interval_ms;
+
+  GMutex            lock;
+  GTree            *pending;        /* key -> GVariant, or NULL to reset */
+  GSource          *flush_source;
+};
+
+typedef GSettingsBackendClass CoalescingBackendClass;
+
+G_DEFINE_TYPE (CoalescingBackend, coalescing_backend, G_TYPE_SETTINGS_BACKEND)
+
+#define BACKEND_CLASS(_b)  G_SETTINGS_BACKEND_GET_CLASS (_b)
+
+static void
+variant_unref0 (gpointer value)
+{
+  if (value != NULL)
+    g_variant_unref (value);
+}
+
+static GTree *
+pending_tree_new (void)
+{
+  return g_tree_new_full ((GCompareDataFunc) strcmp, NULL,
+                          g_free, variant_unref0);
+}
+
+/* Takes the pending writes and hands them to the real backend. Writes
+ * that arrive meanwhile start a new batch. */
+void
+coalescing_backend_flush (GSettingsBackend *backend)
+{
+  CoalescingBackend *self = (CoalescingBackend *) backend;
+  GTree *pending;
+
+  g_return_if_fail (G_TYPE_CHECK_INSTANCE_TYPE (backend, COALESCING_TYPE_BACKEND));
+
+  g_mutex_lock (&self->lock);
+
+  pending = self->pending;
+  self->pending = pending_tree_new ();
+
+  if (self->flush_source != NULL)
+    {
+      g_source_destroy (self->flush_source);
+      g_source_unref (self->flush_source);
+      self->flush_source = NULL;
+    }
+
+  g_mutex_unlock (&self->lock);
+
+  if (g_tree_nnodes (pending) > 0 &&
+      !BACKEND_CLASS (self->backend)->write_tree (self->backend, pending, self))
+    g_warning ("Could not write %d coalesced settings", g_tree_nnodes (pending));
+
+  g_tree_unref (pending);
+}
+
+static gboolean
+flush_cb (gpointer user_data)
+{
+  coalescing_backend_flush (user_data);
+
+  return FALSE;
+}
+
+/* Must be called with the lock held */
+static void
+schedule_flush (CoalescingBackend *self)
+{
+  if (self->flush_source != NULL)
+    return;
+
+  if (self->flush_interval_ms == 0)
+    self->flush_source = g_idle_source_new ();
+  else
+    self->flush_source = g_timeout_source_new (self->flush_interval_ms);
+
+  /* The source keeps us alive, so dropping the backend with writes still
+   * pending does not lose them */
+  g_source_set_callback (self->flush_source, flush_cb,
+                         g_object_ref (self), g_object_unref);
+  g_source_attach (self->flush_source, NULL);
+}
+
+static GVariant *
+coalescing_backend_read (GSettingsBackend   *backend,
+                         const gchar        *key,
+                         const GVariantType *expected_type,
+                         gboolean            default_value)
+{
+  CoalescingBackend *self = (CoalescingBackend *) backend;
+  gpointer value;
+  gboolean found;
+
+  if (!default_value)
+    {
+      g_mutex_lock (&self->lock);
+      found = g_tree_lookup_extended (self->pending, key, NULL, &value);
+      if (found && value != NULL)
+        value = g_variant_is_of_type (value, expected_type) ? g_variant_ref (value) : NULL;
+      g_mutex_unlock (&self->lock);
+
+      if (found)
+        return value;
+    }
+
+  return BACKEND_CLASS (self->backend)->read (self->backend, key, expected_type,
+                                              default_value);
+}
+
+/* Must be called with the lock held. Takes a reference to @value. */
+static void
+add_pending (CoalescingBackend *self,
+             const gchar       *key,
+             GVariant          *value)
+{
+  if (value != NULL)
+    g_variant_ref_sink (value);
+
+  g_tree_insert (self->pending, g_strdup (key), value);
+  schedule_flush (self);
+}
+
+static gboolean
+coalescing_backend_write (GSettingsBackend *backend,
+                          const gchar      *key,
+                          GVariant         *value,
+                          gpointer          origin_tag)
+{
+  CoalescingBackend *self = (CoalescingBackend *) backend;
+
+  g_mutex_lock (&self->lock);
+  add_pending (self, key, value);
+  g_mutex_unlock (&self->lock);
+
+  g_settings_backend_changed (backend, key, origin_tag);
+
+  return TRUE;
+}
+
+static gboolean
+add_pending_func (gpointer key,
+                  gpointer value,
+                  gpointer user_data)
+{
+  add_pending (user_data, key, value);
+
+  return FALSE;
+}
+
+static gboolean
+coalescing_backend_write_tree (GSettingsBackend *backend,
+                               GTree            *tree,
+                               gpointer          origin_tag)
+{
+  CoalescingBackend *self = (CoalescingBackend *) backend;
+
+  g_mutex_lock (&self->lock);
+  g_tree_foreach (tree, add_pending_func, self);
+  g_mutex_unlock (&self->lock);
+
+  g_settings_backend_changed_tree (backend, tree, origin_tag);
+
+  return TRUE;
+}
+
+static void
+coalescing_backend_reset (GSettingsBackend *backend,
+                          const gchar      *key,
+                          gpointer          origin_tag)
+{
+  CoalescingBackend *self = (CoalescingBackend *) backend;
+
+  g_mutex_lock (&self->lock);
+  add_pending (self, key, NULL);
+  g_mutex_unlock (&self->lock);
+
+  g_settings_backend_changed (backend, key, origin_tag);
+}
+
+static gboolean
+coalescing_backend_get_writable (GSettingsBackend *backend,
+                                 const gchar      *key)
+{
+  CoalescingBackend *self = (CoalescingBackend *) backend;
+
+  return BACKEND_CLASS (self->backend)->get_writable (self->backend, key);
+}
+
+/* GIO has no public way to listen to another backend's notifications, so
+ * changes made to @backend behind our back are not passed on; subscribing
+ * still lets it keep any caches of its own up to date */
+static void
+coalescing_backend_subscribe (GSettingsBackend *backend,
+                              const gchar      *name)
+{
+  CoalescingBackend *self = (CoalescingBackend *) backend;
+
+  BACKEND_CLASS (self->backend)->subscribe (self->backend, name);
+}
+
+static void
+coalescing_backend_unsubscribe (GSettingsBackend *backend,
+                                const gchar      *name)
+{
+  CoalescingBackend *self = (CoalescingBackend *) backend;
+
+  BACKEND_CLASS (self->backend)->unsubscribe (self->backend, name);
+}
+
+static void
+coalescing_backend_sync (GSettingsBackend *backend)
+{
+  CoalescingBackend *self = (CoalescingBackend *) backend;
+
+  coalescing_backend_flush (backend);
+
+  if (BACKEND_CLASS (self->backend)->sync != NULL)
+    BACKEND_CLASS (self->backend)->sync (self->backend);
+}
+
+static void
+coalescing_backend_finalize (GObject *object)
+{
+  CoalescingBackend *self = (CoalescingBackend *) object;
+
+  /* No flush can be scheduled, it would be holding a reference */
+  coalescing_backend_flush (G_SETTINGS_BACKEND (self));
+
+  g_tree_unref (self->pending);
+  g_object_unref (self->backend);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (coalescing_backend_parent_class)->finalize (object);
+}
+
+static void
+coalescing_backend_init (CoalescingBackend *self)
+{
+  g_mutex_init (&self->lock);
+  self->pending = pending_tree_new ();
+}
+
+static void
+coalescing_backend_class_init (CoalescingBackendClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+
+  object_class->finalize = coalescing_backend_finalize;
+
+  class->read = coalescing_backend_read;
+  class->write = coalescing_backend_write;
+  class->write_tree = coalescing_backend_write_tree;
+  class->reset = coalescing_backend_reset;
+  class->get_writable = coalescing_backend_get_writable;
+  class->subscribe = coalescing_backend_subscribe;
+  class->unsubscribe = coalescing_backend_unsubscribe;
+  class->sync = coalescing_backend_sync;
+}
+
+GSettingsBackend *
+coalescing_backend_new (GSettingsBackend *backend,
+                        guint             flush_interval_ms)
+{
+  CoalescingBackend *self;
+
+  g_return_val_if_fail (G_IS_SETTINGS_BACKEND (backend), NULL);
+
+  self = g_object_new (COALESCING_TYPE_BACKEND, NULL);
+  self->backend = g_object_ref (backend);
+  self->flush_interval_ms = flush_interval_ms;
+
+  return G_SETTINGS_BACKEND (self);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <gio/gio.h>
+
+#ifndef __COALESCING_BACKEND_H__
+#define __COALESCING_BACKEND_H__
+
+G_BEGIN_DECLS
+
+#define COALESCING_TYPE_BACKEND  (coalescing_backend_get_type ())
+
+GType             coalescing_backend_get_type (void);
+
+/* A GSettingsBackend which holds on to writes and passes only the latest
+ * value of each key on to @backend, in one write_tree() call. Pending
+ * writes are flushed from the default main context when it is next idle,
+ * or @flush_interval_ms after the first of them if that is not 0. */
+GSettingsBackend *coalescing_backend_new      (GSettingsBackend *backend,
+                                               guint             flush_interval_ms);
+
+void              coalescing_backend_flush    (GSettingsBackend *backend);
+
+G_END_DECLS
+
+#endif /* __COALESCING_BACKEND_H__ */
@@ -0,0 +1,232 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <string.h>
+
+#define G_SETTINGS_ENABLE_BACKEND
+#include <gio/gsettingsbackend.h>
+
+#include "dedup-backend.h"
+
+typedef struct _DedupBackend DedupBackend;
+
+struct _DedupBackend {
+  GSettingsBackend  parent_instance;
+
+  GSettingsBackend *backend;
+};
+
+typedef GSettingsBackendClass DedupBackendClass;
+
+G_DEFINE_TYPE (DedupBackend, dedup_backend, G_TYPE_SETTINGS_BACKEND)
+
+#define BACKEND_CLASS(_b)  G_SETTINGS_BACKEND_GET_CLASS (_b)
+
+/* Whether @key already holds @value. Resets are never dropped: without
+ * knowing the key's type we cannot read what is stored. */
+static gboolean
+value_is_stored (DedupBackend *self,
+                 const gchar  *key,
+                 GVariant     *value)
+{
+  GVariant *stored;
+  gboolean same;
+  gsize size;
+
+  if (value == NULL)
+    return FALSE;
+
+  stored = BACKEND_CLASS (self->backend)->read (self->backend, key,
+                                                g_variant_get_type (value),
+                                                FALSE);
+  if (stored == NULL)
+    return FALSE;
+
+  g_variant_ref_sink (stored);
+
+  size = g_variant_get_size (value);
+  same = g_variant_get_size (stored) == size &&
+         memcmp (g_variant_get_data (stored), g_variant_get_data (value), size) == 0;
+
+  g_variant_unref (stored);
+
+  return same;
+}
+
+static GVariant *
+dedup_backend_read (GSettingsBackend   *backend,
+                    const gchar        *key,
+                    const GVariantType *expected_type,
+                    gboolean            default_value)
+{
+  DedupBackend *self = (DedupBackend *) backend;
+
+  return BACKEND_CLASS (self->backend)->read (self->backend, key, expected_type,
+                                              default_value);
+}
+
+static gboolean
+dedup_backend_write (GSettingsBackend *backend,
+                     const gchar      *key,
+                     GVariant         *value,
+                     gpointer          origin_tag)
+{
+  DedupBackend *self = (DedupBackend *) backend;
+
+  if (value_is_stored (self, key, value))
+    return TRUE;
+
+  if (!BACKEND_CLASS (self->backend)->write (self->backend, key, value, origin_tag))
+    return FALSE;
+
+  g_settings_backend_changed (backend, key, origin_tag);
+
+  return TRUE;
+}
+
+typedef struct {
+  DedupBackend *backend;
+  GTree        *changed;
+} FilterTreeData;
+
+static gboolean
+filter_tree_func (gpointer key,
+                  gpointer value,
+                  gpointer user_data)
+{
+  FilterTreeData *data = user_data;
+
+  if (!value_is_stored (data->backend, key, value))
+    g_tree_insert (data->changed, key, value);
+
+  return FALSE;
+}
+
+static gboolean
+dedup_backend_write_tree (GSettingsBackend *backend,
+                          GTree            *tree,
+                          gpointer          origin_tag)
+{
+  DedupBackend *self = (DedupBackend *) backend;
+  FilterTreeData data;
+  gboolean success = TRUE;
+
+  /* The filtered tree borrows its keys and values from @tree */
+  data.backend = self;
+  data.changed = g_tree_new ((GCompareFunc) strcmp);
+  g_tree_foreach (tree, filter_tree_func, &data);
+
+  if (g_tree_nnodes (data.changed) > 0)
+    {
+      success = BACKEND_CLASS (self->backend)->write_tree (self->backend, data.changed,
+                                                           origin_tag);
+      if (success)
+        g_settings_backend_changed_tree (backend, data.changed, origin_tag);
+    }
+
+  g_tree_unref (data.changed);
+
+  return success;
+}
+
+static void
+dedup_backend_reset (GSettingsBackend *backend,
+                     const gchar      *key,
+                     gpointer          origin_tag)
+{
+  DedupBackend *self = (DedupBackend *) backend;
+
+  BACKEND_CLASS (self->backend)->reset (self->backend, key, origin_tag);
+
+  g_settings_backend_changed (backend, key, origin_tag);
+}
+
+static gboolean
+dedup_backend_get_writable (GSettingsBackend *backend,
+                            const gchar      *key)
+{
+  DedupBackend *self = (DedupBackend *) backend;
+
+  return BACKEND_CLASS (self->backend)->get_writable (self->backend, key);
+}
+
+static void
+dedup_backend_subscribe (GSettingsBackend *backend,
+                         const gchar      *name)
+{
+  DedupBackend *self = (DedupBackend *) backend;
+
+  BACKEND_CLASS (self->backend)->subscribe (self->backend, name);
+}
+
+static void
+dedup_backend_unsubscribe (GSettingsBackend *backend,
+                           const gchar      *name)
+{
+  DedupBackend *self = (DedupBackend *) backend;
+
+  BACKEND_CLASS (self->backend)->unsubscribe (self->backend, name);
+}
+
+static void
+dedup_backend_sync (GSettingsBackend *backend)
+{
+  DedupBackend *self = (DedupBackend *) backend;
+
+  if (BACKEND_CLASS (self->backend)->sync != NULL)
+    BACKEND_CLASS (self->backend)->sync (self->backend);
+}
+
+static void
+dedup_backend_finalize (GObject *object)
+{
+  DedupBackend *self = (DedupBackend *) object;
+
+  g_object_unref (self->backend);
+
+  G_OBJECT_CLASS (dedup_backend_parent_class)->finalize (object);
+}
+
+static void
+dedup_backend_init (DedupBackend *self)
+{
+}
+
+static void
+dedup_backend_class_init (DedupBackendClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+
+  object_class->finalize = dedup_backend_finalize;
+
+  class->read = dedup_backend_read;
+  class->write = dedup_backend_write;
+  class->write_tree = dedup_backend_write_tree;
+  class->reset = dedup_backend_reset;
+  class->get_writable = dedup_backend_get_writable;
+  class->subscribe = dedup_backend_subscribe;
+  class->unsubscribe = dedup_backend_unsubscribe;
+  class->sync = dedup_backend_sync;
+}
+
+GSettingsBackend *
+dedup_backend_new (GSettingsBackend *backend)
+{
+  DedupBackend *self;
+
+  g_return_val_if_fail (G_IS_SETTINGS_BACKEND (backend), NULL);
+
+  self = g_object_new (DEDUP_TYPE_BACKEND, NULL);
+  self->backend = g_object_ref (backend);
+
+  return G_SETTINGS_BACKEND (self);
+}
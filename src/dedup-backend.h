@@ -0,0 +1,33 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <gio/gio.h>
+
+#ifndef __DEDUP_BACKEND_H__
+#define __DEDUP_BACKEND_H__
+
+G_BEGIN_DECLS
+
+#define DEDUP_TYPE_BACKEND  (dedup_backend_get_type ())
+
+GType             dedup_backend_get_type (void);
+
+/* A GSettingsBackend which drops writes that would store the value a key
+ * already has in @backend, byte for byte, so that they cost no I/O and
+ * emit no "changed" signal. Wrapping a caching backend makes the
+ * comparison cheap. As with the coalescing backend, changes made to
+ * @backend by other means are not passed on. */
+GSettingsBackend *dedup_backend_new      (GSettingsBackend *backend);
+
+G_END_DECLS
+
+#endif /* __DEDUP_BACKEND_H__ */
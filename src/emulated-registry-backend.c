@@ -0,0 +1,774 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <string.h>
+
+#define G_SETTINGS_ENABLE_BACKEND
+#include <gio/gsettingsbackend.h>
+
+#include "emulated-registry-backend.h"
+#include "registry-emulator.h"
+#include "watch-mux.h"
+
+#ifndef G_OS_WIN32
+
+#define BASE_KEY_PATH "Software\\GSettings"
+
+typedef struct _EmulatedRegistryBackend EmulatedRegistryBackend;
+
+struct _EmulatedRegistryBackend {
+  GSettingsBackend  parent_instance;
+
+  /* Rather than one registry watch per subscribed path, there is a single
+   * one at the root of everything subscribed, and the changes it reports
+   * are routed to the subscribed paths they affect */
+  GMutex            lock;
+  WatchMux         *subscriptions;
+  gchar            *watch_root;      /* GSettings path */
+  guint             watch_id;
+
+  /* Updated atomically, see EmulatedRegistryBackendStats */
+  gint              n_reads;
+  gint              n_writes;
+  gint              n_tree_writes;
+  gint              n_resets;
+  gint              n_values_written;
+
+  /* Listeners for external changes. They are called without the lock, so
+   * that they can add and remove listeners themselves. */
+  GMutex            listeners_lock;
+  GPtrArray        *listeners;       /* ChangedListener */
+  guint             last_listener_id;
+
+  gboolean          binary_values;
+};
+
+typedef struct {
+  guint                              id;
+  EmulatedRegistryBackendChangedFunc func;
+  GWeakRef                           owner;
+} ChangedListener;
+
+static void
+changed_listener_free (ChangedListener *listener)
+{
+  g_weak_ref_clear (&listener->owner);
+  g_slice_free (ChangedListener, listener);
+}
+
+typedef GSettingsBackendClass EmulatedRegistryBackendClass;
+
+G_DEFINE_TYPE (EmulatedRegistryBackend, emulated_registry_backend, G_TYPE_SETTINGS_BACKEND)
+
+/* Set while this thread is writing on behalf of a backend, so that the
+ * notification for our own write is not reported a second time */
+static GPrivate backend_writing;
+
+/* Splits "/tests/storage/string" into "Software\GSettings\tests\storage"
+ * and "string". @path_or_key may also be a path ending in '/', in which
+ * case @value_name is set to "". */
+static gunichar2 *
+key_to_registry_path (const gchar  *path_or_key,
+                      gunichar2   **value_name)
+{
+  const gchar *last_slash;
+  gchar *path, *registry_path;
+  gunichar2 *result;
+
+  last_slash = strrchr (path_or_key, '/');
+  g_assert (last_slash != NULL);
+
+  path = g_strndup (path_or_key, last_slash - path_or_key);
+  g_strdelimit (path, "/", '\\');
+  registry_path = g_strconcat (BASE_KEY_PATH, path, NULL);
+
+  result = g_utf8_to_utf16 (registry_path, -1, NULL, NULL, NULL);
+  if (value_name != NULL)
+    *value_name = g_utf8_to_utf16 (last_slash + 1, -1, NULL, NULL, NULL);
+
+  g_free (registry_path);
+  g_free (path);
+
+  return result;
+}
+
+static GVariant *
+registry_value_to_variant (DWORD               type,
+                           const BYTE         *data,
+                           DWORD               size,
+                           const GVariantType *expected_type)
+{
+  if (type == REG_DWORD && size == sizeof (DWORD))
+    {
+      DWORD dword;
+
+      memcpy (&dword, data, sizeof (DWORD));
+
+      switch (g_variant_type_peek_string (expected_type)[0])
+        {
+          case 'b': return g_variant_new_boolean (dword != 0);
+          case 'y': return g_variant_new_byte ((guchar) dword);
+          case 'n': return g_variant_new_int16 ((gint16) dword);
+          case 'q': return g_variant_new_uint16 ((guint16) dword);
+          case 'i': return g_variant_new_int32 ((gint32) dword);
+          case 'u': return g_variant_new_uint32 (dword);
+          default:  return NULL;
+        }
+    }
+  else if (type == REG_QWORD && size == sizeof (guint64))
+    {
+      guint64 qword;
+
+      memcpy (&qword, data, sizeof (guint64));
+
+      switch (g_variant_type_peek_string (expected_type)[0])
+        {
+          case 'x': return g_variant_new_int64 ((gint64) qword);
+          case 't': return g_variant_new_uint64 (qword);
+          default:  return NULL;
+        }
+    }
+  else if (type == REG_BINARY)
+    {
+      const gchar *type_string = (const gchar *) data;
+      gsize type_len, offset;
+      GBytes *bytes;
+      GVariant *result;
+
+      /* See set_binary_value() */
+      type_len = strnlen (type_string, size);
+      if (type_len == size ||
+          !g_variant_type_string_is_valid (type_string) ||
+          !g_variant_type_equal ((const GVariantType *) type_string, expected_type))
+        return NULL;
+
+      offset = (type_len + 8) & ~(gsize) 7;
+      if (offset > size)
+        return NULL;
+
+      bytes = g_bytes_new (data + offset, size - offset);
+      result = g_variant_new_from_bytes (expected_type, bytes, FALSE);
+      g_bytes_unref (bytes);
+
+      return result;
+    }
+  else if (type == REG_SZ)
+    {
+      const gunichar2 *chars = (const gunichar2 *) data;
+      glong n_chars = size / sizeof (gunichar2);
+      GVariant *result;
+      gchar *string;
+
+      /* The stored length may or may not include the terminator */
+      while (n_chars > 0 && chars[n_chars - 1] == 0)
+        n_chars--;
+
+      string = g_utf16_to_utf8 (chars, n_chars, NULL, NULL, NULL);
+      if (string == NULL)
+        return NULL;
+
+      if (g_variant_type_equal (expected_type, G_VARIANT_TYPE_STRING))
+        result = g_variant_new_string (string);
+      else
+        result = g_variant_parse (expected_type, string, NULL, NULL, NULL);
+
+      g_free (string);
+
+      return result;
+    }
+
+  return NULL;
+}
+
+static GVariant *
+emulated_registry_backend_read (GSettingsBackend   *backend,
+                                const gchar        *key,
+                                const GVariantType *expected_type,
+                                gboolean            default_value)
+{
+  gunichar2 *path, *value_name;
+  BYTE buffer[256], *data;
+  DWORD type, size;
+  GVariant *result = NULL;
+  HKEY hkey;
+  LONG status;
+
+  if (default_value)
+    return NULL;
+
+  g_atomic_int_inc (&((EmulatedRegistryBackend *) backend)->n_reads);
+
+  path = key_to_registry_path (key, &value_name);
+
+  if (RegOpenKeyExW (HKEY_CURRENT_USER, path, 0, KEY_READ, &hkey) == ERROR_SUCCESS)
+    {
+      data = buffer;
+      size = sizeof (buffer);
+      status = RegQueryValueExW (hkey, value_name, NULL, &type, data, &size);
+
+      if (status == ERROR_MORE_DATA)
+        {
+          data = g_malloc (size);
+          status = RegQueryValueExW (hkey, value_name, NULL, &type, data, &size);
+        }
+
+      if (status == ERROR_SUCCESS)
+        result = registry_value_to_variant (type, data, size, expected_type);
+
+      if (data != buffer)
+        g_free (data);
+
+      RegCloseKey (hkey);
+    }
+
+  g_free (value_name);
+  g_free (path);
+
+  return result;
+}
+
+/* Stores @value serialized, tagged with its type string, which is
+ * NUL-terminated and padded to 8 bytes so that the data after it is
+ * aligned for GVariant */
+static LONG
+set_binary_value (HKEY             hkey,
+                  const gunichar2 *value_name,
+                  GVariant        *value)
+{
+  const gchar *type_string = g_variant_get_type_string (value);
+  gsize type_len, offset, data_size;
+  BYTE *data;
+  LONG status;
+
+  type_len = strlen (type_string);
+  offset = (type_len + 8) & ~(gsize) 7;
+  data_size = g_variant_get_size (value);
+
+  data = g_malloc0 (offset + data_size);
+  memcpy (data, type_string, type_len);
+  g_variant_store (value, data + offset);
+
+  status = RegSetValueExW (hkey, value_name, 0, REG_BINARY, data, offset + data_size);
+  g_free (data);
+
+  return status;
+}
+
+static gboolean
+write_value (EmulatedRegistryBackend *self,
+             const gchar             *key,
+             GVariant                *value)
+{
+  gunichar2 *path, *value_name, *string;
+  const gchar *type_string;
+  glong n_chars;
+  HKEY hkey;
+  LONG status;
+
+  path = key_to_registry_path (key, &value_name);
+  status = RegCreateKeyExW (HKEY_CURRENT_USER, path, 0, NULL, 0, KEY_ALL_ACCESS,
+                            NULL, &hkey, NULL);
+  g_free (path);
+
+  if (status != ERROR_SUCCESS)
+    {
+      g_free (value_name);
+      return FALSE;
+    }
+
+  g_atomic_int_inc (&self->n_values_written);
+
+  if (value == NULL)
+    {
+      /* Resetting a key that was never set is not an error */
+      status = RegDeleteValueW (hkey, value_name);
+      if (status == ERROR_FILE_NOT_FOUND)
+        status = ERROR_SUCCESS;
+    }
+  else
+    {
+      type_string = g_variant_get_type_string (value);
+
+      switch (type_string[0])
+        {
+          case 'b': case 'y': case 'n': case 'q': case 'i': case 'u':
+            {
+              DWORD dword;
+
+              switch (type_string[0])
+                {
+                  case 'b': dword = g_variant_get_boolean (value); break;
+                  case 'y': dword = g_variant_get_byte (value); break;
+                  case 'n': dword = g_variant_get_int16 (value); break;
+                  case 'q': dword = g_variant_get_uint16 (value); break;
+                  case 'i': dword = g_variant_get_int32 (value); break;
+                  default:  dword = g_variant_get_uint32 (value); break;
+                }
+
+              status = RegSetValueExW (hkey, value_name, 0, REG_DWORD,
+                                       (const BYTE *) &dword, sizeof (DWORD));
+              break;
+            }
+
+          case 'x': case 't':
+            {
+              guint64 qword;
+
+              if (type_string[0] == 'x')
+                qword = g_variant_get_int64 (value);
+              else
+                qword = g_variant_get_uint64 (value);
+
+              status = RegSetValueExW (hkey, value_name, 0, REG_QWORD,
+                                       (const BYTE *) &qword, sizeof (guint64));
+              break;
+            }
+
+          default:
+            {
+              gchar *text;
+
+              if (self->binary_values && type_string[0] != 's')
+                {
+                  status = set_binary_value (hkey, value_name, value);
+                  break;
+                }
+
+              /* Strings are stored as-is, everything else as a GVariant
+               * text literal */
+              if (type_string[0] == 's')
+                text = g_variant_dup_string (value, NULL);
+              else
+                text = g_variant_print (value, FALSE);
+
+              string = g_utf8_to_utf16 (text, -1, NULL, &n_chars, NULL);
+              status = RegSetValueExW (hkey, value_name, 0, REG_SZ,
+                                       (const BYTE *) string,
+                                       (n_chars + 1) * sizeof (gunichar2));
+              g_free (string);
+              g_free (text);
+              break;
+            }
+        }
+    }
+
+  RegCloseKey (hkey);
+  g_free (value_name);
+
+  return (status == ERROR_SUCCESS);
+}
+
+static gboolean
+emulated_registry_backend_write (GSettingsBackend *backend,
+                                 const gchar      *key,
+                                 GVariant         *value,
+                                 gpointer          origin_tag)
+{
+  EmulatedRegistryBackend *self = (EmulatedRegistryBackend *) backend;
+  gboolean success;
+
+  g_atomic_int_inc (&self->n_writes);
+
+  g_private_set (&backend_writing, backend);
+  success = write_value (self, key, value);
+  g_private_set (&backend_writing, NULL);
+
+  if (success)
+    g_settings_backend_changed (backend, key, origin_tag);
+
+  return success;
+}
+
+typedef struct {
+  EmulatedRegistryBackend *backend;
+  gboolean                 success;
+} WriteTreeData;
+
+static gboolean
+write_tree_func (gpointer key,
+                 gpointer value,
+                 gpointer user_data)
+{
+  WriteTreeData *data = user_data;
+
+  if (!write_value (data->backend, key, value))
+    data->success = FALSE;
+
+  return FALSE;
+}
+
+static gboolean
+emulated_registry_backend_write_tree (GSettingsBackend *backend,
+                                      GTree            *tree,
+                                      gpointer          origin_tag)
+{
+  WriteTreeData data = { (EmulatedRegistryBackend *) backend, TRUE };
+
+  g_atomic_int_inc (&data.backend->n_tree_writes);
+
+  g_private_set (&backend_writing, backend);
+  g_tree_foreach (tree, write_tree_func, &data);
+  g_private_set (&backend_writing, NULL);
+
+  g_settings_backend_changed_tree (backend, tree, origin_tag);
+
+  return data.success;
+}
+
+static void
+emulated_registry_backend_reset (GSettingsBackend *backend,
+                                 const gchar      *key,
+                                 gpointer          origin_tag)
+{
+  EmulatedRegistryBackend *self = (EmulatedRegistryBackend *) backend;
+
+  g_atomic_int_inc (&self->n_resets);
+
+  g_private_set (&backend_writing, backend);
+  write_value (self, key, NULL);
+  g_private_set (&backend_writing, NULL);
+
+  g_settings_backend_changed (backend, key, origin_tag);
+}
+
+static gboolean
+emulated_registry_backend_get_writable (GSettingsBackend *backend,
+                                        const gchar      *key)
+{
+  return TRUE;
+}
+
+/* "Software\GSettings\tests\storage" -> "/tests/storage/", or NULL
+ * if @key_path is not inside BASE_KEY_PATH */
+static gchar *
+registry_path_to_path (const gchar *key_path)
+{
+  gsize base_len = strlen (BASE_KEY_PATH);
+  gchar *path;
+
+  if (g_ascii_strncasecmp (key_path, BASE_KEY_PATH, base_len) != 0 ||
+      (key_path[base_len] != '\0' && key_path[base_len] != '\\'))
+    return NULL;
+
+  path = g_strconcat (key_path + base_len, "\\", NULL);
+  g_strdelimit (path, "\\", '/');
+
+  return path;
+}
+
+static void
+collect_path (const gchar *path,
+              gpointer     user_data)
+{
+  g_ptr_array_add (user_data, g_strdup (path));
+}
+
+static void
+emit_changed (EmulatedRegistryBackend *self,
+              const gchar             *path_or_key)
+{
+  GPtrArray *funcs, *owners;
+  guint i;
+
+  /* Take a reference on each owner, so that none can go away while it is
+   * being called, then call them without the lock */
+  funcs = g_ptr_array_new ();
+  owners = g_ptr_array_new_with_free_func (g_object_unref);
+
+  g_mutex_lock (&self->listeners_lock);
+  for (i = 0; i < self->listeners->len; i++)
+    {
+      ChangedListener *listener = g_ptr_array_index (self->listeners, i);
+      GObject *owner = g_weak_ref_get (&listener->owner);
+
+      if (owner != NULL)
+        {
+          g_ptr_array_add (funcs, listener->func);
+          g_ptr_array_add (owners, owner);
+        }
+    }
+  g_mutex_unlock (&self->listeners_lock);
+
+  for (i = 0; i < funcs->len; i++)
+    ((EmulatedRegistryBackendChangedFunc) funcs->pdata[i]) (G_SETTINGS_BACKEND (self),
+                                                            path_or_key,
+                                                            owners->pdata[i]);
+
+  g_ptr_array_free (funcs, TRUE);
+  g_ptr_array_unref (owners);
+}
+
+static void
+registry_changed (RegistryEmulatorChange  change,
+                  const gchar            *key_path,
+                  const gchar            *value_name,
+                  gpointer                user_data)
+{
+  EmulatedRegistryBackend *self = user_data;
+  GSettingsBackend *backend = G_SETTINGS_BACKEND (self);
+  GPtrArray *paths;
+  gchar *path, *key;
+  guint i;
+
+  if (g_private_get (&backend_writing) == backend)
+    return;
+
+  if (change == REGISTRY_EMULATOR_KEY_CREATED ||
+      (change == REGISTRY_EMULATOR_VALUE_CHANGED && value_name[0] == '\0'))
+    return;
+
+  /* A key outside our base path can only be reported if it was one of its
+   * parents that went away */
+  path = registry_path_to_path (key_path);
+  if (path == NULL)
+    path = g_strdup ("/");
+
+  paths = g_ptr_array_new_with_free_func (g_free);
+
+  /* Values are reported to the path holding them; a deleted key affects
+   * every path inside it */
+  g_mutex_lock (&self->lock);
+  watch_mux_dispatch (self->subscriptions, path,
+                      change == REGISTRY_EMULATOR_KEY_DELETED,
+                      collect_path, paths);
+  g_mutex_unlock (&self->lock);
+
+  for (i = 0; i < paths->len; i++)
+    {
+      const gchar *subscribed = g_ptr_array_index (paths, i);
+
+      if (change == REGISTRY_EMULATOR_VALUE_CHANGED)
+        {
+          key = g_strconcat (subscribed, value_name, NULL);
+          emit_changed (self, key);
+          g_settings_backend_changed (backend, key, NULL);
+          g_free (key);
+        }
+      else
+        {
+          emit_changed (self, subscribed);
+          g_settings_backend_path_changed (backend, subscribed, NULL);
+        }
+    }
+
+  g_ptr_array_unref (paths);
+  g_free (path);
+}
+
+/* Must be called with the lock held. Moves the registry watch to the new
+ * root of the subscribed paths if that has changed. */
+static void
+update_watch (EmulatedRegistryBackend *self)
+{
+  gchar *root, *registry_path;
+  gunichar2 *pathw;
+  guint old_watch_id;
+
+  root = watch_mux_get_root (self->subscriptions);
+
+  if (g_strcmp0 (root, self->watch_root) == 0)
+    {
+      g_free (root);
+      return;
+    }
+
+  old_watch_id = self->watch_id;
+  self->watch_id = 0;
+
+  /* Add the new watch before removing the old one so no change is missed */
+  if (root != NULL)
+    {
+      pathw = key_to_registry_path (root, NULL);
+      registry_path = g_utf16_to_utf8 (pathw, -1, NULL, NULL, NULL);
+      self->watch_id = registry_emulator_watch_add (registry_path, TRUE,
+                                                    registry_changed, self);
+      g_free (registry_path);
+      g_free (pathw);
+    }
+
+  if (old_watch_id != 0)
+    registry_emulator_watch_remove (old_watch_id);
+
+  g_free (self->watch_root);
+  self->watch_root = root;
+}
+
+static void
+emulated_registry_backend_subscribe (GSettingsBackend *backend,
+                                     const gchar      *name)
+{
+  EmulatedRegistryBackend *self = (EmulatedRegistryBackend *) backend;
+
+  g_mutex_lock (&self->lock);
+
+  if (watch_mux_add (self->subscriptions, name))
+    update_watch (self);
+
+  g_mutex_unlock (&self->lock);
+}
+
+static void
+emulated_registry_backend_unsubscribe (GSettingsBackend *backend,
+                                       const gchar      *name)
+{
+  EmulatedRegistryBackend *self = (EmulatedRegistryBackend *) backend;
+
+  g_mutex_lock (&self->lock);
+
+  if (watch_mux_remove (self->subscriptions, name))
+    update_watch (self);
+
+  g_mutex_unlock (&self->lock);
+}
+
+static void
+emulated_registry_backend_finalize (GObject *object)
+{
+  EmulatedRegistryBackend *self = (EmulatedRegistryBackend *) object;
+
+  if (self->watch_id != 0)
+    registry_emulator_watch_remove (self->watch_id);
+  g_free (self->watch_root);
+  watch_mux_free (self->subscriptions);
+  g_ptr_array_unref (self->listeners);
+  g_mutex_clear (&self->listeners_lock);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (emulated_registry_backend_parent_class)->finalize (object);
+}
+
+static void
+emulated_registry_backend_init (EmulatedRegistryBackend *self)
+{
+  gunichar2 *pathw;
+  HKEY hkey;
+
+  g_mutex_init (&self->lock);
+  self->subscriptions = watch_mux_new ();
+  g_mutex_init (&self->listeners_lock);
+  self->listeners = g_ptr_array_new_with_free_func ((GDestroyNotify) changed_listener_free);
+
+  /* Like the real backend, make sure our root key exists */
+  pathw = g_utf8_to_utf16 (BASE_KEY_PATH, -1, NULL, NULL, NULL);
+  if (RegCreateKeyExW (HKEY_CURRENT_USER, pathw, 0, NULL, 0, KEY_ALL_ACCESS,
+                       NULL, &hkey, NULL) == ERROR_SUCCESS)
+    RegCloseKey (hkey);
+  g_free (pathw);
+}
+
+static void
+emulated_registry_backend_class_init (EmulatedRegistryBackendClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+
+  object_class->finalize = emulated_registry_backend_finalize;
+
+  class->read = emulated_registry_backend_read;
+  class->write = emulated_registry_backend_write;
+  class->write_tree = emulated_registry_backend_write_tree;
+  class->reset = emulated_registry_backend_reset;
+  class->get_writable = emulated_registry_backend_get_writable;
+  class->subscribe = emulated_registry_backend_subscribe;
+  class->unsubscribe = emulated_registry_backend_unsubscribe;
+}
+
+GSettingsBackend *
+emulated_registry_backend_new (void)
+{
+  return g_object_new (EMULATED_TYPE_REGISTRY_BACKEND, NULL);
+}
+
+void
+emulated_registry_backend_get_stats (GSettingsBackend             *backend,
+                                     EmulatedRegistryBackendStats *stats)
+{
+  EmulatedRegistryBackend *self = (EmulatedRegistryBackend *) backend;
+
+  g_return_if_fail (G_TYPE_CHECK_INSTANCE_TYPE (backend, EMULATED_TYPE_REGISTRY_BACKEND));
+
+  stats->n_reads = g_atomic_int_get (&self->n_reads);
+  stats->n_writes = g_atomic_int_get (&self->n_writes);
+  stats->n_tree_writes = g_atomic_int_get (&self->n_tree_writes);
+  stats->n_resets = g_atomic_int_get (&self->n_resets);
+  stats->n_values_written = g_atomic_int_get (&self->n_values_written);
+}
+
+void
+emulated_registry_backend_reset_stats (GSettingsBackend *backend)
+{
+  EmulatedRegistryBackend *self = (EmulatedRegistryBackend *) backend;
+
+  g_return_if_fail (G_TYPE_CHECK_INSTANCE_TYPE (backend, EMULATED_TYPE_REGISTRY_BACKEND));
+
+  g_atomic_int_set (&self->n_reads, 0);
+  g_atomic_int_set (&self->n_writes, 0);
+  g_atomic_int_set (&self->n_tree_writes, 0);
+  g_atomic_int_set (&self->n_resets, 0);
+  g_atomic_int_set (&self->n_values_written, 0);
+}
+
+guint
+emulated_registry_backend_add_changed_func (GSettingsBackend                   *backend,
+                                            EmulatedRegistryBackendChangedFunc  func,
+                                            gpointer                            owner)
+{
+  EmulatedRegistryBackend *self = (EmulatedRegistryBackend *) backend;
+  ChangedListener *listener;
+  guint id;
+
+  g_return_val_if_fail (G_TYPE_CHECK_INSTANCE_TYPE (backend, EMULATED_TYPE_REGISTRY_BACKEND), 0);
+  g_return_val_if_fail (func != NULL, 0);
+  g_return_val_if_fail (G_IS_OBJECT (owner), 0);
+
+  listener = g_slice_new (ChangedListener);
+  listener->func = func;
+  g_weak_ref_init (&listener->owner, owner);
+
+  g_mutex_lock (&self->listeners_lock);
+  id = listener->id = ++self->last_listener_id;
+  g_ptr_array_add (self->listeners, listener);
+  g_mutex_unlock (&self->listeners_lock);
+
+  return id;
+}
+
+void
+emulated_registry_backend_remove_changed_func (GSettingsBackend *backend,
+                                               guint             listener_id)
+{
+  EmulatedRegistryBackend *self = (EmulatedRegistryBackend *) backend;
+  guint i;
+
+  g_return_if_fail (G_TYPE_CHECK_INSTANCE_TYPE (backend, EMULATED_TYPE_REGISTRY_BACKEND));
+
+  g_mutex_lock (&self->listeners_lock);
+  for (i = 0; i < self->listeners->len; i++)
+    if (((ChangedListener *) g_ptr_array_index (self->listeners, i))->id == listener_id)
+      {
+        g_ptr_array_remove_index (self->listeners, i);
+        break;
+      }
+  g_mutex_unlock (&self->listeners_lock);
+}
+
+void
+emulated_registry_backend_set_binary_values (GSettingsBackend *backend,
+                                             gboolean          binary_values)
+{
+  EmulatedRegistryBackend *self = (EmulatedRegistryBackend *) backend;
+
+  g_return_if_fail (G_TYPE_CHECK_INSTANCE_TYPE (backend, EMULATED_TYPE_REGISTRY_BACKEND));
+
+  self->binary_values = binary_values;
+}
+
+#endif /* G_OS_WIN32 */
@@ -0,0 +1,75 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <gio/gio.h>
+
+#ifndef __EMULATED_REGISTRY_BACKEND_H__
+#define __EMULATED_REGISTRY_BACKEND_H__
+
+#ifndef G_OS_WIN32
+
+G_BEGIN_DECLS
+
+#define EMULATED_TYPE_REGISTRY_BACKEND  (emulated_registry_backend_get_type ())
+
+GType             emulated_registry_backend_get_type (void);
+
+/* A GSettingsBackend which stores its values in the registry emulator, the
+ * same way the Windows registry backend in GIO lays them out under
+ * HKEY_CURRENT_USER\Software\GSettings */
+GSettingsBackend *emulated_registry_backend_new      (void);
+
+/* How many times each part of the backend has been called, so that
+ * benchmarks can tell how much work a GSettings operation turned into */
+typedef struct {
+  guint n_reads;
+  guint n_writes;
+  guint n_tree_writes;
+  guint n_resets;
+  guint n_values_written;   /* registry values set or deleted */
+} EmulatedRegistryBackendStats;
+
+void emulated_registry_backend_get_stats   (GSettingsBackend             *backend,
+                                            EmulatedRegistryBackendStats *stats);
+void emulated_registry_backend_reset_stats (GSettingsBackend             *backend);
+
+/* Called for every change made to the registry by something other than
+ * the backend itself, with the key or, for a path ending in '/', the
+ * whole path that changed. GIO only reports these to GSettings objects,
+ * so this is how a backend wrapping this one can hear about them. */
+typedef void (*EmulatedRegistryBackendChangedFunc) (GSettingsBackend *backend,
+                                                    const gchar      *path_or_key,
+                                                    gpointer          user_data);
+
+/* Any number of listeners can be added, each removed again by the id it
+ * was given. @owner, a GObject, is passed as the user data and held for
+ * as long as @func runs; once it is gone, @func is no longer called. A
+ * change already being reported when the listener is removed may still
+ * reach it. Listeners may add and remove listeners themselves. */
+guint emulated_registry_backend_add_changed_func    (GSettingsBackend                   *backend,
+                                                     EmulatedRegistryBackendChangedFunc  func,
+                                                     gpointer                            owner);
+void  emulated_registry_backend_remove_changed_func (GSettingsBackend                   *backend,
+                                                     guint                               listener_id);
+
+/* By default, values that are not strings or integers are stored as
+ * REG_SZ text and parsed again on every read. With @binary_values set they
+ * are written as REG_BINARY in GVariant's serialized form instead, which
+ * is read back without parsing. Both forms are always readable. */
+void emulated_registry_backend_set_binary_values (GSettingsBackend *backend,
+                                                  gboolean          binary_values);
+
+G_END_DECLS
+
+#endif /* G_OS_WIN32 */
+
+#endif /* __EMULATED_REGISTRY_BACKEND_H__ */
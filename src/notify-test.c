@@ -14,14 +14,18 @@
 #include <glib.h>
 #include <gio/gio.h>
 
+#ifdef G_OS_WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <shlwapi.h>
+#endif
 
+#include "caching-backend.h"
+#include "dedup-backend.h"
 #include "utils.h"
 
 typedef struct {
-  gboolean  change_flag;
+  guint  n_changes;
   gchar *key;
 } Change;
 
@@ -34,9 +38,9 @@ single_change_handler (GSettings   *settings,
 
   /* Make sure previous change was acknowledged and
    * we are not getting spurious duplicates*/
-  g_return_if_fail (change->change_flag == FALSE);
+  g_return_if_fail (change->n_changes == 0);
 
-  change->change_flag = TRUE;
+  change->n_changes++;
   change->key = g_strdup (key);
 }
 
@@ -51,47 +55,47 @@ basic_test (gconstpointer test_data)
   gint64 int64;
 
   main_loop = g_main_loop_new (NULL, FALSE);
-  settings = g_settings_new ("org.gsettings.test.storage-test");
+  settings = util_settings_new ("org.gsettings.test.storage-test");
 
   g_signal_connect (settings, "changed", G_CALLBACK (single_change_handler), &change);
 
   /* Test simple notifications. */
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   g_settings_set_string (settings, "string", "Notify me");
-  util_main_iterate ();
+  g_assert (util_main_wait (&change.n_changes, 1));
   g_assert_cmpstr (change.key, ==, "string");
   string = g_settings_get_string (settings, "string");
   g_assert_cmpstr (string, ==, "Notify me");
   g_free (change.key);
 
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   g_settings_set_int (settings, "int32", 1691);
-  util_main_iterate ();
+  g_assert (util_main_wait (&change.n_changes, 1));
   g_assert_cmpstr (change.key, ==, "int32");
   int32 = g_settings_get_int (settings, "int32");
   g_assert (int32 == 1691);
   g_free (change.key);
 
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   g_settings_set (settings, "qword", "x", (gint64)-778019);
-  util_main_iterate ();
+  g_assert (util_main_wait (&change.n_changes, 1));
   g_assert_cmpstr (change.key, ==, "qword");
   g_settings_get (settings, "qword", "x", &int64);
   g_assert (int64 == -778019);
   g_free (change.key);
 
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   g_settings_set (settings, "box", "(iii)", -1, 99, 11111);
-  util_main_iterate ();
+  g_assert (util_main_wait (&change.n_changes, 1));
   g_assert_cmpstr (change.key, ==, "box");
   g_settings_get (settings, "box", "(iii)", &x, &y, &z);
   g_assert (x == -1 && y == 99 && z == 11111);
   g_free (change.key);
 
   /* Test resettting */
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   g_settings_reset (settings, "string");
-  util_main_iterate ();
+  g_assert (util_main_wait (&change.n_changes, 1));
   g_assert_cmpstr (change.key, ==, "string");
   string = g_settings_get_string (settings, "string");
   g_assert_cmpstr (string, ==, "Hello world");
@@ -113,16 +117,15 @@ manual_test (gconstpointer test_data)
   GSettings *settings, *s1, *s2;
 
   main_loop = g_main_loop_new (NULL, FALSE);
-  settings = g_settings_new ("org.gsettings.test.storage-test");
+  settings = util_settings_new ("org.gsettings.test.storage-test");
 
   g_signal_connect (settings, "changed", G_CALLBACK (single_change_handler), &change);
 
   /* Delete a value */
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   g_settings_set_string (settings, "string", "I'm getting deleted!");
 
-  while (change.change_flag == FALSE)
-    util_main_iterate ();
+  g_assert (util_main_wait (&change.n_changes, 1));
 
   g_assert_cmpstr (change.key, ==, "string");
   string = g_settings_get_string (settings, "string");
@@ -133,7 +136,7 @@ manual_test (gconstpointer test_data)
   /* We should receive at this point a changed signal if the key
    * is externally changed
    */
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   if (util_registry_open_path ("tests\\storage", &hpath))
     {
       result = RegDeleteValueW (hpath, L"string");
@@ -142,8 +145,7 @@ manual_test (gconstpointer test_data)
       RegCloseKey (hpath);
     }
 
-  while (change.change_flag == FALSE)
-    util_main_iterate();
+  g_assert (util_main_wait (&change.n_changes, 1));
 
   g_assert_cmpstr(change.key, == , "string");
   string = g_settings_get_string(settings, "string");
@@ -152,11 +154,11 @@ manual_test (gconstpointer test_data)
   g_free(change.key);
 
   /* Add a value */
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   g_settings_reset (settings, "double");
-  util_main_iterate();
+  util_main_settle ();
 
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   if (util_registry_open_path ("tests\\storage", &hpath))
     {
       result = RegSetValueExW (hpath, L"double", 0, REG_SZ, (const BYTE *)L"2.99e8", 7 * sizeof (gunichar2));
@@ -165,21 +167,20 @@ manual_test (gconstpointer test_data)
       RegCloseKey (hpath);
     }
 
-  while (change.change_flag == FALSE)
-    util_main_iterate ();
+  g_assert (util_main_wait (&change.n_changes, 1));
 
-  g_assert (change.change_flag == TRUE);
+  g_assert_cmpuint (change.n_changes, ==, 1);
   g_assert_cmpstr (change.key, ==, "double");
   double_value = g_settings_get_double (settings, "double");
   g_assert_cmpfloat (double_value, ==, 299000000.0);
   g_free (change.key);
 
   /* the same but using the ansi version to modify the registry */
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   g_settings_reset(settings, "double");
-  util_main_iterate();
+  util_main_settle ();
 
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   if (util_registry_open_path ("tests\\storage", &hpath))
     {
       result = RegSetValueExA (hpath, "double", 0, REG_SZ, "2.99e8", 7);
@@ -188,22 +189,21 @@ manual_test (gconstpointer test_data)
       RegCloseKey (hpath);
     }
 
-  while (change.change_flag == FALSE)
-    util_main_iterate ();
+  g_assert (util_main_wait (&change.n_changes, 1));
 
-  g_assert (change.change_flag == TRUE);
+  g_assert_cmpuint (change.n_changes, ==, 1);
   g_assert_cmpstr (change.key, ==, "double");
   double_value = g_settings_get_double (settings, "double");
   g_assert_cmpfloat (double_value, ==, 299000000.0);
   g_free (change.key);
 
-  s1 = g_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
-                                 "/tests/storage/a/twisty/little/maze/of/pathnames/all/alike/");
-  s2 = g_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
-                                 "/tests/storage/a/twisty/maze/of/little/pathnames/all/alike/");
+  s1 = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                    "/tests/storage/a/twisty/little/maze/of/pathnames/all/alike/");
+  s2 = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                    "/tests/storage/a/twisty/maze/of/little/pathnames/all/alike/");
 
   /* Add some keys */
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   if (util_registry_open_path ("tests\\storage", &hpath))
     {
       HKEY hsubpath1, hsubpath2, hsubpath3;
@@ -222,7 +222,7 @@ manual_test (gconstpointer test_data)
       RegCloseKey (hsubpath2);
       RegCloseKey (hsubpath1);
 
-      g_assert (change.change_flag == FALSE);
+      g_assert_cmpuint (change.n_changes, ==, 0);
 
       /* Set a value */
       g_settings_set (s1, "marker", "ms", "lamp");
@@ -232,7 +232,7 @@ manual_test (gconstpointer test_data)
 
       RegCloseKey (hpath);
     }
-  util_main_iterate ();
+  util_main_settle ();
 
   g_settings_get (s2, "marker", "ms", &string);
   g_assert (string == NULL);
@@ -250,12 +250,11 @@ breakage_test (gconstpointer test_data)
   HKEY hpath;
   LONG result;
   Change change;
-  gint i;
   GMainLoop *main_loop;
   GSettings *settings;
 
   main_loop = g_main_loop_new (NULL, FALSE);
-  settings = g_settings_new ("org.gsettings.test.storage-test");
+  settings = util_settings_new ("org.gsettings.test.storage-test");
 
   g_signal_connect (settings, "changed", G_CALLBACK (single_change_handler), &change);
 
@@ -263,7 +262,7 @@ breakage_test (gconstpointer test_data)
    * (I think the registry backend does actually fire a changed notification
    * here and it's GSettings that ignores it, but that's fine, it shouldn't
    * happen really) */
-  change.change_flag = FALSE;
+  change.n_changes = 0;
   if (util_registry_open_path ("tests\\storage", &hpath))
     {
       result = RegSetValueExW (hpath, L"intruder", 0, REG_SZ, (const BYTE *)L"oh no", 6 * sizeof (gunichar2));
@@ -273,10 +272,9 @@ breakage_test (gconstpointer test_data)
       RegCloseKey (hpath);
     }
 
-  for (i = 0; i < 100; i++)
-    util_main_iterate ();
+  util_main_settle ();
 
-  g_assert (change.change_flag == FALSE);
+  g_assert_cmpuint (change.n_changes, ==, 0);
 
   g_object_unref (settings);
 
@@ -295,12 +293,12 @@ nesting_test (gconstpointer test_data)
 
   main_loop = g_main_loop_new (NULL, FALSE);
   
-  s1 = g_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
-                                 "/tests/storage/");
-  s2 = g_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
-                                 "/tests/storage/nested/");
-  s3 = g_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
-                                 "/tests/storage/nested/even/further/");
+  s1 = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                    "/tests/storage/");
+  s2 = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                    "/tests/storage/nested/");
+  s3 = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                    "/tests/storage/nested/even/further/");
 
   g_signal_connect (s1, "changed", G_CALLBACK (single_change_handler), &change);
 
@@ -315,7 +313,7 @@ nesting_test (gconstpointer test_data)
       RegCloseKey (hpath);
     }
 
-  g_usleep (10000);
+  util_main_settle ();
 
   g_settings_get (s3, "marker", "ms", &string);
   g_assert_cmpstr (string, ==, "tasty food");
@@ -340,7 +338,7 @@ stress_test (gconstpointer test_data)
   /* 63 is the maximum but this shouldn't fail, because the backend shouldn't
    * watch the same prefix twice */
   for (i = 0; i < 100; i++)
-    settings[i] = g_settings_new ("org.gsettings.test.storage-test");
+    settings[i] = util_settings_new ("org.gsettings.test.storage-test");
 
   for (i = 0; i < 1000; i++)
     {
@@ -355,14 +353,14 @@ stress_test (gconstpointer test_data)
 
   /* Now watch 63 different paths. */
 
-  s0 = g_settings_new ("org.gsettings.test.storage-test");
+  s0 = util_settings_new ("org.gsettings.test.storage-test");
 
   for (i = 0; i < 62; i++)
     {
       char buffer[256];
       g_snprintf (buffer, 255, "/tests/storage/prefix%i/", i);
-      settings[i] = g_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
-                                              buffer);
+      settings[i] = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                                 buffer);
     }
 
   for (i = 0; i < 1000; i++)
@@ -386,6 +384,377 @@ stress_test (gconstpointer test_data)
   g_main_loop_unref (main_loop);
 }
 
+#ifndef G_OS_WIN32
+#define N_PREFIXES 10000
+
+static void
+count_change_handler (GSettings   *settings,
+                      const gchar *key,
+                      guint       *n_changes)
+{
+  (*n_changes)++;
+}
+
+/* Far more watched paths than Windows can wait on at once. Each external
+ * change must reach exactly the one path it was made in. */
+static void
+many_paths_test (gconstpointer test_data)
+{
+  GSettings **settings;
+  guint *n_changes;
+  HKEY hpath, hprefix;
+  LONG result;
+  gint i, j, k;
+
+  settings = g_new (GSettings *, N_PREFIXES);
+  n_changes = g_new0 (guint, N_PREFIXES);
+
+  for (i = 0; i < N_PREFIXES; i++)
+    {
+      char buffer[256];
+      g_snprintf (buffer, 255, "/tests/storage/prefix%i/", i);
+      settings[i] = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                                 buffer);
+      g_signal_connect (settings[i], "changed", G_CALLBACK (count_change_handler), &n_changes[i]);
+    }
+
+  if (!util_registry_open_path ("tests\\storage", &hpath))
+    g_assert_not_reached ();
+
+  for (i = 0; i < 100; i++)
+    {
+      gchar *name;
+      gunichar2 *namew;
+
+      j = g_test_rand_int_range (0, N_PREFIXES);
+
+      name = g_strdup_printf ("prefix%i", j);
+      namew = g_utf8_to_utf16 (name, -1, NULL, NULL, NULL);
+      result = RegCreateKeyExW (hpath, namew, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hprefix, NULL);
+      g_assert_no_win32_error (result, "Error creating a path");
+      g_free (namew);
+      g_free (name);
+
+      result = RegSetValueExW (hprefix, L"marker", 0, REG_SZ, (const BYTE *)L"'somewhere'", 12 * sizeof (gunichar2));
+      g_assert_no_win32_error (result, "Error setting value 'marker'");
+
+      RegCloseKey (hprefix);
+
+      g_assert (util_main_wait (&n_changes[j], 1));
+
+      for (k = 0; k < N_PREFIXES; k++)
+        g_assert_cmpuint (n_changes[k], ==, (k == j) ? 1 : 0);
+      n_changes[j] = 0;
+    }
+
+  RegCloseKey (hpath);
+
+  for (i = 0; i < N_PREFIXES; i++)
+    g_object_unref (settings[i]);
+
+  g_free (n_changes);
+  g_free (settings);
+}
+#endif
+
+/* Writing the value a key already has must not notify anybody */
+static void
+identical_test (gconstpointer test_data)
+{
+  GSettingsBackend *backend;
+  GSettings *settings;
+  Change change;
+
+  backend = dedup_backend_new (util_settings_backend_get ());
+  settings = util_settings_new_with_backend ("org.gsettings.test.storage-test", backend);
+
+  g_signal_connect (settings, "changed", G_CALLBACK (single_change_handler), &change);
+
+  change.n_changes = 0;
+  g_settings_set_string (settings, "string", "Same again");
+  g_assert (util_main_wait (&change.n_changes, 1));
+  g_assert_cmpstr (change.key, ==, "string");
+  g_free (change.key);
+
+  change.n_changes = 0;
+  g_settings_set_string (settings, "string", "Same again");
+  g_settings_set (settings, "box", "(iii)", 1, 2, 3);
+  g_assert (util_main_wait (&change.n_changes, 1));
+  g_assert_cmpstr (change.key, ==, "box");
+  g_free (change.key);
+
+  change.n_changes = 0;
+  g_settings_set (settings, "box", "(iii)", 1, 2, 3);
+  g_settings_set_string (settings, "string", "Same again");
+  util_main_settle ();
+  g_assert_cmpuint (change.n_changes, ==, 0);
+
+  g_object_unref (settings);
+  g_object_unref (backend);
+}
+
+#ifndef G_OS_WIN32
+/* Values cached by the caching backend must not outlive external changes.
+ * Only the emulated registry tells the cache about those. */
+static void
+cache_test (gconstpointer test_data)
+{
+  GSettingsBackend *backend;
+  GSettings *settings, *s1;
+  Change change;
+  HKEY hpath;
+  LONG result;
+  gchar *string;
+
+  backend = caching_backend_new (util_settings_backend_get ());
+  settings = util_settings_new_with_backend ("org.gsettings.test.storage-test", backend);
+  s1 = util_settings_new_with_backend_and_path ("org.gsettings.test.storage-test.long-path",
+                                                backend, "/tests/storage/cached/");
+
+  g_signal_connect (settings, "changed", G_CALLBACK (single_change_handler), &change);
+
+  change.n_changes = 0;
+  g_settings_set_string (settings, "string", "Cached");
+  g_assert (util_main_wait (&change.n_changes, 1));
+  g_free (change.key);
+
+  /* Twice, so that the second read comes from the cache */
+  string = g_settings_get_string (settings, "string");
+  g_assert_cmpstr (string, ==, "Cached");
+  g_free (string);
+  string = g_settings_get_string (settings, "string");
+  g_assert_cmpstr (string, ==, "Cached");
+  g_free (string);
+
+  /* Another cache of the same backend coming and going must not stop this
+   * one hearing about changes */
+  g_object_unref (caching_backend_new (util_settings_backend_get ()));
+
+  /* Change a value */
+  change.n_changes = 0;
+  if (util_registry_open_path ("tests\\storage", &hpath))
+    {
+      result = RegSetValueExW (hpath, L"string", 0, REG_SZ, (const BYTE *)L"Changed outside", 16 * sizeof (gunichar2));
+      g_assert_no_win32_error (result, "Error setting value 'string'");
+
+      RegCloseKey (hpath);
+    }
+
+  g_assert (util_main_wait (&change.n_changes, 1));
+  g_assert_cmpstr (change.key, ==, "string");
+  string = g_settings_get_string (settings, "string");
+  g_assert_cmpstr (string, ==, "Changed outside");
+  g_free (string);
+  g_free (change.key);
+
+  /* Delete a value */
+  change.n_changes = 0;
+  if (util_registry_open_path ("tests\\storage", &hpath))
+    {
+      result = RegDeleteValueW (hpath, L"string");
+      g_assert_no_win32_error (result, "Error deleting value 'string'");
+
+      RegCloseKey (hpath);
+    }
+
+  g_assert (util_main_wait (&change.n_changes, 1));
+  string = g_settings_get_string (settings, "string");
+  g_assert_cmpstr (string, ==, "Hello world");
+  g_free (string);
+  g_free (change.key);
+
+  /* Delete a whole subtree */
+  g_settings_set (s1, "marker", "ms", "cached");
+  g_settings_get (s1, "marker", "ms", &string);
+  g_assert_cmpstr (string, ==, "cached");
+  g_free (string);
+
+  if (util_registry_open_path ("tests\\storage", &hpath))
+    {
+      result = SHDeleteKeyW (hpath, L"cached");
+      g_assert_no_win32_error (result, "Error deleting key 'cached'");
+
+      RegCloseKey (hpath);
+    }
+
+  util_main_settle ();
+
+  g_settings_get (s1, "marker", "ms", &string);
+  g_assert (string == NULL);
+
+  /* Change a value while nothing watches its path */
+  g_settings_set (s1, "marker", "ms", "cached");
+  g_settings_get (s1, "marker", "ms", &string);
+  g_assert_cmpstr (string, ==, "cached");
+  g_free (string);
+  util_main_settle ();
+  g_object_unref (s1);
+
+  if (util_registry_open_path ("tests\\storage\\cached", &hpath))
+    {
+      result = RegSetValueExW (hpath, L"marker", 0, REG_SZ, (const BYTE *)L"'outside'", 10 * sizeof (gunichar2));
+      g_assert_no_win32_error (result, "Error setting value 'marker'");
+
+      RegCloseKey (hpath);
+    }
+
+  s1 = util_settings_new_with_backend_and_path ("org.gsettings.test.storage-test.long-path",
+                                                backend, "/tests/storage/cached/");
+  g_settings_get (s1, "marker", "ms", &string);
+  g_assert_cmpstr (string, ==, "outside");
+  g_free (string);
+
+  g_object_unref (s1);
+  g_object_unref (settings);
+  g_object_unref (backend);
+}
+#endif
+
+typedef struct {
+  guint   n_callbacks;
+  gchar **keys;
+} Changes;
+
+static void
+changes_handler (GSettings           *settings,
+                 const gchar * const *keys,
+                 gpointer             user_data)
+{
+  Changes *changes = user_data;
+
+  changes->n_callbacks++;
+  g_strfreev (changes->keys);
+  changes->keys = g_strdupv ((gchar **) keys);
+}
+
+/* A burst of changes arrives as one callback naming each key once */
+static void
+aggregate_test (gconstpointer test_data)
+{
+  UtilChangeAggregator *aggregator;
+  GSettings *settings, *writer;
+  Changes changes = { 0, NULL };
+
+  settings = util_settings_new ("org.gsettings.test.storage-test");
+  writer = util_settings_new ("org.gsettings.test.storage-test");
+  aggregator = util_change_aggregator_new (settings, 20, changes_handler, &changes);
+
+  g_settings_set_string (writer, "string", "Storm");
+  g_settings_set_int (writer, "int32", 1);
+  g_settings_set_string (writer, "string", "Storm again");
+  g_settings_set_int (writer, "int32", 2);
+  g_settings_set (writer, "box", "(iii)", 4, 5, 6);
+
+  g_assert (util_main_wait (&changes.n_callbacks, 1));
+  g_assert_cmpuint (changes.n_callbacks, ==, 1);
+  g_assert_cmpuint (g_strv_length (changes.keys), ==, 3);
+  g_assert (g_strv_contains ((const gchar * const *) changes.keys, "string"));
+  g_assert (g_strv_contains ((const gchar * const *) changes.keys, "int32"));
+  g_assert (g_strv_contains ((const gchar * const *) changes.keys, "box"));
+
+  /* And the next burst in a callback of its own */
+  g_settings_set_string (writer, "junk", "Calm");
+  g_assert (util_main_wait (&changes.n_callbacks, 2));
+  g_assert_cmpuint (g_strv_length (changes.keys), ==, 1);
+  g_assert_cmpstr (changes.keys[0], ==, "junk");
+
+  util_change_aggregator_free (aggregator);
+  g_strfreev (changes.keys);
+  g_object_unref (writer);
+  g_object_unref (settings);
+}
+
+typedef struct {
+  UtilSettingsView *view;
+  gchar            *seen;
+  guint             n_changes;
+} ViewPeek;
+
+static void
+view_peek_handler (GSettings   *settings,
+                   const gchar *key,
+                   ViewPeek    *peek)
+{
+  g_free (peek->seen);
+  peek->seen = g_strdup (util_settings_view_peek_string (peek->view, "string"));
+  peek->n_changes++;
+}
+
+/* A "changed" handler connected before the view was made must still see
+ * the new value through it */
+static void
+view_test (gconstpointer test_data)
+{
+  GSettings *settings, *writer;
+  ViewPeek peek = { NULL, NULL, 0 };
+
+  settings = util_settings_new ("org.gsettings.test.storage-test");
+  writer = util_settings_new ("org.gsettings.test.storage-test");
+  g_signal_connect (settings, "changed", G_CALLBACK (view_peek_handler), &peek);
+  peek.view = util_settings_view_new (settings);
+
+  g_settings_set_string (writer, "string", "Before");
+  g_assert (util_main_wait (&peek.n_changes, 1));
+  g_assert_cmpstr (peek.seen, ==, "Before");
+
+  g_settings_set_string (writer, "string", "After");
+  g_assert (util_main_wait (&peek.n_changes, 2));
+  g_assert_cmpstr (peek.seen, ==, "After");
+
+  util_settings_view_free (peek.view);
+  g_free (peek.seen);
+  g_object_unref (writer);
+  g_object_unref (settings);
+}
+
+#ifndef G_OS_WIN32
+static void
+stall_read_back (GSettings   *settings,
+                 const gchar *key,
+                 guint       *n_changed)
+{
+  GVariant *value;
+
+  /* Like a UI redrawing with the new value, this goes to storage */
+  value = g_settings_get_value (settings, key);
+  g_variant_unref (value);
+
+  (*n_changed)++;
+}
+
+/* Slow storage shows up as stalls in the dispatch of the slow key */
+static void
+stall_test (gconstpointer test_data)
+{
+  UtilStallMonitor *monitor;
+  GSettings *settings, *writer;
+  guint n_changed = 0;
+
+  settings = util_settings_new ("org.gsettings.test.storage-test");
+  writer = util_settings_new ("org.gsettings.test.storage-test");
+  g_signal_connect (settings, "changed", G_CALLBACK (stall_read_back), &n_changed);
+  monitor = util_stall_monitor_new (settings);
+
+  util_stall_monitor_set_value (monitor, "string", g_variant_new_string ("Quick"));
+  g_assert (util_main_wait (&n_changed, 1));
+
+  registry_emulator_set_latency (20000);
+  g_settings_set_int (writer, "int32", 500);
+  g_assert (util_main_wait (&n_changed, 2));
+  registry_emulator_set_latency (0);
+
+  g_assert_cmpuint (util_stall_monitor_get_count (monitor, UTIL_STALL_DISPATCH), ==, 2);
+  g_assert_cmpuint (util_stall_monitor_get_count (monitor, UTIL_STALL_WRITE), ==, 1);
+  g_assert_cmpint (util_stall_monitor_get_percentile (monitor, UTIL_STALL_DISPATCH, 100), >=, 20000000);
+  g_assert_cmpstr (util_stall_monitor_get_worst_key (monitor, UTIL_STALL_DISPATCH), ==, "int32");
+  g_assert_cmpstr (util_stall_monitor_get_worst_key (monitor, UTIL_STALL_WRITE), ==, "string");
+
+  util_stall_monitor_free (monitor);
+  g_object_unref (writer);
+  g_object_unref (settings);
+}
+#endif
+
 static void
 delete_old_keys (void)
 {
@@ -404,17 +773,27 @@ main (int argc, char **argv)
 {
   gint result;
 
-  g_test_init (&argc, &argv, NULL);
+  util_test_init (&argc, &argv);
 
   delete_old_keys ();
 
-  g_test_add_data_func ("/gsettings/notify/Basic", NULL, basic_test);
-  g_test_add_data_func ("/gsettings/notify/Manual", NULL, manual_test);
-  g_test_add_data_func ("/gsettings/notify/Breakage", NULL, breakage_test);
-  g_test_add_data_func ("/gsettings/notify/Nesting", NULL, nesting_test);
-  g_test_add_data_func ("/gsettings/notify/Stress", NULL, stress_test);
-
-  result = g_test_run ();
+  util_test_add ("/gsettings/notify/Basic", NULL, basic_test);
+  util_test_add ("/gsettings/notify/Manual", NULL, manual_test);
+  util_test_add ("/gsettings/notify/Breakage", NULL, breakage_test);
+  util_test_add ("/gsettings/notify/Nesting", NULL, nesting_test);
+  util_test_add ("/gsettings/notify/Stress", NULL, stress_test);
+#ifndef G_OS_WIN32
+  util_test_add ("/gsettings/notify/Many paths", NULL, many_paths_test);
+#endif
+  util_test_add ("/gsettings/notify/Identical", NULL, identical_test);
+  util_test_add ("/gsettings/notify/Aggregate", NULL, aggregate_test);
+  util_test_add ("/gsettings/notify/View", NULL, view_test);
+#ifndef G_OS_WIN32
+  util_test_add ("/gsettings/notify/Cache", NULL, cache_test);
+  util_test_add ("/gsettings/notify/Stalls", NULL, stall_test);
+#endif
+
+  result = util_test_run ();
 
   delete_old_keys ();
 
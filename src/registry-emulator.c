@@ -0,0 +1,958 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <string.h>
+
+#include "registry-emulator.h"
+
+#ifndef G_OS_WIN32
+
+typedef struct _RegistryNode RegistryNode;
+
+struct _RegistryNode {
+  gint          ref_count;
+  gchar        *name;
+  RegistryNode *parent;
+  GHashTable   *children;   /* casefolded name -> RegistryNode */
+  GHashTable   *values;     /* casefolded name -> RegistryValue */
+  gboolean      deleted;
+};
+
+typedef struct {
+  gchar  *name;
+  DWORD   type;
+  GBytes *data;
+} RegistryValue;
+
+struct _RegistryHandle {
+  RegistryNode *node;
+};
+
+struct _RegistryEvent {
+  GMutex   mutex;
+  GCond    cond;
+  gboolean manual_reset;
+  gboolean signalled;
+};
+
+typedef struct {
+  guint                       id;
+  gchar                      *key_path;   /* casefolded */
+  gboolean                    watch_subtree;
+  DWORD                       notify_filter;
+
+  /* Either a callback, or a one-shot event from RegNotifyChangeKeyValue */
+  RegistryEmulatorChangeFunc  func;
+  gpointer                    user_data;
+  HANDLE                      event;
+} RegistryWatch;
+
+typedef struct {
+  RegistryEmulatorChangeFunc  func;
+  gpointer                    user_data;
+  HANDLE                      event;
+} RegistryDispatch;
+
+static GMutex        registry_lock;
+static RegistryNode *registry_root = NULL;
+static GSList       *registry_watches = NULL;
+static guint         registry_last_watch_id = 0;
+static gint          registry_latency = 0;
+
+static void
+registry_value_free (RegistryValue *value)
+{
+  g_free (value->name);
+  g_bytes_unref (value->data);
+  g_slice_free (RegistryValue, value);
+}
+
+static RegistryNode *
+registry_node_ref (RegistryNode *node)
+{
+  g_atomic_int_inc (&node->ref_count);
+  return node;
+}
+
+static void
+registry_node_unref (RegistryNode *node)
+{
+  if (g_atomic_int_dec_and_test (&node->ref_count))
+    {
+      g_hash_table_unref (node->children);
+      g_hash_table_unref (node->values);
+      g_free (node->name);
+      g_slice_free (RegistryNode, node);
+    }
+}
+
+static RegistryNode *
+registry_node_new (RegistryNode *parent,
+                   const gchar  *name)
+{
+  RegistryNode *node;
+
+  node = g_slice_new0 (RegistryNode);
+  node->ref_count = 1;
+  node->name = g_strdup (name);
+  node->parent = parent;
+  node->children = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify) registry_node_unref);
+  node->values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify) registry_value_free);
+  return node;
+}
+
+/* Registry names are case insensitive */
+static gchar *
+registry_casefold (const gchar *name)
+{
+  return g_utf8_casefold (name, -1);
+}
+
+static gchar *
+registry_node_get_path (RegistryNode *node)
+{
+  GString *path;
+  GSList *names = NULL, *l;
+
+  for (; node != NULL && node != registry_root; node = node->parent)
+    names = g_slist_prepend (names, node->name);
+
+  path = g_string_new (NULL);
+  for (l = names; l != NULL; l = l->next)
+    {
+      if (path->len > 0)
+        g_string_append_c (path, '\\');
+      g_string_append (path, l->data);
+    }
+  g_slist_free (names);
+
+  return g_string_free (path, FALSE);
+}
+
+static void
+registry_node_mark_deleted (RegistryNode *node)
+{
+  GHashTableIter iter;
+  gpointer child;
+
+  node->deleted = TRUE;
+
+  g_hash_table_iter_init (&iter, node->children);
+  while (g_hash_table_iter_next (&iter, NULL, &child))
+    registry_node_mark_deleted (child);
+}
+
+static void
+emulate_latency (void)
+{
+  gulong latency = registry_emulator_get_latency ();
+
+  if (latency > 0)
+    g_usleep (latency);
+}
+
+/* Must be called with registry_lock held */
+static RegistryNode *
+resolve_handle (HKEY hkey)
+{
+  if (registry_root == NULL)
+    registry_root = registry_node_new (NULL, "");
+
+  if (hkey == HKEY_CURRENT_USER)
+    return registry_root;
+
+  if (hkey == NULL)
+    return NULL;
+
+  return hkey->node;
+}
+
+static gchar *
+wide_to_utf8 (LPCWSTR string)
+{
+  if (string == NULL)
+    return g_strdup ("");
+
+  return g_utf16_to_utf8 (string, -1, NULL, NULL, NULL);
+}
+
+/* Must be called with registry_lock held. Returns a borrowed node, or NULL
+ * if any component is missing and @create is FALSE. */
+static RegistryNode *
+lookup_node (RegistryNode *node,
+             const gchar  *subkey,
+             gboolean      create,
+             gboolean     *created)
+{
+  gchar **components;
+  gint i;
+
+  if (created != NULL)
+    *created = FALSE;
+
+  components = g_strsplit (subkey, "\\", -1);
+
+  for (i = 0; node != NULL && components[i] != NULL; i++)
+    {
+      RegistryNode *child;
+      gchar *folded;
+
+      if (components[i][0] == '\0')
+        continue;
+
+      folded = registry_casefold (components[i]);
+      child = g_hash_table_lookup (node->children, folded);
+
+      if (child == NULL && create)
+        {
+          child = registry_node_new (node, components[i]);
+          g_hash_table_insert (node->children, folded, child);
+          folded = NULL;
+
+          if (created != NULL)
+            *created = TRUE;
+        }
+
+      g_free (folded);
+      node = child;
+    }
+
+  g_strfreev (components);
+
+  return node;
+}
+
+static gboolean
+watch_matches (RegistryWatch          *watch,
+               RegistryEmulatorChange  change,
+               const gchar            *folded_path)
+{
+  gsize watch_len = strlen (watch->key_path);
+
+  if (watch->event != NULL)
+    {
+      DWORD needed = (change == REGISTRY_EMULATOR_VALUE_CHANGED) ?
+                     REG_NOTIFY_CHANGE_LAST_SET : REG_NOTIFY_CHANGE_NAME;
+
+      if ((watch->notify_filter & needed) == 0)
+        return FALSE;
+    }
+
+  if (strcmp (watch->key_path, folded_path) == 0)
+    return TRUE;
+
+  /* Change happened below the watched key */
+  if (watch->watch_subtree &&
+      (watch_len == 0 ||
+       (strncmp (watch->key_path, folded_path, watch_len) == 0 &&
+        folded_path[watch_len] == '\\')))
+    return TRUE;
+
+  /* The watched key was removed along with one of its parents */
+  if (change == REGISTRY_EMULATOR_KEY_DELETED)
+    {
+      gsize path_len = strlen (folded_path);
+
+      if (strncmp (watch->key_path, folded_path, path_len) == 0 &&
+          watch->key_path[path_len] == '\\')
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Must be called with registry_lock held. The returned dispatch list is
+ * run with notify_changes() once the lock has been dropped. */
+static GArray *
+collect_watches (RegistryEmulatorChange  change,
+                 RegistryNode           *node)
+{
+  GArray *dispatch;
+  GSList *l, *next;
+  gchar *path, *folded;
+
+  dispatch = g_array_new (FALSE, FALSE, sizeof (RegistryDispatch));
+
+  if (registry_watches == NULL)
+    return dispatch;
+
+  path = registry_node_get_path (node);
+  folded = registry_casefold (path);
+  g_free (path);
+
+  for (l = registry_watches; l != NULL; l = next)
+    {
+      RegistryWatch *watch = l->data;
+      RegistryDispatch item;
+
+      next = l->next;
+
+      if (!watch_matches (watch, change, folded))
+        continue;
+
+      item.func = watch->func;
+      item.user_data = watch->user_data;
+      item.event = watch->event;
+      g_array_append_val (dispatch, item);
+
+      /* RegNotifyChangeKeyValue() only signals once */
+      if (watch->event != NULL)
+        {
+          registry_watches = g_slist_delete_link (registry_watches, l);
+          g_free (watch->key_path);
+          g_slice_free (RegistryWatch, watch);
+        }
+    }
+
+  g_free (folded);
+
+  return dispatch;
+}
+
+static void
+notify_changes (GArray                 *dispatch,
+                RegistryEmulatorChange  change,
+                const gchar            *key_path,
+                const gchar            *value_name)
+{
+  guint i;
+
+  for (i = 0; i < dispatch->len; i++)
+    {
+      RegistryDispatch *item = &g_array_index (dispatch, RegistryDispatch, i);
+
+      if (item->event != NULL)
+        SetEvent (item->event);
+      else
+        item->func (change, key_path, value_name, item->user_data);
+    }
+
+  g_array_free (dispatch, TRUE);
+}
+
+static LONG
+open_key (HKEY         hkey,
+          const gchar *subkey,
+          gboolean     create,
+          PHKEY        result,
+          LPDWORD      disposition)
+{
+  RegistryNode *node, *parent;
+  GArray *dispatch = NULL;
+  gchar *path = NULL;
+  gboolean created;
+
+  g_return_val_if_fail (result != NULL, ERROR_INVALID_PARAMETER);
+
+  g_mutex_lock (&registry_lock);
+
+  parent = resolve_handle (hkey);
+  if (parent == NULL)
+    {
+      g_mutex_unlock (&registry_lock);
+      return ERROR_INVALID_HANDLE;
+    }
+  if (parent->deleted)
+    {
+      g_mutex_unlock (&registry_lock);
+      return ERROR_KEY_DELETED;
+    }
+
+  node = lookup_node (parent, subkey, create, &created);
+  if (node == NULL)
+    {
+      g_mutex_unlock (&registry_lock);
+      return ERROR_FILE_NOT_FOUND;
+    }
+
+  *result = g_slice_new (struct _RegistryHandle);
+  (*result)->node = registry_node_ref (node);
+
+  if (disposition != NULL)
+    *disposition = created ? REG_CREATED_NEW_KEY : REG_OPENED_EXISTING_KEY;
+
+  if (created)
+    {
+      dispatch = collect_watches (REGISTRY_EMULATOR_KEY_CREATED, node);
+      path = registry_node_get_path (node);
+    }
+
+  g_mutex_unlock (&registry_lock);
+
+  if (dispatch != NULL)
+    notify_changes (dispatch, REGISTRY_EMULATOR_KEY_CREATED, path, NULL);
+  g_free (path);
+
+  return ERROR_SUCCESS;
+}
+
+LONG
+RegOpenKeyExW (HKEY    hkey,
+               LPCWSTR subkey,
+               DWORD   options,
+               REGSAM  sam_desired,
+               PHKEY   result)
+{
+  gchar *subkey_utf8;
+  LONG status;
+
+  emulate_latency ();
+
+  subkey_utf8 = wide_to_utf8 (subkey);
+  if (subkey_utf8 == NULL)
+    return ERROR_INVALID_PARAMETER;
+
+  status = open_key (hkey, subkey_utf8, FALSE, result, NULL);
+  g_free (subkey_utf8);
+
+  return status;
+}
+
+LONG
+RegCreateKeyExW (HKEY                  hkey,
+                 LPCWSTR               subkey,
+                 DWORD                 reserved,
+                 WCHAR                *class_name,
+                 DWORD                 options,
+                 REGSAM                sam_desired,
+                 LPSECURITY_ATTRIBUTES security_attributes,
+                 PHKEY                 result,
+                 LPDWORD               disposition)
+{
+  gchar *subkey_utf8;
+  LONG status;
+
+  emulate_latency ();
+
+  subkey_utf8 = wide_to_utf8 (subkey);
+  if (subkey_utf8 == NULL)
+    return ERROR_INVALID_PARAMETER;
+
+  status = open_key (hkey, subkey_utf8, TRUE, result, disposition);
+  g_free (subkey_utf8);
+
+  return status;
+}
+
+LONG
+RegCloseKey (HKEY hkey)
+{
+  if (hkey == HKEY_CURRENT_USER)
+    return ERROR_SUCCESS;
+
+  if (hkey == NULL)
+    return ERROR_INVALID_HANDLE;
+
+  g_mutex_lock (&registry_lock);
+  registry_node_unref (hkey->node);
+  g_mutex_unlock (&registry_lock);
+
+  g_slice_free (struct _RegistryHandle, hkey);
+
+  return ERROR_SUCCESS;
+}
+
+/* Takes ownership of @data, which may be NULL to delete the value */
+static LONG
+set_value (HKEY         hkey,
+           const gchar *value_name,
+           DWORD        type,
+           GBytes      *data)
+{
+  RegistryNode *node;
+  GArray *dispatch;
+  gchar *path, *folded;
+
+  emulate_latency ();
+
+  g_mutex_lock (&registry_lock);
+
+  node = resolve_handle (hkey);
+  if (node == NULL || node->deleted)
+    {
+      g_mutex_unlock (&registry_lock);
+      if (data != NULL)
+        g_bytes_unref (data);
+      return node == NULL ? ERROR_INVALID_HANDLE : ERROR_KEY_DELETED;
+    }
+
+  folded = registry_casefold (value_name);
+
+  if (data != NULL)
+    {
+      RegistryValue *value;
+
+      value = g_slice_new (RegistryValue);
+      value->name = g_strdup (value_name);
+      value->type = type;
+      value->data = data;
+      g_hash_table_replace (node->values, folded, value);
+    }
+  else if (!g_hash_table_remove (node->values, folded))
+    {
+      g_mutex_unlock (&registry_lock);
+      g_free (folded);
+      return ERROR_FILE_NOT_FOUND;
+    }
+  else
+    g_free (folded);
+
+  dispatch = collect_watches (REGISTRY_EMULATOR_VALUE_CHANGED, node);
+  path = registry_node_get_path (node);
+
+  g_mutex_unlock (&registry_lock);
+
+  notify_changes (dispatch, REGISTRY_EMULATOR_VALUE_CHANGED, path, value_name);
+  g_free (path);
+
+  return ERROR_SUCCESS;
+}
+
+LONG
+RegSetValueExW (HKEY        hkey,
+                LPCWSTR     value_name,
+                DWORD       reserved,
+                DWORD       type,
+                const BYTE *data,
+                DWORD       data_size)
+{
+  gchar *name;
+  LONG result;
+
+  name = wide_to_utf8 (value_name);
+  if (name == NULL)
+    return ERROR_INVALID_PARAMETER;
+
+  result = set_value (hkey, name, type, g_bytes_new (data, data_size));
+  g_free (name);
+
+  return result;
+}
+
+LONG
+RegSetValueExA (HKEY        hkey,
+                LPCSTR      value_name,
+                DWORD       reserved,
+                DWORD       type,
+                const BYTE *data,
+                DWORD       data_size)
+{
+  GBytes *bytes;
+  gchar *name;
+  LONG result;
+
+  /* The ANSI code page is taken to be Latin-1, which is close enough to
+   * what Windows does for the ASCII strings the tests use */
+  name = g_convert (value_name != NULL ? value_name : "", -1,
+                    "UTF-8", "ISO-8859-1", NULL, NULL, NULL);
+
+  if (type == REG_SZ)
+    {
+      gunichar2 *wide;
+      DWORD i;
+
+      wide = g_new (gunichar2, data_size);
+      for (i = 0; i < data_size; i++)
+        wide[i] = data[i];
+      bytes = g_bytes_new_take (wide, data_size * sizeof (gunichar2));
+    }
+  else
+    bytes = g_bytes_new (data, data_size);
+
+  result = set_value (hkey, name, type, bytes);
+  g_free (name);
+
+  return result;
+}
+
+LONG
+RegQueryValueExW (HKEY    hkey,
+                  LPCWSTR value_name,
+                  LPDWORD reserved,
+                  LPDWORD type,
+                  LPBYTE  data,
+                  LPDWORD data_size)
+{
+  RegistryNode *node;
+  RegistryValue *value;
+  gchar *name, *folded;
+  gsize size;
+  LONG result = ERROR_SUCCESS;
+
+  emulate_latency ();
+
+  name = wide_to_utf8 (value_name);
+  if (name == NULL)
+    return ERROR_INVALID_PARAMETER;
+  folded = registry_casefold (name);
+  g_free (name);
+
+  g_mutex_lock (&registry_lock);
+
+  node = resolve_handle (hkey);
+  if (node == NULL || node->deleted)
+    {
+      g_mutex_unlock (&registry_lock);
+      g_free (folded);
+      return node == NULL ? ERROR_INVALID_HANDLE : ERROR_KEY_DELETED;
+    }
+
+  value = g_hash_table_lookup (node->values, folded);
+  g_free (folded);
+
+  if (value == NULL)
+    {
+      g_mutex_unlock (&registry_lock);
+      return ERROR_FILE_NOT_FOUND;
+    }
+
+  size = g_bytes_get_size (value->data);
+
+  if (type != NULL)
+    *type = value->type;
+
+  if (data != NULL)
+    {
+      if (data_size == NULL)
+        result = ERROR_INVALID_PARAMETER;
+      else if (*data_size < size)
+        result = ERROR_MORE_DATA;
+      else
+        memcpy (data, g_bytes_get_data (value->data, NULL), size);
+    }
+
+  if (data_size != NULL)
+    *data_size = size;
+
+  g_mutex_unlock (&registry_lock);
+
+  return result;
+}
+
+LONG
+RegDeleteValueW (HKEY    hkey,
+                 LPCWSTR value_name)
+{
+  gchar *name;
+  LONG result;
+
+  name = wide_to_utf8 (value_name);
+  if (name == NULL)
+    return ERROR_INVALID_PARAMETER;
+
+  result = set_value (hkey, name, REG_NONE, NULL);
+  g_free (name);
+
+  return result;
+}
+
+static LONG
+delete_key (HKEY     hkey,
+            LPCWSTR  subkey,
+            gboolean recursive)
+{
+  RegistryNode *parent, *node;
+  GArray *dispatch;
+  gchar *subkey_utf8, *path, *folded;
+
+  emulate_latency ();
+
+  subkey_utf8 = wide_to_utf8 (subkey);
+  if (subkey_utf8 == NULL || subkey_utf8[0] == '\0')
+    {
+      g_free (subkey_utf8);
+      return ERROR_INVALID_PARAMETER;
+    }
+
+  g_mutex_lock (&registry_lock);
+
+  parent = resolve_handle (hkey);
+  if (parent == NULL || parent->deleted)
+    {
+      g_mutex_unlock (&registry_lock);
+      g_free (subkey_utf8);
+      return parent == NULL ? ERROR_INVALID_HANDLE : ERROR_KEY_DELETED;
+    }
+
+  node = lookup_node (parent, subkey_utf8, FALSE, NULL);
+  g_free (subkey_utf8);
+
+  if (node == NULL)
+    {
+      g_mutex_unlock (&registry_lock);
+      return ERROR_FILE_NOT_FOUND;
+    }
+
+  /* RegDeleteKey() refuses to remove keys that still have subkeys */
+  if (!recursive && g_hash_table_size (node->children) > 0)
+    {
+      g_mutex_unlock (&registry_lock);
+      return ERROR_ACCESS_DENIED;
+    }
+
+  dispatch = collect_watches (REGISTRY_EMULATOR_KEY_DELETED, node);
+  path = registry_node_get_path (node);
+
+  registry_node_mark_deleted (node);
+  folded = registry_casefold (node->name);
+  g_hash_table_remove (node->parent->children, folded);
+  g_free (folded);
+
+  g_mutex_unlock (&registry_lock);
+
+  notify_changes (dispatch, REGISTRY_EMULATOR_KEY_DELETED, path, NULL);
+  g_free (path);
+
+  return ERROR_SUCCESS;
+}
+
+LONG
+RegDeleteKeyW (HKEY    hkey,
+               LPCWSTR subkey)
+{
+  return delete_key (hkey, subkey, FALSE);
+}
+
+LONG
+SHDeleteKeyW (HKEY    hkey,
+              LPCWSTR subkey)
+{
+  return delete_key (hkey, subkey, TRUE);
+}
+
+LONG
+RegNotifyChangeKeyValue (HKEY   hkey,
+                         BOOL   watch_subtree,
+                         DWORD  notify_filter,
+                         HANDLE event,
+                         BOOL   asynchronous)
+{
+  RegistryNode *node;
+  RegistryWatch *watch;
+  gchar *path;
+
+  /* Blocking until the change happens is not supported */
+  g_return_val_if_fail (asynchronous && event != NULL, ERROR_INVALID_PARAMETER);
+
+  g_mutex_lock (&registry_lock);
+
+  node = resolve_handle (hkey);
+  if (node == NULL || node->deleted)
+    {
+      g_mutex_unlock (&registry_lock);
+      return node == NULL ? ERROR_INVALID_HANDLE : ERROR_KEY_DELETED;
+    }
+
+  path = registry_node_get_path (node);
+
+  watch = g_slice_new0 (RegistryWatch);
+  watch->id = ++registry_last_watch_id;
+  watch->key_path = registry_casefold (path);
+  watch->watch_subtree = watch_subtree;
+  watch->notify_filter = notify_filter;
+  watch->event = event;
+  registry_watches = g_slist_prepend (registry_watches, watch);
+
+  g_mutex_unlock (&registry_lock);
+
+  g_free (path);
+
+  return ERROR_SUCCESS;
+}
+
+HANDLE
+CreateEventW (LPSECURITY_ATTRIBUTES security_attributes,
+              BOOL                  manual_reset,
+              BOOL                  initial_state,
+              LPCWSTR               name)
+{
+  HANDLE event;
+
+  g_return_val_if_fail (name == NULL, NULL);
+
+  event = g_slice_new0 (struct _RegistryEvent);
+  g_mutex_init (&event->mutex);
+  g_cond_init (&event->cond);
+  event->manual_reset = manual_reset;
+  event->signalled = initial_state;
+
+  return event;
+}
+
+BOOL
+SetEvent (HANDLE event)
+{
+  g_mutex_lock (&event->mutex);
+  event->signalled = TRUE;
+  g_cond_broadcast (&event->cond);
+  g_mutex_unlock (&event->mutex);
+
+  return TRUE;
+}
+
+BOOL
+ResetEvent (HANDLE event)
+{
+  g_mutex_lock (&event->mutex);
+  event->signalled = FALSE;
+  g_mutex_unlock (&event->mutex);
+
+  return TRUE;
+}
+
+DWORD
+WaitForSingleObject (HANDLE event,
+                     DWORD  milliseconds)
+{
+  gint64 end_time;
+  DWORD result = WAIT_OBJECT_0;
+
+  end_time = g_get_monotonic_time () + (gint64) milliseconds * G_TIME_SPAN_MILLISECOND;
+
+  g_mutex_lock (&event->mutex);
+
+  while (!event->signalled)
+    {
+      if (milliseconds == INFINITE)
+        g_cond_wait (&event->cond, &event->mutex);
+      else if (!g_cond_wait_until (&event->cond, &event->mutex, end_time))
+        {
+          result = WAIT_TIMEOUT;
+          break;
+        }
+    }
+
+  if (result == WAIT_OBJECT_0 && !event->manual_reset)
+    event->signalled = FALSE;
+
+  g_mutex_unlock (&event->mutex);
+
+  return result;
+}
+
+BOOL
+CloseHandle (HANDLE event)
+{
+  GSList *l;
+
+  /* Drop any pending RegNotifyChangeKeyValue() watch using this event */
+  g_mutex_lock (&registry_lock);
+  for (l = registry_watches; l != NULL; l = l->next)
+    {
+      RegistryWatch *watch = l->data;
+
+      if (watch->event == event)
+        {
+          registry_watches = g_slist_delete_link (registry_watches, l);
+          g_free (watch->key_path);
+          g_slice_free (RegistryWatch, watch);
+          break;
+        }
+    }
+  g_mutex_unlock (&registry_lock);
+
+  g_cond_clear (&event->cond);
+  g_mutex_clear (&event->mutex);
+  g_slice_free (struct _RegistryEvent, event);
+
+  return TRUE;
+}
+
+guint
+registry_emulator_watch_add (const gchar                *key_path,
+                             gboolean                    watch_subtree,
+                             RegistryEmulatorChangeFunc  func,
+                             gpointer                    user_data)
+{
+  RegistryWatch *watch;
+  guint id;
+
+  g_return_val_if_fail (key_path != NULL, 0);
+  g_return_val_if_fail (func != NULL, 0);
+
+  watch = g_slice_new0 (RegistryWatch);
+  watch->key_path = registry_casefold (key_path);
+  watch->watch_subtree = watch_subtree;
+  watch->func = func;
+  watch->user_data = user_data;
+
+  g_mutex_lock (&registry_lock);
+  id = watch->id = ++registry_last_watch_id;
+  registry_watches = g_slist_prepend (registry_watches, watch);
+  g_mutex_unlock (&registry_lock);
+
+  return id;
+}
+
+void
+registry_emulator_watch_remove (guint watch_id)
+{
+  GSList *l;
+
+  g_mutex_lock (&registry_lock);
+  for (l = registry_watches; l != NULL; l = l->next)
+    {
+      RegistryWatch *watch = l->data;
+
+      if (watch->id == watch_id)
+        {
+          registry_watches = g_slist_delete_link (registry_watches, l);
+          g_free (watch->key_path);
+          g_slice_free (RegistryWatch, watch);
+          break;
+        }
+    }
+  g_mutex_unlock (&registry_lock);
+}
+
+/* Every registry call sleeps for this long before doing anything, to
+ * simulate slow storage */
+void
+registry_emulator_set_latency (gulong microseconds)
+{
+  g_atomic_int_set (&registry_latency, (gint) microseconds);
+}
+
+gulong
+registry_emulator_get_latency (void)
+{
+  return (gulong) g_atomic_int_get (&registry_latency);
+}
+
+gchar *
+registry_emulator_error_message (LONG result)
+{
+  switch (result)
+    {
+      case ERROR_SUCCESS:
+        return g_strdup ("The operation completed successfully.");
+      case ERROR_FILE_NOT_FOUND:
+        return g_strdup ("The system cannot find the file specified.");
+      case ERROR_ACCESS_DENIED:
+        return g_strdup ("Access is denied.");
+      case ERROR_INVALID_HANDLE:
+        return g_strdup ("The handle is invalid.");
+      case ERROR_INVALID_PARAMETER:
+        return g_strdup ("The parameter is incorrect.");
+      case ERROR_MORE_DATA:
+        return g_strdup ("More data is available.");
+      case ERROR_KEY_DELETED:
+        return g_strdup ("Illegal operation attempted on a registry key that "
+                         "has been marked for deletion.");
+      default:
+        return g_strdup_printf ("Unknown error %d", (gint) result);
+    }
+}
+
+#endif /* G_OS_WIN32 */
@@ -0,0 +1,168 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+/* An in-process emulation of the parts of the Win32 registry API that the
+ * tests use, so that they can be built and profiled on platforms without a
+ * registry. Keys live in memory only and are lost when the process exits.
+ *
+ * Wide strings are expected to be UTF-16, which means the code including
+ * this header must be built with -fshort-wchar so that L"" literals match.
+ */
+
+#include <stddef.h>
+#include <glib.h>
+
+#ifndef __REGISTRY_EMULATOR_H__
+#define __REGISTRY_EMULATOR_H__
+
+#ifndef G_OS_WIN32
+
+G_BEGIN_DECLS
+
+typedef guint8        BYTE;
+typedef guint32       DWORD;
+typedef gint32        LONG;
+typedef gint          BOOL;
+typedef guint32       REGSAM;
+typedef wchar_t       WCHAR;
+typedef const WCHAR  *LPCWSTR;
+typedef const gchar  *LPCSTR;
+typedef DWORD        *LPDWORD;
+typedef BYTE         *LPBYTE;
+typedef gpointer      LPSECURITY_ATTRIBUTES;
+
+typedef struct _RegistryHandle *HKEY;
+typedef HKEY                   *PHKEY;
+typedef struct _RegistryEvent  *HANDLE;
+
+#define HKEY_CURRENT_USER       ((HKEY) (gsize) 0x80000001)
+
+#define ERROR_SUCCESS           0L
+#define ERROR_FILE_NOT_FOUND    2L
+#define ERROR_ACCESS_DENIED     5L
+#define ERROR_INVALID_HANDLE    6L
+#define ERROR_INVALID_PARAMETER 87L
+#define ERROR_MORE_DATA         234L
+#define ERROR_KEY_DELETED       1018L
+
+#define REG_NONE                0
+#define REG_SZ                  1
+#define REG_BINARY              3
+#define REG_DWORD               4
+#define REG_QWORD               11
+
+#define KEY_READ                0x20019
+#define KEY_WRITE               0x20006
+#define KEY_ALL_ACCESS          0xF003F
+
+#define REG_OPTION_NON_VOLATILE 0
+#define REG_CREATED_NEW_KEY     1
+#define REG_OPENED_EXISTING_KEY 2
+
+#define REG_NOTIFY_CHANGE_NAME     0x1
+#define REG_NOTIFY_CHANGE_LAST_SET 0x4
+
+#define INFINITE                0xFFFFFFFF
+#define WAIT_OBJECT_0           0
+#define WAIT_TIMEOUT            258
+
+G_STATIC_ASSERT (sizeof (WCHAR) == sizeof (gunichar2));
+
+LONG RegOpenKeyExW    (HKEY                   hkey,
+                       LPCWSTR                subkey,
+                       DWORD                  options,
+                       REGSAM                 sam_desired,
+                       PHKEY                  result);
+LONG RegCreateKeyExW  (HKEY                   hkey,
+                       LPCWSTR                subkey,
+                       DWORD                  reserved,
+                       WCHAR                 *class_name,
+                       DWORD                  options,
+                       REGSAM                 sam_desired,
+                       LPSECURITY_ATTRIBUTES  security_attributes,
+                       PHKEY                  result,
+                       LPDWORD                disposition);
+LONG RegCloseKey      (HKEY                   hkey);
+LONG RegSetValueExW   (HKEY                   hkey,
+                       LPCWSTR                value_name,
+                       DWORD                  reserved,
+                       DWORD                  type,
+                       const BYTE            *data,
+                       DWORD                  data_size);
+LONG RegSetValueExA   (HKEY                   hkey,
+                       LPCSTR                 value_name,
+                       DWORD                  reserved,
+                       DWORD                  type,
+                       const BYTE            *data,
+                       DWORD                  data_size);
+LONG RegQueryValueExW (HKEY                   hkey,
+                       LPCWSTR                value_name,
+                       LPDWORD                reserved,
+                       LPDWORD                type,
+                       LPBYTE                 data,
+                       LPDWORD                data_size);
+LONG RegDeleteValueW  (HKEY                   hkey,
+                       LPCWSTR                value_name);
+LONG RegDeleteKeyW    (HKEY                   hkey,
+                       LPCWSTR                subkey);
+LONG SHDeleteKeyW     (HKEY                   hkey,
+                       LPCWSTR                subkey);
+
+LONG RegNotifyChangeKeyValue (HKEY    hkey,
+                              BOOL    watch_subtree,
+                              DWORD   notify_filter,
+                              HANDLE  event,
+                              BOOL    asynchronous);
+
+HANDLE CreateEventW        (LPSECURITY_ATTRIBUTES  security_attributes,
+                            BOOL                   manual_reset,
+                            BOOL                   initial_state,
+                            LPCWSTR                name);
+BOOL   SetEvent            (HANDLE                 event);
+BOOL   ResetEvent          (HANDLE                 event);
+DWORD  WaitForSingleObject (HANDLE                 event,
+                            DWORD                  milliseconds);
+BOOL   CloseHandle         (HANDLE                 event);
+
+/* Emulator-only extensions */
+
+typedef enum {
+  REGISTRY_EMULATOR_VALUE_CHANGED,
+  REGISTRY_EMULATOR_KEY_CREATED,
+  REGISTRY_EMULATOR_KEY_DELETED
+} RegistryEmulatorChange;
+
+/* Called from the thread that made the change, once it has been committed.
+ * @key_path is the full path of the key below HKEY_CURRENT_USER, using '\'
+ * as separator. @value_name is only set for REGISTRY_EMULATOR_VALUE_CHANGED,
+ * which covers values being set as well as deleted. */
+typedef void (*RegistryEmulatorChangeFunc) (RegistryEmulatorChange  change,
+                                            const gchar            *key_path,
+                                            const gchar            *value_name,
+                                            gpointer                user_data);
+
+guint  registry_emulator_watch_add      (const gchar                *key_path,
+                                         gboolean                    watch_subtree,
+                                         RegistryEmulatorChangeFunc  func,
+                                         gpointer                    user_data);
+void   registry_emulator_watch_remove   (guint                       watch_id);
+
+void   registry_emulator_set_latency    (gulong                      microseconds);
+gulong registry_emulator_get_latency    (void);
+
+gchar *registry_emulator_error_message  (LONG                        result);
+
+G_END_DECLS
+
+#endif /* G_OS_WIN32 */
+
+#endif /* __REGISTRY_EMULATOR_H__ */
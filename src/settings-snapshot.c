@@ -0,0 +1,180 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <string.h>
+
+#define G_SETTINGS_ENABLE_BACKEND
+#include <gio/gsettingsbackend.h>
+
+#include "settings-snapshot.h"
+
+#define BACKEND_CLASS(_b)  G_SETTINGS_BACKEND_GET_CLASS (_b)
+
+/* Backends are only ever given keys that GSettings has checked, and a
+ * snapshot may come from anywhere */
+static gboolean
+is_valid_key (const gchar *key)
+{
+  return key[0] == '/' && strstr (key, "//") == NULL && !g_str_has_suffix (key, "/");
+}
+
+static const gchar *
+find_invalid_key (GVariant *snapshot)
+{
+  GVariantIter iter;
+  const gchar *key;
+
+  g_variant_iter_init (&iter, snapshot);
+  while (g_variant_iter_next (&iter, "{&smv}", &key, NULL))
+    if (!is_valid_key (key))
+      return key;
+
+  return NULL;
+}
+
+void
+settings_snapshot_add (GVariantBuilder *snapshot,
+                       GSettings       *settings)
+{
+  GSettingsSchema *schema;
+  gchar **names;
+  gchar *path;
+  guint i;
+
+  g_return_if_fail (G_IS_SETTINGS (settings));
+
+  g_object_get (settings, "settings-schema", &schema, "path", &path, NULL);
+
+  names = g_settings_schema_list_keys (schema);
+  for (i = 0; names[i] != NULL; i++)
+    {
+      GVariant *value = g_settings_get_user_value (settings, names[i]);
+      gchar *key = g_strconcat (path, names[i], NULL);
+
+      g_variant_builder_add (snapshot, "{smv}", key, value);
+
+      if (value != NULL)
+        g_variant_unref (value);
+      g_free (key);
+    }
+  g_strfreev (names);
+
+  names = g_settings_list_children (settings);
+  for (i = 0; names[i] != NULL; i++)
+    {
+      GSettings *child = g_settings_get_child (settings, names[i]);
+
+      settings_snapshot_add (snapshot, child);
+      g_object_unref (child);
+    }
+  g_strfreev (names);
+
+  g_settings_schema_unref (schema);
+  g_free (path);
+}
+
+gboolean
+settings_snapshot_save (GVariant     *snapshot,
+                        const gchar  *filename,
+                        GError      **error)
+{
+  GVariant *normal;
+  gboolean success;
+
+  g_return_val_if_fail (g_variant_is_of_type (snapshot, SETTINGS_SNAPSHOT_TYPE), FALSE);
+
+  normal = g_variant_get_normal_form (snapshot);
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    {
+      GVariant *swapped = g_variant_byteswap (normal);
+
+      g_variant_unref (normal);
+      normal = swapped;
+    }
+
+  success = g_file_set_contents (filename, g_variant_get_data (normal),
+                                 g_variant_get_size (normal), error);
+  g_variant_unref (normal);
+
+  return success;
+}
+
+GVariant *
+settings_snapshot_load (const gchar  *filename,
+                        GError      **error)
+{
+  GVariant *snapshot;
+  gchar *contents;
+  gsize length;
+
+  if (!g_file_get_contents (filename, &contents, &length, error))
+    return NULL;
+
+  snapshot = g_variant_new_from_data (SETTINGS_SNAPSHOT_TYPE, contents, length,
+                                      FALSE, g_free, contents);
+  g_variant_ref_sink (snapshot);
+
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    {
+      GVariant *swapped = g_variant_byteswap (snapshot);
+
+      g_variant_unref (snapshot);
+      snapshot = swapped;
+    }
+
+  if (find_invalid_key (snapshot) != NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Snapshot '%s' holds the invalid key '%s'",
+                   filename, find_invalid_key (snapshot));
+      g_variant_unref (snapshot);
+      return NULL;
+    }
+
+  return snapshot;
+}
+
+static void
+variant_unref0 (gpointer value)
+{
+  if (value != NULL)
+    g_variant_unref (value);
+}
+
+gboolean
+settings_snapshot_restore (GVariant         *snapshot,
+                           GSettingsBackend *backend)
+{
+  GVariantIter iter;
+  GVariant *value;
+  gboolean success;
+  gchar *key;
+  GTree *tree;
+
+  g_return_val_if_fail (g_variant_is_of_type (snapshot, SETTINGS_SNAPSHOT_TYPE), FALSE);
+  g_return_val_if_fail (G_IS_SETTINGS_BACKEND (backend), FALSE);
+
+  if (find_invalid_key (snapshot) != NULL)
+    return FALSE;
+
+  /* A NULL value in the tree resets the key */
+  tree = g_tree_new_full ((GCompareDataFunc) strcmp, NULL, g_free, variant_unref0);
+
+  g_variant_iter_init (&iter, snapshot);
+  while (g_variant_iter_next (&iter, "{smv}", &key, &value))
+    g_tree_insert (tree, key, value);
+
+  success = BACKEND_CLASS (backend)->write_tree (backend, tree, NULL);
+  g_tree_unref (tree);
+
+  return success;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <gio/gio.h>
+
+#ifndef __SETTINGS_SNAPSHOT_H__
+#define __SETTINGS_SNAPSHOT_H__
+
+G_BEGIN_DECLS
+
+/* A snapshot maps full key paths, such as "/tests/storage/string", to the
+ * value stored for the key, or to nothing for a key at its default. Build
+ * one with a GVariantBuilder of this type and settings_snapshot_add(). */
+#define SETTINGS_SNAPSHOT_TYPE  G_VARIANT_TYPE ("a{smv}")
+
+/* Adds every key of @settings, and of its children, to @snapshot */
+void      settings_snapshot_add     (GVariantBuilder   *snapshot,
+                                     GSettings         *settings);
+
+/* The file holds the snapshot as serialized little-endian GVariant data.
+ * Loading fails with G_IO_ERROR_INVALID_DATA if a key is not a full key
+ * path: starting with '/', not ending with one, and without "//". */
+gboolean  settings_snapshot_save    (GVariant          *snapshot,
+                                     const gchar       *filename,
+                                     GError           **error);
+GVariant *settings_snapshot_load    (const gchar       *filename,
+                                     GError           **error);
+
+/* Stores every value of @snapshot in @backend, and resets the keys that
+ * were at their defaults, as a single write_tree call. Returns FALSE if
+ * the backend could not write everything, or without writing anything if
+ * a key is not a full key path. */
+gboolean  settings_snapshot_restore (GVariant          *snapshot,
+                                     GSettingsBackend  *backend);
+
+G_END_DECLS
+
+#endif /* __SETTINGS_SNAPSHOT_H__ */
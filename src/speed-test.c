@@ -11,53 +11,3178 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
+#define G_SETTINGS_ENABLE_BACKEND
+#include <gio/gsettingsbackend.h>
+
+#ifdef G_OS_WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <shlwapi.h>
+#endif
+
+#include "bench.h"
+#include "caching-backend.h"
+#include "coalescing-backend.h"
+#include "dedup-backend.h"
+#include "emulated-registry-backend.h"
+#include "settings-snapshot.h"
+#include "utils.h"
+
+static void
+write_distinct_string (guint    iteration,
+                       gpointer user_data)
+{
+  gchar string[32];
+
+  g_snprintf (string, 31, "testing %u", iteration);
+  g_settings_set_string (user_data, "string", string);
+}
+
+static void
+write_identical_string (guint    iteration,
+                        gpointer user_data)
+{
+  g_settings_set_string (user_data, "string", "Testing");
+}
+
+static void
+read_string (guint    iteration,
+             gpointer user_data)
+{
+  g_free (g_settings_get_string (user_data, "string"));
+}
+
+static void
+basic_test (gconstpointer data)
+{
+  GMainLoop *main_loop;
+  GSettings *settings;
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  settings = util_settings_new ("org.gsettings.test.storage-test");
+
+  bench_run ("Write distinct strings", 1000, write_distinct_string, settings);
+  bench_run ("Write identical strings", 1000, write_identical_string, settings);
+  bench_run ("Read string", 1000, read_string, settings);
+
+  g_object_unref (settings);
+  g_main_loop_unref (main_loop);
+}
+
+/* One key of each type in the storage-test schema, with two values to
+ * alternate between */
+typedef struct {
+  const gchar *key;
+  const gchar *value_a;
+  const gchar *value_b;
+} TypeKey;
+
+static const TypeKey type_keys[] = {
+  { "bool", "false", "true" },
+  { "int32", "-999", "1691" },
+  { "qword", "31313131", "-778019" },
+  { "double", "-10000000000.5", "2.99e8" },
+  { "string", "'Testing'", "'Testing again'" },
+  { "strv", "['foo', 'bar']", "['Hello world', 'Pipo', 'bar']" },
+  { "box", "(11, 19, 86)", "(-1, 99, 11111)" },
+  { "noughts-and-crosses", "[(0, 0, 1), (1, 1, 0)]",
+                           "[(1, 2, 0), (2, 1, 1), (2, 2, 1), (0, 0, 0)]" },
+  { "breakfast", "{'eggs': 2.0, 'bacon': 3.0}",
+                 "{'toast': 1.0, 'beans': 0.5, 'tea': 1.0}" }
+};
+
+typedef struct {
+  GSettings   *settings;
+  const gchar *key;
+  GVariant    *value_a;
+  GVariant    *value_b;
+} TypeCase;
+
+static void
+type_get (guint    iteration,
+          gpointer user_data)
+{
+  TypeCase *type_case = user_data;
+
+  g_variant_unref (g_settings_get_value (type_case->settings, type_case->key));
+}
+
+static void
+type_set (guint    iteration,
+          gpointer user_data)
+{
+  TypeCase *type_case = user_data;
+
+  g_settings_set_value (type_case->settings, type_case->key,
+                        (iteration % 2) ? type_case->value_b : type_case->value_a);
+}
+
+static void
+type_set_identical (guint    iteration,
+                    gpointer user_data)
+{
+  TypeCase *type_case = user_data;
+
+  g_settings_set_value (type_case->settings, type_case->key, type_case->value_a);
+}
+
+static void
+type_reset (guint    iteration,
+            gpointer user_data)
+{
+  TypeCase *type_case = user_data;
+
+  g_settings_reset (type_case->settings, type_case->key);
+}
+
+/* get, set, set-identical and reset for every type the schema uses, since
+ * native registry types and GVariant text literals take different paths */
+static void
+types_test (gconstpointer data)
+{
+  GSettings *settings;
+  GString *summary;
+  guint i;
+
+  settings = util_settings_new ("org.gsettings.test.storage-test");
+
+  summary = g_string_new (NULL);
+  g_string_append_printf (summary, "\n%-8s %-24s %12s %12s %12s %12s\n",
+                          "Type", "Key", "get", "set", "set-same", "reset");
+
+  for (i = 0; i < G_N_ELEMENTS (type_keys); i++)
+    {
+      const GVariantType *type;
+      GVariant *current;
+      TypeCase type_case;
+      gdouble get, set, set_identical, reset;
+      gchar *name;
+
+      current = g_settings_get_value (settings, type_keys[i].key);
+      type = g_variant_get_type (current);
+
+      type_case.settings = settings;
+      type_case.key = type_keys[i].key;
+      type_case.value_a = g_variant_parse (type, type_keys[i].value_a, NULL, NULL, NULL);
+      type_case.value_b = g_variant_parse (type, type_keys[i].value_b, NULL, NULL, NULL);
+      g_assert (type_case.value_a != NULL && type_case.value_b != NULL);
+
+      name = g_strdup_printf ("Types/%s/get", type_keys[i].key);
+      get = bench_run (name, 1000, type_get, &type_case)->ns_per_op;
+      g_free (name);
+
+      name = g_strdup_printf ("Types/%s/set", type_keys[i].key);
+      set = bench_run (name, 1000, type_set, &type_case)->ns_per_op;
+      g_free (name);
+
+      name = g_strdup_printf ("Types/%s/set-identical", type_keys[i].key);
+      set_identical = bench_run (name, 1000, type_set_identical, &type_case)->ns_per_op;
+      g_free (name);
+
+      /* Reset a stored value each time rather than an absent one */
+      name = g_strdup_printf ("Types/%s/reset", type_keys[i].key);
+      reset = bench_run_with_setup (name, 1000, type_set, type_reset, &type_case)->ns_per_op;
+      g_free (name);
+
+      g_string_append_printf (summary, "%-8s %-24s %12.0f %12.0f %12.0f %12.0f\n",
+                              g_variant_get_type_string (current), type_keys[i].key,
+                              get, set, set_identical, reset);
+
+      g_variant_unref (type_case.value_b);
+      g_variant_unref (type_case.value_a);
+      g_variant_unref (current);
+    }
+
+  fprintf (stderr, "%s\n", summary->str);
+  g_string_free (summary, TRUE);
+
+  g_object_unref (settings);
+}
+
+typedef enum {
+  CONTENTION_SAME_KEY,        /* one GSettings per thread, all on one path */
+  CONTENTION_DISJOINT_KEYS,   /* one GSettings per thread, one path each */
+  CONTENTION_SHARED_INSTANCE  /* one GSettings used by every thread */
+} ContentionMode;
+
+static const gchar *contention_mode_names[] = {
+  "same-key", "disjoint-keys", "shared-instance"
+};
+
+typedef struct {
+  ContentionMode  mode;
+  guint           n_threads;
+  GSettings      *shared;
+
+  GMutex          lock;
+  GCond           cond;
+  guint           n_ready;
+  gboolean        go;
+  gint            n_finished;
+} Contention;
+
+typedef struct {
+  Contention *contention;
+  guint       index;
+  guint64     end_ns;
+} ContentionThread;
+
+static gint contention_max_threads = 0;
+static gint contention_write_percent = 20;
+static gint contention_ops = 2000;
+
+static gpointer
+contention_thread (gpointer data)
+{
+  ContentionThread *thread = data;
+  Contention *contention = thread->contention;
+  const gchar *markers[] = { "Leeds", "London", "Manchester", "Bristol" };
+  GMainContext *context;
+  GSettings *settings;
+  GRand *rand;
+  gint i;
+
+  /* Change notifications for our own instance are dispatched here */
+  context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+
+  if (contention->mode == CONTENTION_SHARED_INSTANCE)
+    settings = g_object_ref (contention->shared);
+  else
+    {
+      gchar *path;
+
+      if (contention->mode == CONTENTION_DISJOINT_KEYS)
+        path = g_strdup_printf ("/tests/storage/contention/thread%u/", thread->index);
+      else
+        path = g_strdup ("/tests/storage/contention/shared/");
+
+      settings = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                              path);
+      g_free (path);
+    }
+
+  rand = g_rand_new_with_seed (thread->index);
+
+  g_mutex_lock (&contention->lock);
+  contention->n_ready++;
+  g_cond_broadcast (&contention->cond);
+  while (!contention->go)
+    g_cond_wait (&contention->cond, &contention->lock);
+  g_mutex_unlock (&contention->lock);
+
+  for (i = 0; i < contention_ops; i++)
+    {
+      if (g_rand_int_range (rand, 0, 100) < contention_write_percent)
+        g_settings_set (settings, "marker", "ms", markers[i % G_N_ELEMENTS (markers)]);
+      else
+        {
+          gchar *string;
+
+          g_settings_get (settings, "marker", "ms", &string);
+          g_free (string);
+        }
+
+      if (i % 64 == 0)
+        while (g_main_context_iteration (context, FALSE));
+    }
+
+  thread->end_ns = bench_get_time_ns ();
+
+  g_object_unref (settings);
+  while (g_main_context_iteration (context, FALSE));
+
+  g_rand_free (rand);
+  g_main_context_pop_thread_default (context);
+  g_main_context_unref (context);
+
+  g_atomic_int_inc (&contention->n_finished);
+  g_main_context_wakeup (NULL);
+
+  return NULL;
+}
+
+/* Returns the aggregate number of operations per second */
+static gdouble
+run_contention (ContentionMode mode,
+                guint          n_threads)
+{
+  Contention contention = { 0, };
+  ContentionThread *threads;
+  GThread **handles;
+  guint64 start_ns, end_ns = 0;
+  guint i;
+
+  contention.mode = mode;
+  contention.n_threads = n_threads;
+  g_mutex_init (&contention.lock);
+  g_cond_init (&contention.cond);
+
+  if (mode == CONTENTION_SHARED_INSTANCE)
+    contention.shared = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                                     "/tests/storage/contention/shared/");
+
+  threads = g_new0 (ContentionThread, n_threads);
+  handles = g_new (GThread *, n_threads);
+
+  for (i = 0; i < n_threads; i++)
+    {
+      threads[i].contention = &contention;
+      threads[i].index = i;
+      handles[i] = g_thread_new ("contention", contention_thread, &threads[i]);
+    }
+
+  g_mutex_lock (&contention.lock);
+  while (contention.n_ready < n_threads)
+    g_cond_wait (&contention.cond, &contention.lock);
+  start_ns = bench_get_time_ns ();
+  contention.go = TRUE;
+  g_cond_broadcast (&contention.cond);
+  g_mutex_unlock (&contention.lock);
+
+  /* The shared instance delivers its notifications to this thread */
+  while ((guint) g_atomic_int_get (&contention.n_finished) < n_threads)
+    g_main_context_iteration (NULL, TRUE);
+
+  for (i = 0; i < n_threads; i++)
+    {
+      g_thread_join (handles[i]);
+      end_ns = MAX (end_ns, threads[i].end_ns);
+    }
+
+  while (g_main_context_iteration (NULL, FALSE));
+
+  if (contention.shared != NULL)
+    g_object_unref (contention.shared);
+
+  g_free (handles);
+  g_free (threads);
+  g_cond_clear (&contention.cond);
+  g_mutex_clear (&contention.lock);
+
+  return (gdouble) n_threads * contention_ops * 1e9 / (end_ns - start_ns);
+}
+
+/* Aggregate throughput of concurrent readers and writers, for 1, 2, 4 ...
+ * threads. Efficiency is the throughput relative to perfect scaling of the
+ * single-threaded number. */
+static void
+contention_test (gconstpointer data)
+{
+  guint max_threads, n_threads;
+  ContentionMode mode;
+
+  max_threads = contention_max_threads > 0 ? contention_max_threads
+                                           : g_get_num_processors ();
+
+  fprintf (stderr, "\nContention: %d ops per thread, %d%% writes\n",
+           contention_ops, contention_write_percent);
+  fprintf (stderr, "%-16s %8s %14s %12s\n",
+           "Mode", "Threads", "ops/s", "efficiency");
+
+  for (mode = CONTENTION_SAME_KEY; mode <= CONTENTION_SHARED_INSTANCE; mode++)
+    {
+      gdouble single = 0;
+
+      for (n_threads = 1; n_threads <= max_threads;
+           n_threads = (n_threads == max_threads) ? n_threads + 1
+                                                  : MIN (n_threads * 2, max_threads))
+        {
+          gdouble throughput, efficiency;
+          gchar *name;
+
+          throughput = run_contention (mode, n_threads);
+          if (n_threads == 1)
+            single = throughput;
+          efficiency = throughput / (single * n_threads);
+
+          fprintf (stderr, "%-16s %8u %14.0f %11.0f%%\n",
+                   contention_mode_names[mode], n_threads, throughput,
+                   efficiency * 100);
+
+          name = g_strdup_printf ("Contention/%s/%u", contention_mode_names[mode], n_threads);
+          bench_record (name, "ops/s", throughput);
+          g_free (name);
+        }
+    }
+
+  fprintf (stderr, "\n");
+}
+
+/* Writes the schema file @xml to @dir and compiles it there, for tests
+ * that need more keys or schemas than are worth keeping in schemas/ */
+static gboolean
+generated_schemas_compile (const gchar  *dir,
+                           const gchar  *xml,
+                           GError      **error)
+{
+  GSubprocess *compiler;
+  gchar *filename, *targetdir;
+  gboolean success;
+
+  filename = g_build_filename (dir, "generated.gschema.xml", NULL);
+  success = g_file_set_contents (filename, xml, -1, error);
+  g_free (filename);
+
+  if (!success)
+    return FALSE;
+
+  targetdir = g_strconcat ("--targetdir=", dir, NULL);
+  compiler = g_subprocess_new (G_SUBPROCESS_FLAGS_STDERR_SILENCE, error,
+                               "glib-compile-schemas", targetdir, dir, NULL);
+  g_free (targetdir);
+
+  if (compiler == NULL)
+    return FALSE;
+
+  success = g_subprocess_wait_check (compiler, NULL, error);
+  g_object_unref (compiler);
+
+  return success;
+}
+
+static void
+generated_schemas_remove (const gchar *dir)
+{
+  gchar *filename;
+
+  filename = g_build_filename (dir, "gschemas.compiled", NULL);
+  g_remove (filename);
+  g_free (filename);
+  filename = g_build_filename (dir, "generated.gschema.xml", NULL);
+  g_remove (filename);
+  g_free (filename);
+  g_rmdir (dir);
+}
+
+typedef struct {
+  GSettings  *settings;
+  guint       n_keys;
+  gboolean    delayed;
+
+  guint       n_changed;
+  guint       n_change_events;
+} BatchCase;
+
+static void
+batch_changed (GSettings   *settings,
+               const gchar *key,
+               BatchCase   *batch)
+{
+  batch->n_changed++;
+}
+
+static gboolean
+batch_change_event (GSettings    *settings,
+                    const GQuark *keys,
+                    gint          n_keys,
+                    BatchCase    *batch)
+{
+  batch->n_change_events++;
+
+  return FALSE;
+}
+
+/* Writes the first K keys once, either one at a time or into one delayed
+ * GSettings that is applied once at the end */
+static void
+batch_write (guint    iteration,
+             gpointer user_data)
+{
+  BatchCase *batch = user_data;
+  gchar key[16], value[32];
+  guint i;
+
+  g_snprintf (value, sizeof (value), "batch %u", iteration);
+
+  for (i = 0; i < batch->n_keys; i++)
+    {
+      g_snprintf (key, sizeof (key), "k%u", i);
+      g_settings_set (batch->settings, key, "ms", value);
+    }
+
+  if (batch->delayed)
+    g_settings_apply (batch->settings);
+}
+
+#define BATCH_MAX_KEYS 1000
+
+/* How much backend work and signal traffic writing K keys of one schema
+ * causes with and without g_settings_delay(), and how long it takes. The
+ * schema with enough keys for that is generated. */
+static void
+batch_test (gconstpointer data)
+{
+  static const guint sizes[] = { 1, 10, 100, BATCH_MAX_KEYS };
+  GSettingsSchemaSource *source;
+  GSettingsSchema *schema;
+  GError *error = NULL;
+  GString *xml;
+  gchar *dir;
+  guint s, i, mode;
+
+  dir = g_dir_make_tmp ("speed-test-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  xml = g_string_new ("<schemalist>\n"
+                      "  <schema id=\"org.gsettings.test.generated.batch\">\n");
+  for (i = 0; i < BATCH_MAX_KEYS; i++)
+    g_string_append_printf (xml, "    <key name=\"k%u\" type=\"ms\"><default>nothing</default></key>\n", i);
+  g_string_append (xml, "  </schema>\n</schemalist>\n");
+
+  if (!generated_schemas_compile (dir, xml->str, &error))
+    {
+      g_test_skip (error->message);
+      g_clear_error (&error);
+      g_string_free (xml, TRUE);
+      generated_schemas_remove (dir);
+      g_free (dir);
+      return;
+    }
+  g_string_free (xml, TRUE);
+
+  source = g_settings_schema_source_new_from_directory (dir, NULL, FALSE, &error);
+  g_assert_no_error (error);
+  schema = g_settings_schema_source_lookup (source, "org.gsettings.test.generated.batch", FALSE);
+  g_assert (schema != NULL);
+
+  fprintf (stderr, "\n%-10s %6s %14s %12s %12s %12s %14s\n",
+           "Mode", "K", "us/batch", "writes", "tree writes", "changed", "change-events");
+
+  for (s = 0; s < G_N_ELEMENTS (sizes); s++)
+    for (mode = 0; mode < 2; mode++)
+      {
+        BatchCase batch = { NULL, sizes[s], mode == 1, 0, 0 };
+        const BenchResult *result;
+        guint n_changed, n_change_events;
+        gchar *name;
+#ifndef G_OS_WIN32
+        EmulatedRegistryBackendStats stats = { 0, };
+#endif
+
+        batch.settings = g_settings_new_full (schema, util_settings_backend_get (),
+                                              "/tests/storage/batch/");
+        g_signal_connect (batch.settings, "changed",
+                          G_CALLBACK (batch_changed), &batch);
+        g_signal_connect (batch.settings, "change-event",
+                          G_CALLBACK (batch_change_event), &batch);
+
+        if (batch.delayed)
+          g_settings_delay (batch.settings);
+
+        /* One untimed pass to count what a single batch costs */
+#ifndef G_OS_WIN32
+        emulated_registry_backend_reset_stats (util_settings_backend_get ());
+#endif
+        batch_write (0, &batch);
+        util_main_settle ();
+        n_changed = batch.n_changed;
+        n_change_events = batch.n_change_events;
+#ifndef G_OS_WIN32
+        emulated_registry_backend_get_stats (util_settings_backend_get (), &stats);
+#endif
+
+        name = g_strdup_printf ("Batch/%s/%u", batch.delayed ? "delayed" : "individual",
+                                batch.n_keys);
+        result = bench_run (name, 1, batch_write, &batch);
+
+#ifndef G_OS_WIN32
+        fprintf (stderr, "%-10s %6u %14.1f %12u %12u %12u %14u\n",
+                 batch.delayed ? "delayed" : "individual", batch.n_keys,
+                 result->ns_per_op / 1000.0, stats.n_writes, stats.n_tree_writes,
+                 n_changed, n_change_events);
+
+        g_free (name);
+        name = g_strdup_printf ("Batch/%s/%u/backend-writes",
+                                batch.delayed ? "delayed" : "individual", batch.n_keys);
+        bench_record (name, "calls", stats.n_writes + stats.n_tree_writes);
+#else
+        fprintf (stderr, "%-10s %6u %14.1f %12s %12s %12u %14u\n",
+                 batch.delayed ? "delayed" : "individual", batch.n_keys,
+                 result->ns_per_op / 1000.0, "-", "-",
+                 n_changed, n_change_events);
+#endif
+
+        g_free (name);
+        name = g_strdup_printf ("Batch/%s/%u/signals",
+                                batch.delayed ? "delayed" : "individual", batch.n_keys);
+        bench_record (name, "emissions", n_changed + n_change_events);
+        g_free (name);
+
+        for (i = 0; i < batch.n_keys; i++)
+          {
+            gchar key[16];
+
+            g_snprintf (key, sizeof (key), "k%u", i);
+            g_settings_reset (batch.settings, key);
+          }
+        if (batch.delayed)
+          g_settings_apply (batch.settings);
+        util_main_settle ();
+
+        g_object_unref (batch.settings);
+      }
+
+  g_settings_schema_unref (schema);
+  g_settings_schema_source_unref (source);
+  generated_schemas_remove (dir);
+  g_free (dir);
+}
+
+#define COALESCE_WRITES 1000
+
+typedef struct {
+  GSettings *settings;
+  GMainLoop *main_loop;
+  guint      n_writes;
+  guint64    set_ns;
+} CoalesceCase;
+
+static gboolean
+coalesce_motion (gpointer user_data)
+{
+  CoalesceCase *coalesce = user_data;
+  gchar value[32];
+  guint64 start;
+
+  g_snprintf (value, sizeof (value), "slider %u", coalesce->n_writes);
+
+  start = bench_get_time_ns ();
+  g_settings_set_string (coalesce->settings, "string", value);
+  coalesce->set_ns += bench_get_time_ns () - start;
+
+  if (++coalesce->n_writes < COALESCE_WRITES)
+    return TRUE;
+
+  g_main_loop_quit (coalesce->main_loop);
+
+  return FALSE;
+}
+
+/* A slider being dragged: a motion event every millisecond writes the
+ * setting, with the main loop running in between as it would in an
+ * application. @flush_interval_ms of -1 means writing straight to the
+ * backend. */
+static void
+coalesce_case (const gchar *name,
+               gint         flush_interval_ms)
+{
+  CoalesceCase coalesce = { NULL, };
+  GSettingsBackend *backend;
+  GSettings *check;
+  gchar *metric, *string;
+#ifndef G_OS_WIN32
+  EmulatedRegistryBackendStats stats;
+  guint n_backend_writes;
+
+  emulated_registry_backend_reset_stats (util_settings_backend_get ());
+#endif
+
+  if (flush_interval_ms < 0)
+    backend = g_object_ref (util_settings_backend_get ());
+  else
+    backend = coalescing_backend_new (util_settings_backend_get (), flush_interval_ms);
+
+  coalesce.settings = g_settings_new_with_backend ("org.gsettings.test.storage-test", backend);
+  coalesce.main_loop = g_main_loop_new (NULL, FALSE);
+
+  g_timeout_add (1, coalesce_motion, &coalesce);
+  g_main_loop_run (coalesce.main_loop);
+
+  /* The button is let go */
+  if (flush_interval_ms >= 0)
+    coalescing_backend_flush (backend);
+
+  /* Nothing may be lost on the way */
+  check = util_settings_new ("org.gsettings.test.storage-test");
+  string = g_settings_get_string (check, "string");
+  g_assert_cmpstr (string, ==, "slider 999");
+  g_free (string);
+  g_object_unref (check);
+
+  metric = g_strdup_printf ("Coalesce/%s/set", name);
+  bench_record (metric, "ns", (gdouble) coalesce.set_ns / COALESCE_WRITES);
+  g_free (metric);
+
+#ifndef G_OS_WIN32
+  emulated_registry_backend_get_stats (util_settings_backend_get (), &stats);
+  n_backend_writes = stats.n_writes + stats.n_tree_writes;
+
+  fprintf (stderr, "%-28s %14.1f %14u %14.1f\n", name,
+           coalesce.set_ns / 1000.0 / COALESCE_WRITES, n_backend_writes,
+           n_backend_writes > 0 ? (gdouble) COALESCE_WRITES / n_backend_writes : 0);
+
+  metric = g_strdup_printf ("Coalesce/%s/backend-writes", name);
+  bench_record (metric, "calls", n_backend_writes);
+  g_free (metric);
+#else
+  fprintf (stderr, "%-28s %14.1f %14s %14s\n", name,
+           coalesce.set_ns / 1000.0 / COALESCE_WRITES, "-", "-");
+#endif
+
+  g_main_loop_unref (coalesce.main_loop);
+  g_object_unref (coalesce.settings);
+  g_object_unref (backend);
+}
+
+/* What writes to one key at the pace of a dragged slider cost the caller
+ * and the backend, with and without the coalescing backend in between */
+static void
+coalesce_test (gconstpointer data)
+{
+  fprintf (stderr, "\n%-28s %14s %14s %14s\n", "Backend", "us/set",
+           "backend writes", "sets/write");
+
+  coalesce_case ("direct", -1);
+  coalesce_case ("coalescing/idle", 0);
+  coalesce_case ("coalescing/16ms", 16);
+  coalesce_case ("coalescing/100ms", 100);
+}
+
+typedef struct {
+  GSettingsBackend *backend;
+  GSettings        *settings;
+  const gchar      *key;
+  gchar            *path;
+} CacheCase;
+
+static void
+cache_read (guint    iteration,
+            gpointer user_data)
+{
+  CacheCase *cache_case = user_data;
+
+  g_variant_unref (g_settings_get_value (cache_case->settings, cache_case->key));
+}
+
+static void
+cache_invalidate (guint    iteration,
+                  gpointer user_data)
+{
+  CacheCase *cache_case = user_data;
+
+  caching_backend_invalidate (cache_case->backend, cache_case->path);
+}
+
+/* Reads straight from the backend, and through the caching backend with
+ * the entry dropped before every read (cold) and kept (warm) */
+static void
+cache_test (gconstpointer data)
+{
+  static const gchar *keys[] = { "string", "breakfast" };
+  GSettings *direct;
+  CacheCase cache_case;
+  gchar *name;
+  guint i;
+
+  direct = util_settings_new ("org.gsettings.test.storage-test");
+
+  cache_case.backend = caching_backend_new (util_settings_backend_get ());
+  cache_case.settings = g_settings_new_with_backend ("org.gsettings.test.storage-test",
+                                                     cache_case.backend);
+
+  /* Make sure there is a stored value to read */
+  g_settings_set_string (direct, "string", "Testing");
+  g_settings_set_value (direct, "breakfast",
+                        g_variant_parse (G_VARIANT_TYPE ("a{sd}"),
+                                         "{'eggs': 2.0, 'bacon': 3.5, 'toast': 1.0}",
+                                         NULL, NULL, NULL));
+
+  for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    {
+      CacheCase direct_case = { NULL, direct, keys[i], NULL };
+
+      cache_case.key = keys[i];
+      cache_case.path = g_strconcat ("/tests/storage/", keys[i], NULL);
+
+      name = g_strdup_printf ("Cache/%s/direct", keys[i]);
+      bench_run (name, 1000, cache_read, &direct_case);
+      g_free (name);
+
+      name = g_strdup_printf ("Cache/%s/cold", keys[i]);
+      bench_run_with_setup (name, 1000, cache_invalidate, cache_read, &cache_case);
+      g_free (name);
+
+      name = g_strdup_printf ("Cache/%s/warm", keys[i]);
+      bench_run (name, 1000, cache_read, &cache_case);
+      g_free (name);
+
+      g_free (cache_case.path);
+    }
+
+  g_object_unref (cache_case.settings);
+  g_object_unref (cache_case.backend);
+  g_object_unref (direct);
+}
+
+static void
+count_changed (GSettings   *settings,
+               const gchar *key,
+               guint       *n_changed)
+{
+  (*n_changed)++;
+}
+
+/* "Write identical strings" straight to the backend and with identical
+ * writes dropped, comparing against what is stored or what is cached */
+static void
+identical_test (gconstpointer data)
+{
+  static const gchar *names[] = { "direct", "dedup", "dedup+cache" };
+  GSettingsBackend *caching;
+  guint i;
+
+  caching = caching_backend_new (util_settings_backend_get ());
+
+  fprintf (stderr, "\n%-24s %12s %14s %12s\n",
+           "Identical writes", "ns/op", "backend writes", "changed");
+
+  for (i = 0; i < G_N_ELEMENTS (names); i++)
+    {
+      GSettingsBackend *backend;
+      GSettings *settings;
+      const BenchResult *result;
+      guint n_changed = 0;
+      gchar *name;
+#ifndef G_OS_WIN32
+      EmulatedRegistryBackendStats stats;
+#endif
+
+      if (i == 0)
+        backend = g_object_ref (util_settings_backend_get ());
+      else if (i == 1)
+        backend = dedup_backend_new (util_settings_backend_get ());
+      else
+        backend = dedup_backend_new (caching);
+
+      settings = g_settings_new_with_backend ("org.gsettings.test.storage-test", backend);
+      g_signal_connect (settings, "changed", G_CALLBACK (count_changed), &n_changed);
+
+      g_settings_set_string (settings, "string", "Testing");
+      util_main_settle ();
+      n_changed = 0;
+
+#ifndef G_OS_WIN32
+      emulated_registry_backend_reset_stats (util_settings_backend_get ());
+#endif
+
+      name = g_strdup_printf ("Identical/%s", names[i]);
+      result = bench_run (name, 1000, write_identical_string, settings);
+      g_free (name);
+
+      util_main_settle ();
+
+#ifndef G_OS_WIN32
+      emulated_registry_backend_get_stats (util_settings_backend_get (), &stats);
+      fprintf (stderr, "%-24s %12.0f %14u %12u\n", names[i], result->ns_per_op,
+               stats.n_writes + stats.n_tree_writes, n_changed);
+
+      name = g_strdup_printf ("Identical/%s/backend-writes", names[i]);
+      bench_record (name, "calls", stats.n_writes + stats.n_tree_writes);
+      g_free (name);
+#else
+      fprintf (stderr, "%-24s %12.0f %14s %12u\n", names[i], result->ns_per_op,
+               "-", n_changed);
+#endif
+
+      g_object_unref (settings);
+      g_object_unref (backend);
+    }
+
+  g_object_unref (caching);
+}
+
+typedef struct {
+  HKEY  *hkeys;
+  guint  n_paths;
+  guint  n_changed;
+} WatchCase;
+
+static void
+watch_changed (GSettings   *settings,
+               const gchar *key,
+               WatchCase   *watch_case)
+{
+  watch_case->n_changed++;
+}
+
+/* An external change to one of the watched paths, which is delivered to
+ * its GSettings before RegSetValueExW() returns on the emulator */
+static void
+watch_external_write (guint    iteration,
+                      gpointer user_data)
+{
+  WatchCase *watch_case = user_data;
+  HKEY hkey = watch_case->hkeys[(iteration * 7919) % watch_case->n_paths];
+
+  RegSetValueExW (hkey, L"marker", 0, REG_SZ, (const BYTE *)L"'moved'", 8 * sizeof (gunichar2));
+}
+
+/* Cost of watching many relocated paths at once: subscribing, routing an
+ * external change to the right one, and unsubscribing */
+static void
+watches_test (gconstpointer data)
+{
+#ifdef G_OS_WIN32
+  /* GIO's registry backend can only wait on so many keys */
+  static const guint sizes[] = { 10, 62 };
+#else
+  static const guint sizes[] = { 10, 100, 1000, 10000 };
+#endif
+  HKEY hstorage;
+  guint s, i;
+
+  if (!util_registry_open_path ("tests\\storage", &hstorage))
+    return;
+
+  fprintf (stderr, "\n%-8s %16s %16s %16s\n",
+           "Paths", "subscribe us", "dispatch ns", "unsubscribe us");
+
+  for (s = 0; s < G_N_ELEMENTS (sizes); s++)
+    {
+      WatchCase watch_case = { NULL, sizes[s], 0 };
+      const BenchResult *result;
+      GSettings **settings;
+      guint64 start, subscribe_ns, unsubscribe_ns;
+      gchar *name;
+
+      settings = g_new (GSettings *, watch_case.n_paths);
+      watch_case.hkeys = g_new (HKEY, watch_case.n_paths);
+
+      for (i = 0; i < watch_case.n_paths; i++)
+        {
+          gchar *key_name = g_strdup_printf ("prefix%u", i);
+          gunichar2 *key_namew = g_utf8_to_utf16 (key_name, -1, NULL, NULL, NULL);
+          LONG status;
+
+          status = RegCreateKeyExW (hstorage, key_namew, 0, NULL, 0, KEY_ALL_ACCESS,
+                                    NULL, &watch_case.hkeys[i], NULL);
+          g_assert_no_win32_error (status, "Error creating a path");
+
+          g_free (key_namew);
+          g_free (key_name);
+        }
+
+      start = bench_get_time_ns ();
+      for (i = 0; i < watch_case.n_paths; i++)
+        {
+          gchar path[64];
+
+          g_snprintf (path, sizeof (path), "/tests/storage/prefix%u/", i);
+          settings[i] = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                                     path);
+          g_signal_connect (settings[i], "changed", G_CALLBACK (watch_changed), &watch_case);
+        }
+      subscribe_ns = bench_get_time_ns () - start;
+
+      name = g_strdup_printf ("Watches/%u/dispatch", watch_case.n_paths);
+      result = bench_run (name, 1000, watch_external_write, &watch_case);
+      g_free (name);
+
+      util_main_settle ();
+      g_assert_cmpuint (watch_case.n_changed, >, 0);
+
+      start = bench_get_time_ns ();
+      for (i = 0; i < watch_case.n_paths; i++)
+        g_object_unref (settings[i]);
+      unsubscribe_ns = bench_get_time_ns () - start;
+
+      fprintf (stderr, "%-8u %16.2f %16.0f %16.2f\n", watch_case.n_paths,
+               subscribe_ns / 1000.0 / watch_case.n_paths, result->ns_per_op,
+               unsubscribe_ns / 1000.0 / watch_case.n_paths);
+
+      name = g_strdup_printf ("Watches/%u/subscribe", watch_case.n_paths);
+      bench_record (name, "ns/path", (gdouble) subscribe_ns / watch_case.n_paths);
+      g_free (name);
+      name = g_strdup_printf ("Watches/%u/unsubscribe", watch_case.n_paths);
+      bench_record (name, "ns/path", (gdouble) unsubscribe_ns / watch_case.n_paths);
+      g_free (name);
+
+      for (i = 0; i < watch_case.n_paths; i++)
+        RegCloseKey (watch_case.hkeys[i]);
+      g_free (watch_case.hkeys);
+      g_free (settings);
+    }
+
+  RegCloseKey (hstorage);
+}
+
+/* What each GSettings instance costs while it is alive, for instances
+ * sharing one path and for instances each watching a path of their own */
+static void
+footprint_test (gconstpointer data)
+{
+  static const guint sizes[] = { 10, 100, 1000, 10000, 100000 };
+  static const gchar *modes[] = { "same-path", "distinct-paths" };
+  gboolean have_alloc_stats;
+  BenchAllocStats dummy;
+  guint s, mode, i;
+
+  have_alloc_stats = bench_get_alloc_stats (&dummy);
+
+  fprintf (stderr, "\n%-16s %8s %14s %14s %14s\n",
+           "Mode", "N", "RSS B/inst", "heap B/inst", "allocs/inst");
+
+  for (mode = 0; mode < G_N_ELEMENTS (modes); mode++)
+    for (s = 0; s < G_N_ELEMENTS (sizes); s++)
+      {
+        BenchAllocStats before, after;
+        GSettings **settings;
+        gsize rss_before, rss_after;
+        gdouble rss_per, heap_per, allocs_per;
+        guint n = sizes[s];
+        gchar *name;
+
+#ifdef G_OS_WIN32
+        /* GIO's registry backend can only wait on so many keys */
+        if (mode == 1 && n > 62)
+          continue;
+#endif
+
+        settings = g_new (GSettings *, n);
+
+        rss_before = bench_get_rss ();
+        bench_get_alloc_stats (&before);
+
+        for (i = 0; i < n; i++)
+          {
+            if (mode == 0)
+              settings[i] = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                                         "/tests/storage/footprint/");
+            else
+              {
+                gchar path[64];
+
+                g_snprintf (path, sizeof (path), "/tests/storage/footprint%u/", i);
+                settings[i] = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                                           path);
+              }
+          }
+
+        bench_get_alloc_stats (&after);
+        rss_after = bench_get_rss ();
+
+        rss_per = ((gdouble) rss_after - (gdouble) rss_before) / n;
+        heap_per = (gdouble) (after.bytes_live - before.bytes_live) / n;
+        allocs_per = (gdouble) (after.n_allocations - before.n_allocations) / n;
+
+        if (have_alloc_stats)
+          fprintf (stderr, "%-16s %8u %14.0f %14.0f %14.1f\n",
+                   modes[mode], n, rss_per, heap_per, allocs_per);
+        else
+          fprintf (stderr, "%-16s %8u %14.0f %14s %14s\n",
+                   modes[mode], n, rss_per, "-", "-");
+
+        name = g_strdup_printf ("Footprint/%s/%u/rss", modes[mode], n);
+        bench_record (name, "bytes/instance", rss_per);
+        g_free (name);
+
+        if (have_alloc_stats)
+          {
+            name = g_strdup_printf ("Footprint/%s/%u/heap", modes[mode], n);
+            bench_record (name, "bytes/instance", heap_per);
+            g_free (name);
+
+            name = g_strdup_printf ("Footprint/%s/%u/allocations", modes[mode], n);
+            bench_record (name, "allocations/instance", allocs_per);
+            g_free (name);
+          }
+
+        for (i = 0; i < n; i++)
+          g_object_unref (settings[i]);
+        g_free (settings);
+      }
+}
+
+typedef struct {
+  GSettings        *settings;
+  UtilSettingsView *view;
+  const gchar      *key;
+} BorrowCase;
+
+static void
+borrow_get_copy (guint    iteration,
+                 gpointer user_data)
+{
+  BorrowCase *borrow = user_data;
+
+  if (strcmp (borrow->key, "string") == 0)
+    g_free (g_settings_get_string (borrow->settings, borrow->key));
+  else if (strcmp (borrow->key, "strv") == 0)
+    g_strfreev (g_settings_get_strv (borrow->settings, borrow->key));
+  else
+    {
+      GVariantIter *iter;
+
+      g_settings_get (borrow->settings, borrow->key, "a{sd}", &iter);
+      g_variant_iter_free (iter);
+    }
+}
+
+static void
+borrow_get_value (guint    iteration,
+                  gpointer user_data)
+{
+  BorrowCase *borrow = user_data;
+  GVariant *value;
+
+  value = g_settings_get_value (borrow->settings, borrow->key);
+
+  if (strcmp (borrow->key, "string") == 0)
+    g_variant_get_string (value, NULL);
+  else if (strcmp (borrow->key, "strv") == 0)
+    g_free (g_variant_get_strv (value, NULL));
+
+  g_variant_unref (value);
+}
+
+static void
+borrow_peek (guint    iteration,
+             gpointer user_data)
+{
+  BorrowCase *borrow = user_data;
+
+  if (strcmp (borrow->key, "string") == 0)
+    util_settings_view_peek_string (borrow->view, borrow->key);
+  else if (strcmp (borrow->key, "strv") == 0)
+    util_settings_view_peek_strv (borrow->view, borrow->key);
+  else
+    util_settings_view_peek_value (borrow->view, borrow->key);
+}
+
+/* Copying getters, getting the GVariant and borrowing from it, and
+ * borrowing from a UtilSettingsView */
+static void
+borrow_test (gconstpointer data)
+{
+  static const gchar *keys[] = { "string", "strv", "breakfast" };
+  BorrowCase borrow;
+  gchar *name;
+  guint i;
+
+  borrow.settings = util_settings_new ("org.gsettings.test.storage-test");
+  borrow.view = util_settings_view_new (borrow.settings);
+
+  for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    {
+      borrow.key = keys[i];
+
+      name = g_strdup_printf ("Borrow/%s/copy", keys[i]);
+      bench_run (name, 1000, borrow_get_copy, &borrow);
+      g_free (name);
+
+      name = g_strdup_printf ("Borrow/%s/get-value", keys[i]);
+      bench_run (name, 1000, borrow_get_value, &borrow);
+      g_free (name);
+
+      name = g_strdup_printf ("Borrow/%s/view", keys[i]);
+      bench_run (name, 1000, borrow_peek, &borrow);
+      g_free (name);
+    }
+
+  /* A change has to show through the view */
+  g_settings_set_string (borrow.settings, "string", "Borrowed");
+  util_main_settle ();
+  g_assert_cmpstr (util_settings_view_peek_string (borrow.view, "string"), ==, "Borrowed");
+
+  util_settings_view_free (borrow.view);
+  g_object_unref (borrow.settings);
+}
+
+/* An as, a(iii) or a{sd} value with @n_elements elements, shaped like the
+ * strv, noughts-and-crosses and breakfast keys */
+static GVariant *
+large_value_new (const gchar *type_string,
+                 guint        n_elements)
+{
+  GVariantBuilder builder;
+  guint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (type_string));
+
+  for (i = 0; i < n_elements; i++)
+    {
+      if (type_string[1] == 's')
+        {
+          gchar string[32];
+
+          g_snprintf (string, sizeof (string), "string %u", i);
+          g_variant_builder_add (&builder, "s", string);
+        }
+      else if (type_string[1] == '(')
+        g_variant_builder_add (&builder, "(iii)", i, i % 3, -(gint) i);
+      else
+        {
+          gchar name[32];
+
+          g_snprintf (name, sizeof (name), "item %u", i);
+          g_variant_builder_add (&builder, "{sd}", name, i * 0.5);
+        }
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+typedef struct {
+  const GVariantType *type;
+  gchar              *text;
+  GBytes             *bytes;
+
+  GSettings          *settings;
+  const gchar        *key;
+} LargeValue;
+
+/* Reading every element is what makes a serialized value do its work,
+ * so both forms are made to pay for it */
+static void
+large_value_visit (GVariant *value)
+{
+  GVariantIter iter;
+  GVariant *child;
+
+  g_variant_iter_init (&iter, value);
+  while ((child = g_variant_iter_next_value (&iter)) != NULL)
+    g_variant_unref (child);
+}
+
+static void
+large_value_parse_text (guint    iteration,
+                        gpointer user_data)
+{
+  LargeValue *large = user_data;
+  GVariant *value;
+
+  value = g_variant_parse (large->type, large->text, NULL, NULL, NULL);
+  large_value_visit (value);
+  g_variant_unref (value);
+}
+
+static void
+large_value_from_bytes (guint    iteration,
+                        gpointer user_data)
+{
+  LargeValue *large = user_data;
+  GVariant *value;
+
+  value = g_variant_new_from_bytes (large->type, large->bytes, FALSE);
+  large_value_visit (value);
+  g_variant_unref (value);
+}
+
+#ifndef G_OS_WIN32
+static void
+large_value_get (guint    iteration,
+                 gpointer user_data)
+{
+  LargeValue *large = user_data;
+  GVariant *value;
+
+  value = g_settings_get_value (large->settings, large->key);
+  large_value_visit (value);
+  g_variant_unref (value);
+}
+#endif
+
+/* Decoding growing a(iii) and a{sd} values from GVariant text, as the
+ * registry backends store them, against loading them from serialized
+ * bytes; and on the emulated registry, reading them through GSettings
+ * in both storage modes */
+static void
+large_values_test (gconstpointer data)
+{
+  static const gchar *keys[] = { "noughts-and-crosses", "breakfast" };
+  static const gchar *types[] = { "a(iii)", "a{sd}" };
+  static const guint sizes[] = { 1, 10, 100, 1000 };
+#ifndef G_OS_WIN32
+  GSettingsBackend *binary_backend;
+  GSettings *text_settings, *binary_settings;
+#endif
+  gchar *name;
+  guint i, j;
+
+#ifndef G_OS_WIN32
+  binary_backend = emulated_registry_backend_new ();
+  emulated_registry_backend_set_binary_values (binary_backend, TRUE);
+
+  text_settings = util_settings_new ("org.gsettings.test.storage-test");
+  binary_settings = g_settings_new_with_backend ("org.gsettings.test.storage-test",
+                                                 binary_backend);
+#endif
+
+  for (i = 0; i < G_N_ELEMENTS (types); i++)
+    for (j = 0; j < G_N_ELEMENTS (sizes); j++)
+      {
+        GVariant *value = large_value_new (types[i], sizes[j]);
+        LargeValue large;
+
+        large.type = g_variant_get_type (value);
+        large.text = g_variant_print (value, FALSE);
+        large.bytes = g_variant_get_data_as_bytes (value);
+
+        name = g_strdup_printf ("LargeValues/%s/%u/parse-text", types[i], sizes[j]);
+        bench_run (name, 1000, large_value_parse_text, &large);
+        g_free (name);
+
+        name = g_strdup_printf ("LargeValues/%s/%u/from-bytes", types[i], sizes[j]);
+        bench_run (name, 1000, large_value_from_bytes, &large);
+        g_free (name);
+
+#ifndef G_OS_WIN32
+        large.key = keys[i];
+
+        large.settings = text_settings;
+        g_settings_set_value (large.settings, large.key, value);
+        name = g_strdup_printf ("LargeValues/%s/%u/registry-text", types[i], sizes[j]);
+        bench_run (name, 1000, large_value_get, &large);
+        g_free (name);
+
+        large.settings = binary_settings;
+        g_settings_set_value (large.settings, large.key, value);
+        name = g_strdup_printf ("LargeValues/%s/%u/registry-binary", types[i], sizes[j]);
+        bench_run (name, 1000, large_value_get, &large);
+        g_free (name);
+
+        g_settings_reset (text_settings, keys[i]);
+#endif
+
+        g_bytes_unref (large.bytes);
+        g_free (large.text);
+        g_variant_unref (value);
+      }
+
+#ifndef G_OS_WIN32
+  g_object_unref (binary_settings);
+  g_object_unref (text_settings);
+  g_object_unref (binary_backend);
+#endif
+}
+
+/* Serialized sizes swept by the throughput test, 10 B to 1 MB */
+static const gsize throughput_sizes[] = { 10, 100, 1000, 10000, 100000, 1000000 };
+
+/* Cost per byte this far above the cheapest seen at a smaller size means
+ * the operation has stopped scaling linearly */
+#define THROUGHPUT_SUPERLINEAR_FACTOR 1.5
+
+typedef struct {
+  GSettings   *settings;
+  const gchar *key;
+  GVariant    *value;
+} ThroughputCase;
+
+static void
+throughput_get (guint    iteration,
+                gpointer user_data)
+{
+  ThroughputCase *throughput = user_data;
+
+  g_variant_unref (g_settings_get_value (throughput->settings, throughput->key));
+}
+
+static void
+throughput_set (guint    iteration,
+                gpointer user_data)
+{
+  ThroughputCase *throughput = user_data;
+
+  g_settings_set_value (throughput->settings, throughput->key, throughput->value);
+}
+
+/* The largest value of @type_string that serializes to about @size bytes,
+ * but at least one element */
+static GVariant *
+throughput_value_new (const gchar *type_string,
+                      gsize        size)
+{
+  GVariant *sample;
+  gsize element_size;
+
+  sample = large_value_new (type_string, 16);
+  element_size = MAX (g_variant_get_size (sample) / 16, 1);
+  g_variant_unref (sample);
+
+  return large_value_new (type_string, MAX (size / element_size, 1));
+}
+
+/* Get and set throughput for as, a(iii) and a{sd} values from 10 B to 1 MB
+ * serialized. Fixed costs make small values cheap per byte; the point at
+ * which the cost per byte starts to grow again is where it turns
+ * superlinear. */
+static void
+throughput_test (gconstpointer data)
+{
+  static const struct {
+    const gchar *key;
+    const gchar *type_string;
+  } keys[] = {
+    { "strings", "as" },
+    { "triples", "a(iii)" },
+    { "prices",  "a{sd}" }
+  };
+  static const gchar *ops[] = { "get", "set" };
+  static const BenchFunc funcs[] = { throughput_get, throughput_set };
+  ThroughputCase throughput;
+  gchar *name;
+  guint i, j, op;
+
+  throughput.settings = util_settings_new ("org.gsettings.test.large-values");
+
+  fprintf (stderr, "\nThroughput\n");
+  fprintf (stderr, "%-8s %-4s %10s %10s %14s %12s %10s\n",
+           "Type", "Op", "Target", "Bytes", "ns/op", "MB/s", "ns/B");
+
+  for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    for (op = 0; op < G_N_ELEMENTS (ops); op++)
+      {
+        const gchar *type_string = keys[i].type_string;
+        gdouble min_ns_per_byte = G_MAXDOUBLE;
+        gsize superlinear_from = 0;
+
+        throughput.key = keys[i].key;
+
+        for (j = 0; j < G_N_ELEMENTS (throughput_sizes); j++)
+          {
+            const BenchResult *result;
+            gdouble ns_per_byte, mb_per_s;
+            guint iterations;
+            gsize size;
+
+            throughput.value = throughput_value_new (type_string, throughput_sizes[j]);
+            size = g_variant_get_size (throughput.value);
+
+            /* Keep each run to roughly the same amount of data */
+            iterations = CLAMP ((16 << 20) / size, 10, 1000);
+
+            g_settings_set_value (throughput.settings, throughput.key, throughput.value);
+
+            name = g_strdup_printf ("Throughput/%s/%s/%" G_GSIZE_FORMAT,
+                                    type_string, ops[op], throughput_sizes[j]);
+            result = bench_run (name, iterations, funcs[op], &throughput);
+            g_free (name);
+
+            ns_per_byte = result->ns_per_op / size;
+            mb_per_s = size * 1e3 / result->ns_per_op;
+
+            fprintf (stderr, "%-8s %-4s %10" G_GSIZE_FORMAT " %10" G_GSIZE_FORMAT
+                     " %14.0f %12.1f %10.2f\n",
+                     type_string, ops[op], throughput_sizes[j], size,
+                     result->ns_per_op, mb_per_s, ns_per_byte);
+
+            name = g_strdup_printf ("Throughput/%s/%s/%" G_GSIZE_FORMAT "/rate",
+                                    type_string, ops[op], throughput_sizes[j]);
+            bench_record (name, "MB/s", mb_per_s);
+            g_free (name);
+
+            if (superlinear_from == 0 &&
+                ns_per_byte > min_ns_per_byte * THROUGHPUT_SUPERLINEAR_FACTOR)
+              superlinear_from = size;
+            min_ns_per_byte = MIN (min_ns_per_byte, ns_per_byte);
+
+            /* Don't leave a megabyte of notifications to the next run */
+            util_main_settle ();
+
+            g_variant_unref (throughput.value);
+          }
+
+        if (superlinear_from > 0)
+          fprintf (stderr, "%s %s turns superlinear at %" G_GSIZE_FORMAT " bytes\n",
+                   type_string, ops[op], superlinear_from);
+        else
+          fprintf (stderr, "%s %s stays linear up to %" G_GSIZE_FORMAT " bytes\n",
+                   type_string, ops[op], throughput_sizes[G_N_ELEMENTS (throughput_sizes) - 1]);
+
+        name = g_strdup_printf ("Throughput/%s/%s/superlinear-from", type_string, ops[op]);
+        bench_record (name, "bytes", superlinear_from);
+        g_free (name);
+
+        g_settings_reset (throughput.settings, throughput.key);
+      }
+
+  fprintf (stderr, "\n");
+
+  g_object_unref (throughput.settings);
+}
+
+#define NOTIFY_LATENCY_SAMPLES 1000
+#define NOTIFY_LATENCY_TIMEOUT (G_TIME_SPAN_SECOND)
+
+typedef struct {
+  GMutex     lock;
+  GCond      cond;
+  guint64    sent_ns;      /* when the change being waited for was made */
+  gboolean   received;
+  guint64    samples[NOTIFY_LATENCY_SAMPLES];
+  guint      n_samples;
+  guint      n_missed;
+  GMainLoop *main_loop;
+} NotifyLatency;
+
+static void
+latency_changed (GSettings     *settings,
+                 const gchar   *key,
+                 NotifyLatency *latency)
+{
+  guint64 now = bench_get_time_ns ();
+
+  g_mutex_lock (&latency->lock);
+  if (!latency->received && latency->sent_ns != 0)
+    {
+      latency->samples[latency->n_samples++] = now - latency->sent_ns;
+      latency->received = TRUE;
+      g_cond_broadcast (&latency->cond);
+    }
+  g_mutex_unlock (&latency->lock);
+}
+
+/* Plays the part of an external admin tool, writing straight to the
+ * registry from another thread */
+static gpointer
+external_writer_thread (gpointer data)
+{
+  NotifyLatency *latency = data;
+  HKEY hpath;
+  DWORD i;
+
+  if (!util_registry_open_path ("tests\\storage", &hpath))
+    {
+      g_main_loop_quit (latency->main_loop);
+      return NULL;
+    }
+
+  for (i = 0; i < NOTIFY_LATENCY_SAMPLES; i++)
+    {
+      DWORD value = 1000 + i;
+      gint64 end_time;
+      LONG result;
+
+      g_mutex_lock (&latency->lock);
+      latency->received = FALSE;
+      latency->sent_ns = bench_get_time_ns ();
+      g_mutex_unlock (&latency->lock);
+
+      result = RegSetValueExW (hpath, L"int32", 0, REG_DWORD,
+                               (const BYTE *) &value, sizeof (DWORD));
+      g_assert_no_win32_error (result, "Error setting value 'int32'");
+
+      end_time = g_get_monotonic_time () + NOTIFY_LATENCY_TIMEOUT;
+      g_mutex_lock (&latency->lock);
+      while (!latency->received)
+        if (!g_cond_wait_until (&latency->cond, &latency->lock, end_time))
+          {
+            latency->n_missed++;
+            break;
+          }
+      g_mutex_unlock (&latency->lock);
+    }
+
+  RegCloseKey (hpath);
+
+  g_main_loop_quit (latency->main_loop);
+
+  return NULL;
+}
+
+static void
+report_latency (const gchar   *name,
+                NotifyLatency *latency)
+{
+  gchar *metric;
+
+  bench_add_samples (name, latency->samples, latency->n_samples);
+  bench_print_histogram (latency->samples, latency->n_samples);
+
+  metric = g_strdup_printf ("%s/missed", name);
+  bench_record (metric, "notifications", latency->n_missed);
+  g_free (metric);
+
+  if (latency->n_missed > 0)
+    fprintf (stderr, "  %u changes were never notified\n", latency->n_missed);
+}
+
+/* Time from making a change to the "changed" signal arriving, for changes
+ * made through GSettings and for changes made to the registry behind its
+ * back, as in notify-test's manual test */
+static void
+notify_latency_test (gconstpointer data)
+{
+  NotifyLatency *latency;
+  GSettings *settings;
+  GThread *writer;
+  guint i;
+
+  latency = g_new0 (NotifyLatency, 1);
+  g_mutex_init (&latency->lock);
+  g_cond_init (&latency->cond);
+  latency->main_loop = g_main_loop_new (NULL, FALSE);
+
+  settings = util_settings_new ("org.gsettings.test.storage-test");
+  g_signal_connect (settings, "changed::int32", G_CALLBACK (latency_changed), latency);
+
+  /* Make sure the key exists for the external writer */
+  g_settings_set_int (settings, "int32", 0);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  for (i = 0; i < NOTIFY_LATENCY_SAMPLES; i++)
+    {
+      gint64 end_time = g_get_monotonic_time () + NOTIFY_LATENCY_TIMEOUT;
+
+      latency->received = FALSE;
+      latency->sent_ns = bench_get_time_ns ();
+      g_settings_set_int (settings, "int32", i + 1);
+
+      while (!latency->received && g_get_monotonic_time () < end_time)
+        g_main_context_iteration (NULL, FALSE);
+
+      if (!latency->received)
+        latency->n_missed++;
+    }
+
+  report_latency ("NotifyLatency/in-process", latency);
+
+  latency->n_samples = 0;
+  latency->n_missed = 0;
+  latency->sent_ns = 0;
+
+  writer = g_thread_new ("external-writer", external_writer_thread, latency);
+  g_main_loop_run (latency->main_loop);
+  g_thread_join (writer);
+
+  report_latency ("NotifyLatency/external", latency);
+
+  g_object_unref (settings);
+  g_main_loop_unref (latency->main_loop);
+  g_cond_clear (&latency->cond);
+  g_mutex_clear (&latency->lock);
+  g_free (latency);
+}
+
+#define CONSTRUCTION_PATHS 100
+
+typedef struct {
+  GSettingsBackend  *backend;
+  const gchar       *path;         /* NULL for the fixed-path schema */
+  gboolean           distinct;     /* a new path every iteration */
+  GSettings         *pending;      /* made in setup, for timing destruction */
+  UtilSettingsPool  *pool;
+} ConstructionCase;
+
+static GSettings *
+construction_new (ConstructionCase *construction,
+                  guint             iteration)
+{
+  gchar path[64];
+
+  if (construction->path == NULL)
+    return util_settings_new_with_backend ("org.gsettings.test.storage-test",
+                                           construction->backend);
+
+  if (construction->distinct)
+    g_snprintf (path, sizeof (path), "%s%u/", construction->path, iteration);
+  else
+    g_snprintf (path, sizeof (path), "%s", construction->path);
+
+  return util_settings_new_with_backend_and_path ("org.gsettings.test.storage-test.long-path",
+                                                  construction->backend, path);
+}
+
+static void
+construction_lookup_schema (guint    iteration,
+                            gpointer user_data)
+{
+  GSettingsSchema *schema;
+
+  schema = g_settings_schema_source_lookup (g_settings_schema_source_get_default (),
+                                            "org.gsettings.test.storage-test", TRUE);
+  g_settings_schema_unref (schema);
+}
+
+static void
+construction_new_unref (guint    iteration,
+                        gpointer user_data)
+{
+  g_object_unref (construction_new (user_data, iteration));
+}
+
+static void
+construction_setup (guint    iteration,
+                    gpointer user_data)
+{
+  ConstructionCase *construction = user_data;
+
+  construction->pending = construction_new (construction, iteration);
+}
+
+static void
+construction_unref (guint    iteration,
+                    gpointer user_data)
+{
+  ConstructionCase *construction = user_data;
+
+  g_object_unref (construction->pending);
+  construction->pending = NULL;
+}
+
+/* A request handler asking for the settings of one of CONSTRUCTION_PATHS
+ * users, cycling through them so that a pool smaller than that always
+ * misses */
+static void
+construction_request (guint    iteration,
+                      gpointer user_data)
+{
+  ConstructionCase *construction = user_data;
+  GSettings *settings;
+  gchar path[64], *marker;
+
+  g_snprintf (path, sizeof (path), "/tests/storage/users/%u/", iteration % CONSTRUCTION_PATHS);
+
+  if (construction->pool != NULL)
+    settings = util_settings_pool_get (construction->pool,
+                                       "org.gsettings.test.storage-test.long-path", path);
+  else
+    settings = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path", path);
+
+  g_settings_get (settings, "marker", "ms", &marker);
+  g_free (marker);
+  g_object_unref (settings);
+}
+
+/* What making and dropping a GSettings costs, split as far as the public
+ * API allows: the schema lookup alone, construction with and without the
+ * backend subscription a registry needs, and destruction. Then the same
+ * per-request pattern with and without a pool in front. */
+static void
+construction_test (gconstpointer data)
+{
+  ConstructionCase construction = { NULL, };
+  GSettingsBackend *memory_backend;
+  gdouble direct, pooled, thrashed;
+  guint i;
+
+  memory_backend = g_memory_settings_backend_new ();
+
+  fprintf (stderr, "\n");
+  bench_run ("Construction/schema-lookup", 1000, construction_lookup_schema, NULL);
+
+  for (i = 0; i < 2; i++)
+    {
+      const gchar *backend_name = i == 0 ? "registry" : "memory";
+      gchar *name;
+
+      construction.backend = i == 0 ? util_settings_backend_get () : memory_backend;
+
+      construction.path = NULL;
+      construction.distinct = FALSE;
+      name = g_strdup_printf ("Construction/%s/new", backend_name);
+      bench_run (name, 1000, construction_new_unref, &construction);
+      g_free (name);
+
+      construction.path = "/tests/storage/construction/";
+      name = g_strdup_printf ("Construction/%s/new-with-path", backend_name);
+      bench_run (name, 1000, construction_new_unref, &construction);
+      g_free (name);
+
+      construction.distinct = TRUE;
+      name = g_strdup_printf ("Construction/%s/new-with-distinct-paths", backend_name);
+      bench_run (name, 1000, construction_new_unref, &construction);
+      g_free (name);
+
+      name = g_strdup_printf ("Construction/%s/destroy", backend_name);
+      bench_run_with_setup (name, 1000, construction_setup, construction_unref, &construction);
+      g_free (name);
+    }
+
+  construction.pool = NULL;
+  direct = bench_run ("Construction/requests/direct", 1000,
+                      construction_request, &construction)->ns_per_op;
+
+  construction.pool = util_settings_pool_new (util_settings_backend_get (), CONSTRUCTION_PATHS);
+  pooled = bench_run ("Construction/requests/pool", 1000,
+                      construction_request, &construction)->ns_per_op;
+  util_settings_pool_free (construction.pool);
+
+  construction.pool = util_settings_pool_new (util_settings_backend_get (), CONSTRUCTION_PATHS / 2);
+  thrashed = bench_run ("Construction/requests/pool-too-small", 1000,
+                        construction_request, &construction)->ns_per_op;
+  util_settings_pool_free (construction.pool);
+
+  fprintf (stderr, "\n%-24s %12s %10s\n", "Requests", "ns/op", "speedup");
+  fprintf (stderr, "%-24s %12.0f %9.1fx\n", "direct", direct, 1.0);
+  fprintf (stderr, "%-24s %12.0f %9.1fx\n", "pool", pooled, direct / pooled);
+  fprintf (stderr, "%-24s %12.0f %9.1fx\n\n", "pool too small", thrashed, direct / thrashed);
+
+  g_object_unref (memory_backend);
+}
+
+typedef struct {
+  GSettings **settings;
+  guint       n_settings;
+  gchar      *filename;
+} SnapshotCase;
+
+/* How fixtures are built now: one g_settings_set() per key */
+static void
+snapshot_write_keys (guint    iteration,
+                     gpointer user_data)
+{
+  SnapshotCase *snapshot = user_data;
+  gchar value[32];
+  guint i;
+
+  for (i = 0; i < snapshot->n_settings; i++)
+    {
+      g_snprintf (value, sizeof (value), "fixture %u", i);
+      g_settings_set (snapshot->settings[i], "marker", "ms", value);
+    }
+}
+
+static void
+snapshot_save (guint    iteration,
+               gpointer user_data)
+{
+  SnapshotCase *snapshot = user_data;
+  GVariantBuilder builder;
+  GVariant *captured;
+  guint i;
+
+  g_variant_builder_init (&builder, SETTINGS_SNAPSHOT_TYPE);
+  for (i = 0; i < snapshot->n_settings; i++)
+    settings_snapshot_add (&builder, snapshot->settings[i]);
+  captured = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!settings_snapshot_save (captured, snapshot->filename, NULL))
+    g_assert_not_reached ();
+
+  g_variant_unref (captured);
+}
+
+/* Loading the file is part of the cost of setting up from a snapshot */
+static void
+snapshot_restore (guint    iteration,
+                  gpointer user_data)
+{
+  SnapshotCase *snapshot = user_data;
+  GVariant *loaded;
+
+  loaded = settings_snapshot_load (snapshot->filename, NULL);
+  g_assert (loaded != NULL);
+
+  if (!settings_snapshot_restore (loaded, util_settings_backend_get ()))
+    g_assert_not_reached ();
+
+  g_variant_unref (loaded);
+}
+
+static void
+snapshot_reset_keys (guint    iteration,
+                     gpointer user_data)
+{
+  SnapshotCase *snapshot = user_data;
+  guint i;
+
+  for (i = 0; i < snapshot->n_settings; i++)
+    g_settings_reset (snapshot->settings[i], "marker");
+}
+
+/* Setting up a fixture of K keys with one write per key against restoring
+ * it from a snapshot file in one batched write */
+static void
+snapshot_test (gconstpointer data)
+{
+  static const guint sizes[] = { 10, 100, 1000, 10000 };
+  SnapshotCase snapshot;
+  GError *error = NULL;
+  gchar *tmpdir;
+  guint s, i;
+
+  tmpdir = g_dir_make_tmp ("speed-test-XXXXXX", &error);
+  g_assert_no_error (error);
+  snapshot.filename = g_build_filename (tmpdir, "snapshot", NULL);
+
+  fprintf (stderr, "\n%6s %14s %14s %14s %10s\n",
+           "K", "per-key ms", "save ms", "restore ms", "speedup");
+
+  for (s = 0; s < G_N_ELEMENTS (sizes); s++)
+    {
+      gdouble per_key, save, restore;
+      gchar *name, *value;
+
+      snapshot.n_settings = sizes[s];
+      snapshot.settings = g_new (GSettings *, snapshot.n_settings);
+      for (i = 0; i < snapshot.n_settings; i++)
+        {
+          gchar path[64];
+
+          g_snprintf (path, sizeof (path), "/tests/storage/snapshot/%u/", i);
+          snapshot.settings[i] = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                                              path);
+        }
+
+      name = g_strdup_printf ("Snapshot/%u/per-key", snapshot.n_settings);
+      per_key = bench_run_with_setup (name, 1, snapshot_reset_keys,
+                                      snapshot_write_keys, &snapshot)->ns_per_op;
+      g_free (name);
+      util_main_settle ();
+
+      name = g_strdup_printf ("Snapshot/%u/save", snapshot.n_settings);
+      save = bench_run (name, 1, snapshot_save, &snapshot)->ns_per_op;
+      g_free (name);
+
+      name = g_strdup_printf ("Snapshot/%u/restore", snapshot.n_settings);
+      restore = bench_run_with_setup (name, 1, snapshot_reset_keys,
+                                      snapshot_restore, &snapshot)->ns_per_op;
+      g_free (name);
+      util_main_settle ();
+
+      g_settings_get (snapshot.settings[snapshot.n_settings - 1], "marker", "ms", &value);
+      g_assert (value != NULL);
+      g_free (value);
+
+      fprintf (stderr, "%6u %14.2f %14.2f %14.2f %9.1fx\n",
+               snapshot.n_settings, per_key / 1e6, save / 1e6, restore / 1e6,
+               per_key / restore);
+
+      snapshot_reset_keys (0, &snapshot);
+      util_main_settle ();
+
+      for (i = 0; i < snapshot.n_settings; i++)
+        g_object_unref (snapshot.settings[i]);
+      g_free (snapshot.settings);
+    }
+
+  fprintf (stderr, "\n");
+
+  g_remove (snapshot.filename);
+  g_rmdir (tmpdir);
+  g_free (snapshot.filename);
+  g_free (tmpdir);
+}
+
+typedef struct {
+  GSettings   *settings;
+  GSettings   *writer;
+  const gchar *key;
+  HKEY         hkey;          /* the registry key for the path */
+  gunichar2   *value_name;
+  guint        n_changed;
+} ScaleCase;
+
+static void
+scale_changed (GSettings   *settings,
+               const gchar *key,
+               ScaleCase   *scale)
+{
+  scale->n_changed++;
+}
+
+static void
+scale_get (guint    iteration,
+           gpointer user_data)
+{
+  ScaleCase *scale = user_data;
+  gchar *value;
+
+  g_settings_get (scale->settings, scale->key, "ms", &value);
+  g_free (value);
+}
+
+static void
+scale_set (guint    iteration,
+           gpointer user_data)
+{
+  ScaleCase *scale = user_data;
+  gchar value[32];
+
+  g_snprintf (value, sizeof (value), "v%u", iteration);
+  g_settings_set (scale->writer, scale->key, "ms", value);
+}
+
+static void
+scale_wait (ScaleCase *scale,
+            guint      n_changed)
+{
+  while (scale->n_changed == n_changed)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+/* From a write through another GSettings to "changed" */
+static void
+scale_watch (guint    iteration,
+             gpointer user_data)
+{
+  ScaleCase *scale = user_data;
+  guint n_changed = scale->n_changed;
+
+  scale_set (iteration, scale);
+  scale_wait (scale, n_changed);
+}
+
+/* From a write to the registry to "changed", which takes the path through
+ * the conversion from the registry's form and back */
+static void
+scale_watch_external (guint    iteration,
+                      gpointer user_data)
+{
+  ScaleCase *scale = user_data;
+  guint n_changed = scale->n_changed;
+  gunichar2 *text;
+  glong n_chars;
+  gchar value[32];
+  LONG result;
+
+  g_snprintf (value, sizeof (value), "'x%u'", iteration);
+  text = g_utf8_to_utf16 (value, -1, NULL, &n_chars, NULL);
+  result = RegSetValueExW (scale->hkey, scale->value_name, 0, REG_SZ,
+                           (const BYTE *) text, (n_chars + 1) * sizeof (gunichar2));
+  g_assert_no_win32_error (result, "Error setting value");
+  g_free (text);
+
+  scale_wait (scale, n_changed);
+}
+
+/* Runs get, set and both watches for @key at @path, which is below
+ * /tests/storage/, and adds a row to @summary */
+static void
+scale_case (const gchar *what,
+            guint        size,
+            const gchar *path,
+            const gchar *key,
+            GString     *summary)
+{
+  ScaleCase scale = { NULL, };
+  gdouble get, set, watch, watch_external;
+  gchar *registry_path, *name;
+
+  scale.settings = util_settings_new_with_path ("org.gsettings.test.key-lengths", path);
+  scale.writer = util_settings_new_with_path ("org.gsettings.test.key-lengths", path);
+  scale.key = key;
+  scale.value_name = g_utf8_to_utf16 (key, -1, NULL, NULL, NULL);
+  g_signal_connect (scale.settings, "changed", G_CALLBACK (scale_changed), &scale);
+
+  name = g_strdup_printf ("Scale/%s/%u/set", what, size);
+  set = bench_run (name, 1000, scale_set, &scale)->ns_per_op;
+  g_free (name);
+  util_main_settle ();
+
+  name = g_strdup_printf ("Scale/%s/%u/get", what, size);
+  get = bench_run (name, 1000, scale_get, &scale)->ns_per_op;
+  g_free (name);
+
+  name = g_strdup_printf ("Scale/%s/%u/watch", what, size);
+  watch = bench_run (name, 200, scale_watch, &scale)->ns_per_op;
+  g_free (name);
+  util_main_settle ();
+
+  /* "/tests/storage/a/b/" -> "tests\storage\a\b"; the set above made it */
+  registry_path = g_strndup (path + 1, strlen (path) - 2);
+  g_strdelimit (registry_path, "/", '\\');
+  if (!util_registry_open_path (registry_path, &scale.hkey))
+    g_assert_not_reached ();
+  g_free (registry_path);
+
+  name = g_strdup_printf ("Scale/%s/%u/watch-external", what, size);
+  watch_external = bench_run (name, 200, scale_watch_external, &scale)->ns_per_op;
+  g_free (name);
+  util_main_settle ();
+
+  RegCloseKey (scale.hkey);
+
+  g_string_append_printf (summary, "%-12s %6u %12.0f %12.0f %12.0f %14.0f\n",
+                          what, size, get, set, watch, watch_external);
+
+  g_settings_reset (scale.writer, key);
+  util_main_settle ();
+
+  g_free (scale.value_name);
+  g_object_unref (scale.writer);
+  g_object_unref (scale.settings);
+}
+
+/* How the cost of get, set and "changed" grows with the depth of the path
+ * and the length of the key name, to show up any work that is linear in
+ * either */
+static void
+scale_test (gconstpointer data)
+{
+  static const guint depths[] = { 1, 2, 4, 8, 16, 32, 64 };
+  static const guint lengths[] = { 1, 2, 4, 8, 16, 32, 64, 128, 255 };
+  GString *summary, *path;
+  gchar key[256];
+  guint i, d;
+
+  summary = g_string_new (NULL);
+  g_string_append_printf (summary, "\n%-12s %6s %12s %12s %12s %14s\n",
+                          "Sweep", "Size", "get", "set", "watch", "watch-external");
+
+  for (i = 0; i < G_N_ELEMENTS (depths); i++)
+    {
+      path = g_string_new ("/tests/storage/");
+      for (d = 0; d < depths[i]; d++)
+        g_string_append_printf (path, "d%u/", d);
+
+      scale_case ("depth", depths[i], path->str, "k", summary);
+      g_string_free (path, TRUE);
+    }
+
+  /* The schema's keys are "k" followed by digits */
+  for (i = 0; i < G_N_ELEMENTS (lengths); i++)
+    {
+      for (d = 0; d < lengths[i]; d++)
+        key[d] = d == 0 ? 'k' : '0' + (d - 1) % 10;
+      key[d] = '\0';
+
+      scale_case ("key-length", lengths[i], "/tests/storage/key-lengths/", key, summary);
+    }
+
+  fprintf (stderr, "%s\n", summary->str);
+  g_string_free (summary, TRUE);
+}
+
+#ifndef G_OS_WIN32
+typedef struct {
+  HKEY   hkey;
+  guint  n_changed;
+} StallCase;
+
+static void
+stall_read_back (GSettings   *settings,
+                 const gchar *key,
+                 StallCase   *stall)
+{
+  GVariant *value;
+
+  value = g_settings_get_value (settings, key);
+  g_variant_unref (value);
+
+  /* Only the key written from outside is waited for */
+  if (strcmp (key, "k0") == 0)
+    stall->n_changed++;
+}
+
+#define STALL_WRITES 200
+
+/* What slow storage does to the thread of an application that writes one
+ * key and watches another, which something else writes to the registry.
+ * The emulator's latency is added to every registry call. */
+static void
+stall_test (gconstpointer data)
+{
+  static const gulong latencies_us[] = { 0, 100, 1000, 5000 };
+  GSettings *settings;
+  StallCase stall = { NULL, 0 };
+  GString *summary;
+  guint i, n;
+
+  settings = util_settings_new_with_path ("org.gsettings.test.key-lengths",
+                                          "/tests/storage/stalls/");
+  g_signal_connect (settings, "changed", G_CALLBACK (stall_read_back), &stall);
+
+  /* Create the key, so that it can be opened */
+  g_settings_set (settings, "k0", "ms", "created");
+  util_main_settle ();
+  if (!util_registry_open_path ("tests\\storage\\stalls", &stall.hkey))
+    g_assert_not_reached ();
+
+  summary = g_string_new (NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (latencies_us); i++)
+    {
+      UtilStallMonitor *monitor;
+      gchar *name, *table;
+
+      monitor = util_stall_monitor_new (settings);
+      registry_emulator_set_latency (latencies_us[i]);
+
+      for (n = 0; n < STALL_WRITES; n++)
+        {
+          gchar value[32];
+          guint n_changed;
+          gunichar2 *text;
+          glong n_chars;
+          LONG result;
+
+          g_snprintf (value, sizeof (value), "v%u", n);
+          util_stall_monitor_set_value (monitor, "k", g_variant_new ("ms", value));
+
+          n_changed = stall.n_changed;
+          g_snprintf (value, sizeof (value), "'x%u'", n);
+          text = g_utf8_to_utf16 (value, -1, NULL, &n_chars, NULL);
+          result = RegSetValueExW (stall.hkey, L"k0", 0, REG_SZ, (const BYTE *) text,
+                                   (n_chars + 1) * sizeof (gunichar2));
+          g_assert_no_win32_error (result, "Error setting value");
+          g_free (text);
 
-#include "utils.h"
+          g_assert (util_main_wait_for (&stall.n_changed, n_changed + 1));
+        }
+
+      util_main_settle ();
+      registry_emulator_set_latency (0);
+
+      g_string_append_printf (summary, "%-12lu %12.1f %12.1f %-8s %12.1f %12.1f %-8s\n",
+                              latencies_us[i],
+                              util_stall_monitor_get_percentile (monitor, UTIL_STALL_DISPATCH, 99) / 1000.0,
+                              util_stall_monitor_get_percentile (monitor, UTIL_STALL_DISPATCH, 100) / 1000.0,
+                              util_stall_monitor_get_worst_key (monitor, UTIL_STALL_DISPATCH),
+                              util_stall_monitor_get_percentile (monitor, UTIL_STALL_WRITE, 99) / 1000.0,
+                              util_stall_monitor_get_percentile (monitor, UTIL_STALL_WRITE, 100) / 1000.0,
+                              util_stall_monitor_get_worst_key (monitor, UTIL_STALL_WRITE));
+
+      name = g_strdup_printf ("Stalls/%lu/dispatch-p99", latencies_us[i]);
+      bench_record (name, "ns", util_stall_monitor_get_percentile (monitor, UTIL_STALL_DISPATCH, 99));
+      g_free (name);
+      name = g_strdup_printf ("Stalls/%lu/dispatch-max", latencies_us[i]);
+      bench_record (name, "ns", util_stall_monitor_get_percentile (monitor, UTIL_STALL_DISPATCH, 100));
+      g_free (name);
+      name = g_strdup_printf ("Stalls/%lu/write-p99", latencies_us[i]);
+      bench_record (name, "ns", util_stall_monitor_get_percentile (monitor, UTIL_STALL_WRITE, 99));
+      g_free (name);
+      name = g_strdup_printf ("Stalls/%lu/write-max", latencies_us[i]);
+      bench_record (name, "ns", util_stall_monitor_get_percentile (monitor, UTIL_STALL_WRITE, 100));
+      g_free (name);
+
+      if (g_test_verbose ())
+        {
+          table = util_stall_monitor_describe (monitor);
+          fprintf (stderr, "\nLatency %lu us:\n%s", latencies_us[i], table);
+          g_free (table);
+        }
+
+      util_stall_monitor_free (monitor);
+    }
+
+  fprintf (stderr, "\n%-12s %12s %12s %-8s %12s %12s %-8s\n",
+           "Latency (us)", "dispatch p99", "max (us)", "worst",
+           "write p99", "max (us)", "worst");
+  fprintf (stderr, "%s\n", summary->str);
+  g_string_free (summary, TRUE);
+
+  RegCloseKey (stall.hkey);
+  g_settings_reset (settings, "k");
+  g_settings_reset (settings, "k0");
+  util_main_settle ();
+  g_object_unref (settings);
+}
+#endif
+
+#define STORM_WRITES 10000
+
+static const gchar *storm_keys[] = { "int32", "a-5", "k12345678901234567890123456789012",
+                                     "string", "junk" };
+
+/* The first three keys are integers, the others strings */
+#define STORM_N_INT_KEYS 3
+
+typedef struct {
+  HKEY     hkey;              /* tests\storage */
+
+  GMutex   lock;
+  guint64  write_ns[G_N_ELEMENTS (storm_keys)];   /* start of the last write
+                                                   * of each key */
+
+  /* Only used from the main thread */
+  guint    n_writers_done;
+  guint    n_callbacks;
+  guint64  worst_ns;
+  gboolean final[G_N_ELEMENTS (storm_keys)];      /* last write seen */
+  guint    n_final;
+} StormCase;
+
+/* Which write is the last one of key @k */
+static guint
+storm_last_write (guint k)
+{
+  return STORM_WRITES - 1 - (STORM_WRITES - 1 - k) % G_N_ELEMENTS (storm_keys);
+}
 
 static void
-basic_test(gconstpointer *data)
+storm_delivered (StormCase   *storm,
+                 GSettings   *settings,
+                 const gchar *key,
+                 guint64      now_ns)
 {
-  GTimer *timer;
-  GMainLoop *main_loop;
+  guint64 write_ns;
+  gchar *string, expected[32];
+  guint k;
+
+  for (k = 0; k < G_N_ELEMENTS (storm_keys); k++)
+    if (strcmp (key, storm_keys[k]) == 0)
+      break;
+  if (k == G_N_ELEMENTS (storm_keys))
+    return;
+
+  g_mutex_lock (&storm->lock);
+  write_ns = storm->write_ns[k];
+  g_mutex_unlock (&storm->lock);
+
+  if (write_ns != 0)
+    storm->worst_ns = MAX (storm->worst_ns, now_ns - write_ns);
+
+  /* A listener reads what it is told has changed */
+  if (k < STORM_N_INT_KEYS)
+    g_snprintf (expected, sizeof (expected), "%d", g_settings_get_int (settings, key));
+  else
+    {
+      string = g_settings_get_string (settings, key);
+      g_strlcpy (expected, string, sizeof (expected));
+      g_free (string);
+    }
+
+  if (!storm->final[k])
+    {
+      gchar final[32];
+
+      if (k < STORM_N_INT_KEYS)
+        g_snprintf (final, sizeof (final), "%u", storm_last_write (k));
+      else
+        g_snprintf (final, sizeof (final), "storm %u", storm_last_write (k));
+
+      if (strcmp (expected, final) == 0)
+        {
+          storm->final[k] = TRUE;
+          storm->n_final++;
+        }
+    }
+}
+
+static void
+storm_changed (GSettings   *settings,
+               const gchar *key,
+               StormCase   *storm)
+{
+  storm->n_callbacks++;
+  storm_delivered (storm, settings, key, bench_get_time_ns ());
+}
+
+static void
+storm_changes (GSettings           *settings,
+               const gchar * const *keys,
+               gpointer             user_data)
+{
+  StormCase *storm = user_data;
+  guint64 now_ns = bench_get_time_ns ();
+
+  storm->n_callbacks++;
+  for (; *keys != NULL; keys++)
+    storm_delivered (storm, settings, *keys, now_ns);
+}
+
+static gboolean
+storm_writer_done (gpointer user_data)
+{
+  StormCase *storm = user_data;
+
+  storm->n_writers_done++;
+
+  return FALSE;
+}
+
+/* The admin tool, writing straight to the registry from a thread of its
+ * own so that every notification has to come through the main loop */
+static gpointer
+storm_writer (gpointer user_data)
+{
+  StormCase *storm = user_data;
+  guint i;
+
+  for (i = 0; i < STORM_WRITES; i++)
+    {
+      guint k = i % G_N_ELEMENTS (storm_keys);
+      gunichar2 *name;
+      LONG result;
+
+      name = g_utf8_to_utf16 (storm_keys[k], -1, NULL, NULL, NULL);
+
+      g_mutex_lock (&storm->lock);
+      storm->write_ns[k] = bench_get_time_ns ();
+      g_mutex_unlock (&storm->lock);
+
+      if (k < STORM_N_INT_KEYS)
+        {
+          DWORD value = i;
+
+          result = RegSetValueExW (storm->hkey, name, 0, REG_DWORD,
+                                   (const BYTE *) &value, sizeof (value));
+        }
+      else
+        {
+          gchar value[32];
+          gunichar2 *text;
+          glong n_chars;
+
+          g_snprintf (value, sizeof (value), "storm %u", i);
+          text = g_utf8_to_utf16 (value, -1, NULL, &n_chars, NULL);
+          result = RegSetValueExW (storm->hkey, name, 0, REG_SZ,
+                                   (const BYTE *) text, (n_chars + 1) * sizeof (gunichar2));
+          g_free (text);
+        }
+
+      g_assert_no_win32_error (result, "Error setting value");
+      g_free (name);
+    }
+
+  g_idle_add (storm_writer_done, storm);
+
+  return NULL;
+}
+
+/* An admin tool rewriting a handful of keys STORM_WRITES times in one go,
+ * seen by a listener on "changed" and by listeners aggregating over
+ * windows of 10 and 100 ms, each reading the keys it is told about.
+ * Latency is from the start of the latest write of a key to the callback
+ * that reports it; the CPU time is the main thread's, from the first
+ * write until the listener has seen the last value of every key and the
+ * main loop has gone quiet. */
+static void
+storm_test (gconstpointer data)
+{
+  static const guint windows[] = { 0, 10, 100 };
+  guint w, k;
+
+  fprintf (stderr, "\n%-16s %10s %12s %12s %14s %14s\n",
+           "Listener", "callbacks", "burst ms", "drain ms", "loop CPU ms", "worst ms");
+
+  for (w = 0; w < G_N_ELEMENTS (windows); w++)
+    {
+      UtilChangeAggregator *aggregator = NULL;
+      GSettings *settings;
+      StormCase storm = { NULL, };
+      GThread *writer;
+      guint64 start_ns, burst_ns, drain_ns, cpu_ns;
+      gchar *mode, *name;
+
+      settings = util_settings_new ("org.gsettings.test.storage-test");
+
+      /* Make sure the key exists to be opened */
+      g_settings_set_int (settings, storm_keys[0], -1);
+      util_main_settle ();
+      if (!util_registry_open_path ("tests\\storage", &storm.hkey))
+        g_assert_not_reached ();
+      g_mutex_init (&storm.lock);
+
+      if (windows[w] == 0)
+        {
+          mode = g_strdup ("changed");
+          g_signal_connect (settings, "changed", G_CALLBACK (storm_changed), &storm);
+        }
+      else
+        {
+          mode = g_strdup_printf ("aggregated-%ums", windows[w]);
+          aggregator = util_change_aggregator_new (settings, windows[w], storm_changes, &storm);
+        }
+
+      start_ns = bench_get_time_ns ();
+      cpu_ns = bench_get_thread_cpu_time_ns ();
+
+      writer = g_thread_new ("storm-writer", storm_writer, &storm);
+      g_assert (util_main_wait_for (&storm.n_writers_done, 1));
+      burst_ns = bench_get_time_ns () - start_ns;
+      g_thread_join (writer);
+
+      g_assert (util_main_wait_for (&storm.n_final, G_N_ELEMENTS (storm_keys)));
+      drain_ns = bench_get_time_ns () - start_ns - burst_ns;
+      util_main_settle ();
+
+      cpu_ns = bench_get_thread_cpu_time_ns () - cpu_ns;
+
+      fprintf (stderr, "%-16s %10u %12.1f %12.1f %14.1f %14.1f\n",
+               mode, storm.n_callbacks, burst_ns / 1e6, drain_ns / 1e6,
+               cpu_ns / 1e6, storm.worst_ns / 1e6);
+
+      name = g_strdup_printf ("Storm/%s/callbacks", mode);
+      bench_record (name, "calls", storm.n_callbacks);
+      g_free (name);
+      name = g_strdup_printf ("Storm/%s/loop-cpu", mode);
+      bench_record (name, "ns", cpu_ns);
+      g_free (name);
+      name = g_strdup_printf ("Storm/%s/worst-latency", mode);
+      bench_record (name, "ns", storm.worst_ns);
+      g_free (name);
+
+      if (aggregator != NULL)
+        util_change_aggregator_free (aggregator);
+
+      RegCloseKey (storm.hkey);
+      g_mutex_clear (&storm.lock);
+
+      for (k = 0; k < G_N_ELEMENTS (storm_keys); k++)
+        g_settings_reset (settings, storm_keys[k]);
+      util_main_settle ();
+
+      g_object_unref (settings);
+      g_free (mode);
+    }
+
+  fprintf (stderr, "\n");
+}
+
+static gchar *comparison_backends = NULL;
+
+#define COMPARISON_ITERATIONS 200
+
+/* The registry is GIO's registry backend on Windows and the emulated one
+ * elsewhere; the keyfile lives in a fresh directory, returned in @tmpdir
+ * for removing afterwards */
+static GSettingsBackend *
+comparison_backend_new (const gchar  *name,
+                        gchar       **tmpdir)
+{
+  GSettingsBackend *backend = NULL;
+  GError *error = NULL;
+  gchar *filename;
+
+  *tmpdir = NULL;
+
+  if (strcmp (name, "memory") == 0)
+    backend = g_memory_settings_backend_new ();
+  else if (strcmp (name, "keyfile") == 0)
+    {
+      *tmpdir = g_dir_make_tmp ("speed-test-XXXXXX", &error);
+      g_assert_no_error (error);
+
+      filename = g_build_filename (*tmpdir, "settings.ini", NULL);
+      backend = g_keyfile_settings_backend_new (filename, "/", NULL);
+      g_free (filename);
+    }
+  else if (strcmp (name, "registry") == 0)
+    backend = g_object_ref (util_settings_backend_get ());
+
+  return backend;
+}
+
+static void
+comparison_backend_free (GSettingsBackend *backend,
+                         gchar            *tmpdir)
+{
+  gchar *filename;
+
+  g_object_unref (backend);
+
+  if (tmpdir != NULL)
+    {
+      filename = g_build_filename (tmpdir, "settings.ini", NULL);
+      g_remove (filename);
+      g_rmdir (tmpdir);
+      g_free (filename);
+      g_free (tmpdir);
+    }
+}
+
+typedef struct {
   GSettings *settings;
-  gdouble time;
-  gint i;
-  gchar *string;
+  GVariant  *values_a[G_N_ELEMENTS (type_keys)];
+  GVariant  *values_b[G_N_ELEMENTS (type_keys)];
+} ComparisonApply;
 
-  timer = g_timer_new ();
-  main_loop = g_main_loop_new (NULL, FALSE);
-  settings = g_settings_new ("org.gsettings.test.storage-test");
+/* Every key of the schema in one delayed apply, so one write_tree */
+static void
+comparison_apply (guint    iteration,
+                  gpointer user_data)
+{
+  ComparisonApply *apply = user_data;
+  guint i;
+
+  g_settings_delay (apply->settings);
+
+  for (i = 0; i < G_N_ELEMENTS (type_keys); i++)
+    g_settings_set_value (apply->settings, type_keys[i].key,
+                          (iteration % 2) ? apply->values_b[i] : apply->values_a[i]);
+
+  g_settings_apply (apply->settings);
+}
+
+/* The get and set workloads of the Types test plus a delayed apply of
+ * every key, run identically on each backend named in --backends, with
+ * ns/op side by side */
+static void
+backends_test (gconstpointer data)
+{
+  gchar **names;
+  guint n_backends, n_rows, b, i;
+  gdouble *table;
+  GString *summary;
+
+  names = g_strsplit (comparison_backends != NULL ? comparison_backends
+                                                  : "memory,keyfile,registry", ",", -1);
+  n_backends = g_strv_length (names);
+
+  /* get and set per key, then apply */
+  n_rows = G_N_ELEMENTS (type_keys) * 2 + 1;
+  table = g_new0 (gdouble, n_rows * n_backends);
+
+  for (b = 0; b < n_backends; b++)
+    {
+      GSettingsBackend *backend;
+      ComparisonApply apply;
+      gchar *tmpdir, *name;
+
+      backend = comparison_backend_new (names[b], &tmpdir);
+      if (backend == NULL)
+        {
+          g_test_message ("Unknown backend '%s'", names[b]);
+          g_test_fail ();
+          continue;
+        }
+
+      apply.settings = g_settings_new_with_backend ("org.gsettings.test.storage-test",
+                                                    backend);
+
+      for (i = 0; i < G_N_ELEMENTS (type_keys); i++)
+        {
+          const GVariantType *type;
+          GVariant *current;
+          TypeCase type_case;
+
+          current = g_settings_get_value (apply.settings, type_keys[i].key);
+          type = g_variant_get_type (current);
+
+          type_case.settings = apply.settings;
+          type_case.key = type_keys[i].key;
+          type_case.value_a = g_variant_parse (type, type_keys[i].value_a, NULL, NULL, NULL);
+          type_case.value_b = g_variant_parse (type, type_keys[i].value_b, NULL, NULL, NULL);
+          apply.values_a[i] = type_case.value_a;
+          apply.values_b[i] = type_case.value_b;
+
+          name = g_strdup_printf ("Backends/%s/%s/get", names[b], type_keys[i].key);
+          table[(i * 2) * n_backends + b] =
+            bench_run (name, COMPARISON_ITERATIONS, type_get, &type_case)->ns_per_op;
+          g_free (name);
+
+          name = g_strdup_printf ("Backends/%s/%s/set", names[b], type_keys[i].key);
+          table[(i * 2 + 1) * n_backends + b] =
+            bench_run (name, COMPARISON_ITERATIONS, type_set, &type_case)->ns_per_op;
+          g_free (name);
+
+          g_variant_unref (current);
+        }
+
+      name = g_strdup_printf ("Backends/%s/apply", names[b]);
+      table[(n_rows - 1) * n_backends + b] =
+        bench_run (name, COMPARISON_ITERATIONS, comparison_apply, &apply)->ns_per_op;
+      g_free (name);
+
+      /* The keyfile backend hears about its own writes through a file
+       * monitor; let those arrive before the file goes */
+      util_main_settle ();
 
-  g_timer_reset (timer);
-  for (i = 0; i < 10000; i++)
+      for (i = 0; i < G_N_ELEMENTS (type_keys); i++)
+        {
+          g_settings_reset (apply.settings, type_keys[i].key);
+          g_variant_unref (apply.values_a[i]);
+          g_variant_unref (apply.values_b[i]);
+        }
+
+      /* Still delayed from the apply workload */
+      g_settings_apply (apply.settings);
+
+      g_object_unref (apply.settings);
+      comparison_backend_free (backend, tmpdir);
+    }
+
+  summary = g_string_new ("\nBackends (ns/op)\n");
+  g_string_append_printf (summary, "%-32s", "Workload");
+  for (b = 0; b < n_backends; b++)
+    g_string_append_printf (summary, " %12s", names[b]);
+  g_string_append_c (summary, '\n');
+
+  for (i = 0; i < n_rows; i++)
     {
-      gchar string[32];
-      g_snprintf (string, 31, "testing %d", i);
-      g_settings_set_string (settings, "string", string);
+      gchar *row;
+
+      if (i == n_rows - 1)
+        row = g_strdup ("apply all keys");
+      else
+        row = g_strdup_printf ("%s %s", type_keys[i / 2].key, (i % 2) ? "set" : "get");
+
+      g_string_append_printf (summary, "%-32s", row);
+      for (b = 0; b < n_backends; b++)
+        g_string_append_printf (summary, " %12.0f", table[i * n_backends + b]);
+      g_string_append_c (summary, '\n');
+
+      g_free (row);
     }
-  time = g_timer_elapsed (timer, NULL);
-  fprintf (stderr, "Write distinct strings: %f\n", time);
 
-  g_timer_reset (timer);
-  for (i = 0; i < 10000; i++)
-    g_settings_set_string (settings, "string", "Testing");
-  time = g_timer_elapsed (timer, NULL);
-  fprintf (stderr, "Write identical strings: %f\n", time);
+  fprintf (stderr, "%s\n", summary->str);
+  g_string_free (summary, TRUE);
+
+  g_free (table);
+  g_strfreev (names);
+}
+
+static gchar *startup_program = NULL;
+static gint startup_probe = 0;
+
+#define STARTUP_RUNS           5
+#define STARTUP_WARM_LOOKUPS   1000
+
+/* Writes @n_schemas schemas of a handful of keys each to one file in
+ * @dir and compiles them there */
+static gboolean
+startup_generate_schemas (const gchar  *dir,
+                          guint         n_schemas,
+                          GError      **error)
+{
+  GString *xml;
+  gboolean success;
+  guint i;
+
+  xml = g_string_new ("<schemalist>\n");
+  for (i = 0; i < n_schemas; i++)
+    g_string_append_printf (xml,
+                            "  <schema id=\"org.gsettings.test.generated.s%u\" path=\"/tests/generated/s%u/\">\n"
+                            "    <key name=\"enabled\" type=\"b\"><default>true</default></key>\n"
+                            "    <key name=\"count\" type=\"i\"><default>%u</default></key>\n"
+                            "    <key name=\"name\" type=\"s\"><default>'schema %u'</default></key>\n"
+                            "    <key name=\"items\" type=\"as\"><default>['a', 'b', 'c']</default></key>\n"
+                            "    <key name=\"position\" type=\"(ii)\"><default>(0, 0)</default></key>\n"
+                            "  </schema>\n",
+                            i, i, i, i);
+  g_string_append (xml, "</schemalist>\n");
+
+  success = generated_schemas_compile (dir, xml->str, error);
+  g_string_free (xml, TRUE);
 
-  g_timer_reset (timer);
-  for (i = 0; i < 10000; i++)
-    string = g_settings_get_string (settings, "string");
-  time = g_timer_elapsed (timer, NULL);
-  fprintf (stderr, "Read string: %f\n", time);
+  return success;
+}
+
+/* Run in a child by startup_test() with GSETTINGS_SCHEMA_DIR pointing at
+ * startup_probe generated schemas. Reports, in ns, loading the schema
+ * source, looking up the first schema, getting its first key counted from
+ * entering main(), and the mean of warm lookups; then the page faults
+ * taken meanwhile. */
+static gint
+startup_probe_run (guint64 start_ns)
+{
+  GSettingsSchemaSource *source;
+  GSettingsSchema *schema;
+  GSettings *settings;
+  guint64 source_ns, lookup_ns, first_get_ns, warm_ns;
+  gchar id[64];
+  guint i;
+
+  source_ns = bench_get_time_ns ();
+  source = g_settings_schema_source_get_default ();
+  lookup_ns = bench_get_time_ns ();
+  source_ns = lookup_ns - source_ns;
+
+  g_strlcpy (id, "org.gsettings.test.generated.s0", sizeof (id));
+  schema = g_settings_schema_source_lookup (source, id, TRUE);
+  lookup_ns = bench_get_time_ns () - lookup_ns;
+  if (schema == NULL)
+    return 1;
+
+  settings = util_settings_new (id);
+  g_settings_get_boolean (settings, "enabled");
+  first_get_ns = bench_get_time_ns () - start_ns;
+
+  warm_ns = bench_get_time_ns ();
+  for (i = 0; i < STARTUP_WARM_LOOKUPS; i++)
+    {
+      g_snprintf (id, sizeof (id), "org.gsettings.test.generated.s%u",
+                  g_random_int_range (0, startup_probe));
+      g_settings_schema_unref (g_settings_schema_source_lookup (source, id, TRUE));
+    }
+  warm_ns = (bench_get_time_ns () - warm_ns) / STARTUP_WARM_LOOKUPS;
+
+  printf ("%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+          " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT "\n",
+          source_ns, lookup_ns, first_get_ns, warm_ns, bench_get_page_faults ());
 
   g_object_unref (settings);
-  g_main_loop_unref (main_loop);
+  g_settings_schema_unref (schema);
+
+  return 0;
+}
+
+/* Cold start cost as the installed schema set grows: each run is a fresh
+ * process that only loads the generated schemas and reads one key */
+static void
+startup_test (gconstpointer data)
+{
+  static const guint sizes[] = { 10, 100, 1000, 10000 };
+  guint s, run;
+
+  fprintf (stderr, "\n%8s %12s %12s %12s %12s %12s %12s %10s\n",
+           "Schemas", "compiled KB", "spawn ms", "1st get ms", "source us",
+           "lookup us", "warm ns", "faults");
+
+  for (s = 0; s < G_N_ELEMENTS (sizes); s++)
+    {
+      GSubprocessLauncher *launcher;
+      GError *error = NULL;
+      gchar *dir, *compiled, *probe, *name;
+      gdouble spawn = 0, totals[5] = { 0, };
+      GStatBuf buf;
+
+      dir = g_dir_make_tmp ("speed-test-XXXXXX", &error);
+      g_assert_no_error (error);
+
+      if (!startup_generate_schemas (dir, sizes[s], &error))
+        {
+          g_test_skip (error->message);
+          g_clear_error (&error);
+          g_free (dir);
+          return;
+        }
+
+      compiled = g_build_filename (dir, "gschemas.compiled", NULL);
+      if (g_stat (compiled, &buf) != 0)
+        buf.st_size = 0;
+
+      launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE |
+                                            G_SUBPROCESS_FLAGS_STDERR_SILENCE);
+      g_subprocess_launcher_setenv (launcher, "GSETTINGS_SCHEMA_DIR", dir, TRUE);
+      probe = g_strdup_printf ("--startup-probe=%u", sizes[s]);
+
+      for (run = 0; run < STARTUP_RUNS; run++)
+        {
+          GSubprocess *child;
+          guint64 start_ns;
+          gchar *output = NULL, **fields;
+          guint i;
+
+          start_ns = bench_get_time_ns ();
+          child = g_subprocess_launcher_spawn (launcher, &error,
+                                               startup_program, probe, NULL);
+          g_assert_no_error (error);
+          g_subprocess_communicate_utf8 (child, NULL, NULL, &output, NULL, &error);
+          g_assert_no_error (error);
+          g_assert (g_subprocess_get_successful (child));
+          spawn += bench_get_time_ns () - start_ns;
+
+          fields = g_strsplit (output, " ", -1);
+          g_assert_cmpuint (g_strv_length (fields), ==, G_N_ELEMENTS (totals));
+          for (i = 0; i < G_N_ELEMENTS (totals); i++)
+            totals[i] += g_ascii_strtoull (fields[i], NULL, 10);
+
+          g_strfreev (fields);
+          g_free (output);
+          g_object_unref (child);
+        }
+
+      spawn /= STARTUP_RUNS;
+      for (run = 0; run < G_N_ELEMENTS (totals); run++)
+        totals[run] /= STARTUP_RUNS;
+
+      fprintf (stderr, "%8u %12.0f %12.2f %12.2f %12.1f %12.1f %12.0f %10.0f\n",
+               sizes[s], buf.st_size / 1024.0, spawn / 1e6, totals[2] / 1e6,
+               totals[0] / 1e3, totals[1] / 1e3, totals[3], totals[4]);
+
+      name = g_strdup_printf ("Startup/%u/spawn-to-exit", sizes[s]);
+      bench_record (name, "ns", spawn);
+      g_free (name);
+      name = g_strdup_printf ("Startup/%u/main-to-first-get", sizes[s]);
+      bench_record (name, "ns", totals[2]);
+      g_free (name);
+      name = g_strdup_printf ("Startup/%u/source-load", sizes[s]);
+      bench_record (name, "ns", totals[0]);
+      g_free (name);
+      name = g_strdup_printf ("Startup/%u/cold-lookup", sizes[s]);
+      bench_record (name, "ns", totals[1]);
+      g_free (name);
+      name = g_strdup_printf ("Startup/%u/warm-lookup", sizes[s]);
+      bench_record (name, "ns", totals[3]);
+      g_free (name);
+      name = g_strdup_printf ("Startup/%u/page-faults", sizes[s]);
+      bench_record (name, "faults", totals[4]);
+      g_free (name);
+
+      g_free (probe);
+      g_object_unref (launcher);
+
+      g_free (compiled);
+      generated_schemas_remove (dir);
+      g_free (dir);
+    }
+
+  fprintf (stderr, "\n");
+}
+
+static gchar *fanout_reader = NULL;
+static gint fanout_rate = 100;
+static gint fanout_writes = 200;
+static gint fanout_max_readers = 64;
+
+/* How long a reader waits for the next notification before giving up */
+#define FANOUT_READER_TIMEOUT_MS 5000
+
+typedef struct {
+  GSettings  *settings;
+  GMainLoop  *main_loop;
+  GArray     *latencies;     /* guint64 ns */
+  gint64      last_seq;
+  guint       n_missed;
+  guint       n_duplicated;
+  guint       timeout_id;
+} FanoutReader;
+
+static gboolean
+fanout_reader_timeout (gpointer user_data)
+{
+  FanoutReader *reader = user_data;
+
+  reader->timeout_id = 0;
+  g_main_loop_quit (reader->main_loop);
+
+  return FALSE;
+}
+
+/* The writer stores "<seq> <time sent>" and finally "end <n_writes>" */
+static void
+fanout_reader_changed (GSettings    *settings,
+                       const gchar  *key,
+                       FanoutReader *reader)
+{
+  guint64 now_ns = bench_get_time_ns ();
+  gchar *value, *end;
+  gint64 seq;
+
+  value = g_settings_get_string (settings, "string");
+
+  if (g_str_has_prefix (value, "end "))
+    {
+      seq = g_ascii_strtoll (value + 4, NULL, 10);
+      if (seq - 1 > reader->last_seq)
+        reader->n_missed += seq - 1 - reader->last_seq;
+      g_main_loop_quit (reader->main_loop);
+    }
+  else
+    {
+      seq = g_ascii_strtoll (value, &end, 10);
+      if (end != value)
+        {
+          guint64 sent_ns = g_ascii_strtoull (end, NULL, 10);
+          guint64 latency = now_ns - sent_ns;
+
+          if (seq <= reader->last_seq)
+            reader->n_duplicated++;
+          else
+            {
+              reader->n_missed += seq - reader->last_seq - 1;
+              reader->last_seq = seq;
+              g_array_append_val (reader->latencies, latency);
+            }
+        }
+    }
+
+  g_free (value);
+
+  if (reader->timeout_id != 0)
+    g_source_remove (reader->timeout_id);
+  reader->timeout_id = g_timeout_add (FANOUT_READER_TIMEOUT_MS, fanout_reader_timeout, reader);
+}
+
+static gint
+compare_latencies (gconstpointer a,
+                   gconstpointer b)
+{
+  guint64 la = *(const guint64 *) a, lb = *(const guint64 *) b;
+
+  return (la > lb) - (la < lb);
+}
+
+/* Run in a child by fanout_test(): listens to the keyfile @filename until
+ * the writer is done, then prints what it received, missed and saw twice,
+ * its latency percentiles in ns and the processor time it used */
+static gint
+fanout_reader_run (const gchar *filename)
+{
+  GSettingsBackend *backend;
+  FanoutReader reader = { NULL, };
+  guint64 p50 = 0, p99 = 0, max = 0;
+  guint n;
+
+  backend = g_keyfile_settings_backend_new (filename, "/", NULL);
+  reader.settings = g_settings_new_with_backend ("org.gsettings.test.storage-test", backend);
+  reader.main_loop = g_main_loop_new (NULL, FALSE);
+  reader.latencies = g_array_new (FALSE, FALSE, sizeof (guint64));
+  reader.last_seq = -1;
+
+  g_signal_connect (reader.settings, "changed::string",
+                    G_CALLBACK (fanout_reader_changed), &reader);
+  g_free (g_settings_get_string (reader.settings, "string"));
+
+  printf ("ready\n");
+  fflush (stdout);
+
+  reader.timeout_id = g_timeout_add (FANOUT_READER_TIMEOUT_MS * 2, fanout_reader_timeout, &reader);
+  g_main_loop_run (reader.main_loop);
+  if (reader.timeout_id != 0)
+    g_source_remove (reader.timeout_id);
+
+  n = reader.latencies->len;
+  if (n > 0)
+    {
+      g_array_sort (reader.latencies, compare_latencies);
+      p50 = g_array_index (reader.latencies, guint64, n / 2);
+      p99 = g_array_index (reader.latencies, guint64, MIN (n * 99 / 100, n - 1));
+      max = g_array_index (reader.latencies, guint64, n - 1);
+    }
+
+  printf ("%u %u %u %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+          " %" G_GUINT64_FORMAT "\n",
+          n, reader.n_missed, reader.n_duplicated, p50, p99, max,
+          bench_get_cpu_time_ns ());
+
+  g_array_free (reader.latencies, TRUE);
+  g_main_loop_unref (reader.main_loop);
+  g_object_unref (reader.settings);
+  g_object_unref (backend);
+
+  return 0;
+}
+
+/* One writer, this process, and M reader processes sharing a keyfile.
+ * Neither the emulated registry, which lives inside one process, nor the
+ * real one elsewhere than Windows can be shared, so this measures the
+ * keyfile backend: how long the file monitor takes to tell each reader,
+ * how many changes get folded together on the way, and what all of it
+ * costs in processor time. */
+static void
+fanout_test (gconstpointer data)
+{
+  GSettingsBackend *backend;
+  GSettings *settings;
+  GError *error = NULL;
+  gchar *tmpdir, *filename, *reader_arg;
+  guint n_readers;
+
+  tmpdir = g_dir_make_tmp ("speed-test-XXXXXX", &error);
+  g_assert_no_error (error);
+  filename = g_build_filename (tmpdir, "fanout.ini", NULL);
+  reader_arg = g_strconcat ("--fanout-reader=", filename, NULL);
+
+  backend = g_keyfile_settings_backend_new (filename, "/", NULL);
+  settings = g_settings_new_with_backend ("org.gsettings.test.storage-test", backend);
+  g_settings_set_string (settings, "string", "start");
+
+  fprintf (stderr, "\nFan-out: %d writes at %d/s through a keyfile\n", fanout_writes, fanout_rate);
+  fprintf (stderr, "%8s %10s %8s %8s %12s %12s %12s %12s\n",
+           "Readers", "received", "missed", "twice", "p50 us", "worst p99 us",
+           "max us", "CPU ms");
+
+  for (n_readers = 1; n_readers <= (guint) fanout_max_readers; n_readers *= 2)
+    {
+      GSubprocess **readers;
+      GDataInputStream **lines;
+      guint64 start_ns, writer_cpu_ns, cpu_ns = 0, p50_sum = 0, p99 = 0, max = 0;
+      guint received = 0, missed = 0, duplicated = 0;
+      gchar value[64], *name;
+      gint seq;
+      guint i;
+
+      readers = g_new (GSubprocess *, n_readers);
+      lines = g_new (GDataInputStream *, n_readers);
+
+      for (i = 0; i < n_readers; i++)
+        {
+          gchar *line;
+
+          readers[i] = g_subprocess_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE |
+                                         G_SUBPROCESS_FLAGS_STDERR_SILENCE, &error,
+                                         startup_program, reader_arg, NULL);
+          g_assert_no_error (error);
+          lines[i] = g_data_input_stream_new (g_subprocess_get_stdout_pipe (readers[i]));
+
+          line = g_data_input_stream_read_line (lines[i], NULL, NULL, &error);
+          g_assert_no_error (error);
+          g_assert_cmpstr (line, ==, "ready");
+          g_free (line);
+        }
+
+      writer_cpu_ns = bench_get_cpu_time_ns ();
+      start_ns = bench_get_time_ns ();
+
+      for (seq = 0; seq < fanout_writes; seq++)
+        {
+          guint64 due_ns = start_ns + (guint64) seq * G_GUINT64_CONSTANT (1000000000) / fanout_rate;
+          guint64 now_ns = bench_get_time_ns ();
+
+          if (now_ns < due_ns)
+            g_usleep ((due_ns - now_ns) / 1000);
+
+          g_snprintf (value, sizeof (value), "%d %" G_GUINT64_FORMAT, seq, bench_get_time_ns ());
+          g_settings_set_string (settings, "string", value);
+
+          while (g_main_context_iteration (NULL, FALSE));
+        }
+
+      g_snprintf (value, sizeof (value), "end %d", fanout_writes);
+      g_settings_set_string (settings, "string", value);
+      util_main_settle ();
+
+      writer_cpu_ns = bench_get_cpu_time_ns () - writer_cpu_ns;
+      cpu_ns += writer_cpu_ns;
+
+      for (i = 0; i < n_readers; i++)
+        {
+          guint64 r_p50, r_p99, r_max, r_cpu;
+          guint r_received, r_missed, r_duplicated;
+          gchar *line;
+
+          line = g_data_input_stream_read_line (lines[i], NULL, NULL, &error);
+          g_assert_no_error (error);
+          g_assert (line != NULL);
+
+          if (sscanf (line, "%u %u %u %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+                      " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+                      &r_received, &r_missed, &r_duplicated,
+                      &r_p50, &r_p99, &r_max, &r_cpu) != 7)
+            g_error ("Unexpected output from reader: %s", line);
+
+          received += r_received;
+          missed += r_missed;
+          duplicated += r_duplicated;
+          p50_sum += r_p50;
+          p99 = MAX (p99, r_p99);
+          max = MAX (max, r_max);
+          cpu_ns += r_cpu;
+
+          g_subprocess_wait_check (readers[i], NULL, &error);
+          g_assert_no_error (error);
+
+          g_free (line);
+          g_object_unref (lines[i]);
+          g_object_unref (readers[i]);
+        }
+
+      fprintf (stderr, "%8u %10u %8u %8u %12.1f %12.1f %12.1f %12.1f\n",
+               n_readers, received, missed, duplicated,
+               p50_sum / n_readers / 1e3, p99 / 1e3, max / 1e3, cpu_ns / 1e6);
+
+      name = g_strdup_printf ("Fanout/%u/p50", n_readers);
+      bench_record (name, "ns", (gdouble) p50_sum / n_readers);
+      g_free (name);
+      name = g_strdup_printf ("Fanout/%u/p99", n_readers);
+      bench_record (name, "ns", p99);
+      g_free (name);
+      name = g_strdup_printf ("Fanout/%u/missed", n_readers);
+      bench_record (name, "notifications", missed);
+      g_free (name);
+      name = g_strdup_printf ("Fanout/%u/duplicated", n_readers);
+      bench_record (name, "notifications", duplicated);
+      g_free (name);
+      name = g_strdup_printf ("Fanout/%u/cpu", n_readers);
+      bench_record (name, "ns", cpu_ns);
+      g_free (name);
+
+      g_free (lines);
+      g_free (readers);
+    }
+
+  fprintf (stderr, "\n");
+
+  g_object_unref (settings);
+  g_object_unref (backend);
+
+  g_remove (filename);
+  g_rmdir (tmpdir);
+  g_free (reader_arg);
+  g_free (filename);
+  g_free (tmpdir);
 }
 
 static void
@@ -69,25 +3194,81 @@ delete_old_keys (void)
   if (util_registry_open_path (NULL, &hparent))
     {
       SHDeleteKeyW(hparent, L"tests\\storage");
+      SHDeleteKeyW(hparent, L"tests\\large-values");
       RegCloseKey (hparent);
     }
 }
 
+static GOptionEntry speed_entries[] = {
+  { "threads", 0, 0, G_OPTION_ARG_INT, &contention_max_threads,
+    "Maximum number of threads for the contention test (default: one per core)", "N" },
+  { "write-percent", 0, 0, G_OPTION_ARG_INT, &contention_write_percent,
+    "Percentage of writes in the contention test (default 20)", "P" },
+  { "contention-ops", 0, 0, G_OPTION_ARG_INT, &contention_ops,
+    "Operations per thread in the contention test (default 2000)", "N" },
+  { "backends", 0, 0, G_OPTION_ARG_STRING, &comparison_backends,
+    "Comma-separated backends to compare: memory, keyfile, registry (default: all)", "LIST" },
+  { "fanout-rate", 0, 0, G_OPTION_ARG_INT, &fanout_rate,
+    "Writes per second in the fan-out test (default 100)", "N" },
+  { "fanout-writes", 0, 0, G_OPTION_ARG_INT, &fanout_writes,
+    "Writes per round of the fan-out test (default 200)", "N" },
+  { "fanout-readers", 0, 0, G_OPTION_ARG_INT, &fanout_max_readers,
+    "Largest number of reader processes in the fan-out test (default 64)", "N" },
+  { "startup-probe", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_INT, &startup_probe,
+    "Measure startup against N generated schemas, for the startup test", "N" },
+  { "fanout-reader", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_FILENAME, &fanout_reader,
+    "Be a reader of the given keyfile, for the fan-out test", "FILE" },
+  { NULL }
+};
+
 int
 main (int    argc,
       char **argv)
 {
+  guint64 start_ns = bench_get_time_ns ();
   gint result;
 
+  startup_program = argv[0];
+  bench_init (&argc, &argv, speed_entries);
+
+  if (startup_probe > 0)
+    return startup_probe_run (start_ns);
+  if (fanout_reader != NULL)
+    return fanout_reader_run (fanout_reader);
+
   g_test_init (&argc, &argv, NULL);
 
   delete_old_keys ();
 
   g_test_add_data_func ("/gsettings/speed/Basic", NULL, basic_test);
+  g_test_add_data_func ("/gsettings/speed/Types", NULL, types_test);
+  g_test_add_data_func ("/gsettings/speed/Contention", NULL, contention_test);
+  g_test_add_data_func ("/gsettings/speed/NotifyLatency", NULL, notify_latency_test);
+  g_test_add_data_func ("/gsettings/speed/Batch", NULL, batch_test);
+  g_test_add_data_func ("/gsettings/speed/Coalesce", NULL, coalesce_test);
+  g_test_add_data_func ("/gsettings/speed/Cache", NULL, cache_test);
+  g_test_add_data_func ("/gsettings/speed/Identical", NULL, identical_test);
+  g_test_add_data_func ("/gsettings/speed/Watches", NULL, watches_test);
+  g_test_add_data_func ("/gsettings/speed/Footprint", NULL, footprint_test);
+  g_test_add_data_func ("/gsettings/speed/Borrow", NULL, borrow_test);
+  g_test_add_data_func ("/gsettings/speed/LargeValues", NULL, large_values_test);
+  g_test_add_data_func ("/gsettings/speed/Throughput", NULL, throughput_test);
+  g_test_add_data_func ("/gsettings/speed/Backends", NULL, backends_test);
+  g_test_add_data_func ("/gsettings/speed/Snapshot", NULL, snapshot_test);
+  g_test_add_data_func ("/gsettings/speed/Construction", NULL, construction_test);
+  g_test_add_data_func ("/gsettings/speed/Startup", NULL, startup_test);
+  g_test_add_data_func ("/gsettings/speed/Fanout", NULL, fanout_test);
+  g_test_add_data_func ("/gsettings/speed/Storm", NULL, storm_test);
+  g_test_add_data_func ("/gsettings/speed/Scale", NULL, scale_test);
+#ifndef G_OS_WIN32
+  g_test_add_data_func ("/gsettings/speed/Stalls", NULL, stall_test);
+#endif
 
   result = g_test_run ();
 
   delete_old_keys ();
 
+  bench_finish ();
+
   return result;
 }
\ No newline at end of file
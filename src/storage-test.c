@@ -12,13 +12,18 @@
 
 #include <stdio.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 #include "storage-test-enums.h"
 
+#ifdef G_OS_WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <shlwapi.h>
+#endif
 
+#include "emulated-registry-backend.h"
+#include "settings-snapshot.h"
 #include "utils.h"
 
 #define TEST_TYPE(_s, _t, _f, _k, _d, _i)  { \
@@ -39,7 +44,7 @@ simple_test (gconstpointer user_data)
   GSettings *settings;
   gchar *string;
 
-  settings = g_settings_new ("org.gsettings.test.storage-test");
+  settings = util_settings_new ("org.gsettings.test.storage-test");
 
   TEST_TYPE (settings, gboolean, "b", "bool", TRUE, FALSE);
 
@@ -74,7 +79,7 @@ hard_test (gconstpointer user_data)
 {
   GSettings *settings;
 
-  settings = g_settings_new ("org.gsettings.test.storage-test");
+  settings = util_settings_new ("org.gsettings.test.storage-test");
 
   TEST_TYPE (settings, gdouble, "d", "double", 3.1415926535897932, -10000000000.5);
 
@@ -89,7 +94,7 @@ complex_test (gconstpointer user_data)
   GVariant *variant;
   gchar **strv;
 
-  settings = g_settings_new ("org.gsettings.test.storage-test");
+  settings = util_settings_new ("org.gsettings.test.storage-test");
 
   strv = g_settings_get_strv (settings, "strv");
   g_assert_cmpstr (strv[0], == , "Hello world");
@@ -110,6 +115,78 @@ complex_test (gconstpointer user_data)
   g_object_unref (settings);
 }
 
+#ifndef G_OS_WIN32
+/* Values written in binary mode must read back the same through either
+ * mode, and text values written before must still read in binary mode */
+static void
+binary_test (gconstpointer user_data)
+{
+  static const gchar *keys[] = { "box", "strv", "noughts-and-crosses", "breakfast" };
+  GSettingsBackend *backend;
+  GSettings *text_settings, *binary_settings;
+  GVariant *value, *stored;
+  HKEY hpath;
+  DWORD type;
+  gint x, y, z;
+  guint i;
+
+  backend = emulated_registry_backend_new ();
+  emulated_registry_backend_set_binary_values (backend, TRUE);
+
+  text_settings = util_settings_new ("org.gsettings.test.storage-test");
+  binary_settings = util_settings_new_with_backend ("org.gsettings.test.storage-test",
+                                                    backend);
+
+  for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    {
+      gunichar2 *name = g_utf8_to_utf16 (keys[i], -1, NULL, NULL, NULL);
+
+      value = g_settings_get_value (text_settings, keys[i]);
+
+      g_settings_set_value (text_settings, keys[i], value);
+      stored = g_settings_get_value (binary_settings, keys[i]);
+      g_assert (g_variant_equal (stored, value));
+      g_variant_unref (stored);
+
+      g_settings_set_value (binary_settings, keys[i], value);
+      stored = g_settings_get_value (text_settings, keys[i]);
+      g_assert (g_variant_equal (stored, value));
+      g_variant_unref (stored);
+
+      g_assert (util_registry_open_path ("tests\\storage", &hpath));
+      g_assert (RegQueryValueExW (hpath, name, NULL, &type, NULL, NULL) == ERROR_SUCCESS);
+      g_assert_cmpint (type, ==, REG_BINARY);
+      RegCloseKey (hpath);
+
+      g_settings_reset (text_settings, keys[i]);
+      g_variant_unref (value);
+      g_free (name);
+    }
+
+  /* A binary value tagged with the wrong type is ignored */
+  g_settings_set (binary_settings, "box", "(iii)", 11, 19, 86);
+
+  if (util_registry_open_path ("tests\\storage", &hpath))
+    {
+      static const BYTE wrong[] = "(uuu)\0\0\0" "\x0b\0\0\0" "\x13\0\0\0" "\x56\0\0\0";
+      LONG result = RegSetValueExW (hpath, L"box", 0, REG_BINARY, wrong, sizeof (wrong) - 1);
+      if (result != ERROR_SUCCESS)
+        g_warning_win32_error (result, "Error breaking 'box'");
+
+      RegCloseKey (hpath);
+    }
+
+  g_settings_get (binary_settings, "box", "(iii)", &x, &y, &z);
+  g_assert (x == 20 && y == 30 && z == 30);
+
+  g_settings_reset (binary_settings, "box");
+
+  g_object_unref (binary_settings);
+  g_object_unref (text_settings);
+  g_object_unref (backend);
+}
+#endif
+
 /* I don't see how this could not work, but you know ... */
 static void
 delay_apply_test (gconstpointer user_data)
@@ -117,7 +194,7 @@ delay_apply_test (gconstpointer user_data)
   GSettings *settings;
   gchar *string;
 
-  settings = g_settings_new ("org.gsettings.test.storage-test");
+  settings = util_settings_new ("org.gsettings.test.storage-test");
   g_settings_delay (settings);
 
   /* If these reads go okay, I'm sure the values are fine (unless GVariant is broken) */
@@ -130,7 +207,7 @@ delay_apply_test (gconstpointer user_data)
   g_assert_cmpint (g_settings_get_int (settings, "a-5"), ==, 88);
   g_object_unref (settings);
 
-  settings = g_settings_new ("org.gsettings.test.storage-test");
+  settings = util_settings_new ("org.gsettings.test.storage-test");
   g_assert_cmpint (g_settings_get_int (settings, "a-5"), ==, 88);
 
   string = g_settings_get_string (settings, "junk");
@@ -151,12 +228,12 @@ relocation_test (gconstpointer user_data)
   GSettings *settings_1, *settings_2;
   gchar *string;
 
-  settings_1 = g_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
-                                         "/tests/storage/a/maze/of/twisty/little/pathnames/all/different/");
+  settings_1 = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                            "/tests/storage/a/maze/of/twisty/little/pathnames/all/different/");
   g_settings_set (settings_1, "marker", "ms", "lamp");
 
-  settings_2 = g_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
-                                         "/tests/storage/a/maze/of/little/twisty/pathnames/all/different/");
+  settings_2 = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                            "/tests/storage/a/maze/of/little/twisty/pathnames/all/different/");
   g_settings_set (settings_2, "marker", "ms", "pirate");
 
   g_settings_get (settings_1, "marker", "ms", &string);
@@ -166,7 +243,16 @@ relocation_test (gconstpointer user_data)
   g_object_unref (settings_1);
 }
 
-/* Break things as a dumb user might */
+static void
+count_changes (GSettings   *settings,
+               const gchar *key,
+               guint       *n_changes)
+{
+  (*n_changes)++;
+}
+
+/* Break things as a dumb user might. Each of our writes and each change
+ * made behind our back is notified once. */
 static void
 breakage_test (gconstpointer user_data)
 {
@@ -175,14 +261,14 @@ breakage_test (gconstpointer user_data)
   gchar *string;
   gint32 int32;
   gint x, y, z;
+  guint n_changes = 0;
 
-  settings = g_settings_new ("org.gsettings.test.storage-test");
+  settings = util_settings_new ("org.gsettings.test.storage-test");
+  g_signal_connect (settings, "changed", G_CALLBACK (count_changes), &n_changes);
 
   /* Delete a value */
   g_settings_set_string (settings, "string", "Calm down");
-
-  //printf ("Will it notify again ???\n");
-  g_usleep (10000);
+  g_assert (util_main_wait_for (&n_changes, 1));
 
   if (util_registry_open_path ("tests\\storage", &hpath))
     {
@@ -197,7 +283,7 @@ breakage_test (gconstpointer user_data)
    * time to propagate because in the real world because 'changed' will be
    * emitted after the read function returns
    */
-  g_usleep (10000);
+  g_assert (util_main_wait_for (&n_changes, 2));
 
   string = g_settings_get_string (settings, "string");
   g_assert_cmpstr (string, ==, "Hello world");
@@ -216,7 +302,7 @@ breakage_test (gconstpointer user_data)
       RegCloseKey (hpath);
     }
 
-  g_usleep (10000);
+  g_assert (util_main_wait_for (&n_changes, 4));
   int32 = g_settings_get_int (settings, "int32");
   g_assert (int32 == 55);
 
@@ -233,7 +319,7 @@ breakage_test (gconstpointer user_data)
       RegCloseKey (hpath);
     }
 
-  g_usleep (10000);
+  g_assert (util_main_wait_for (&n_changes, 6));
 
   g_settings_get (settings, "box", "(iii)", &x, &y, &z);
   g_assert (x == 20 && y == 30 && z == 30);
@@ -251,7 +337,7 @@ breakage_test (gconstpointer user_data)
       RegCloseKey (hpath);
     }
 
-  g_usleep (10000);
+  g_assert (util_main_wait_for (&n_changes, 8));
 
   g_assert_cmpstr (g_settings_get_string (settings, "string"), ==, "");
 
@@ -259,8 +345,10 @@ breakage_test (gconstpointer user_data)
 
 
   /* Delete an entire key */
-  settings = g_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
-                                       "/tests/storage/long-path/");
+  settings = util_settings_new_with_path ("org.gsettings.test.storage-test.long-path",
+                                          "/tests/storage/long-path/");
+  n_changes = 0;
+  g_signal_connect (settings, "changed", G_CALLBACK (count_changes), &n_changes);
   g_settings_set (settings, "marker", "ms", "maybe... maybe not");
 
   if (util_registry_open_path ("tests\\storage", &hpath))
@@ -272,7 +360,7 @@ breakage_test (gconstpointer user_data)
       RegCloseKey (hpath);
     }
 
-  g_usleep (10000);
+  g_assert (util_main_wait_for (&n_changes, 2));
   g_settings_get (settings, "marker", "ms", &string);
 
   g_assert_cmpstr (string, ==, NULL);
@@ -288,7 +376,7 @@ escape_test (gconstpointer user_data)
   gchar **strv;
   const gchar *value[] = { "foo\\.bar", "\\pipo\\.bar", NULL };
 
-  settings = g_settings_new ("org.gsettings.test.storage-test");
+  settings = util_settings_new ("org.gsettings.test.storage-test");
 
   g_settings_set_string (settings, "string", "foo\\.bar");
   string = g_settings_get_string (settings, "string");
@@ -310,7 +398,7 @@ long_key_test(gconstpointer user_data)
 {
     GSettings *settings;
 
-    settings = g_settings_new("org.gsettings.test.storage-test");
+    settings = util_settings_new("org.gsettings.test.storage-test");
     g_settings_delay(settings);
 
     g_settings_set_int(settings, "k12345678901234567890123456789012", 88);
@@ -320,7 +408,7 @@ long_key_test(gconstpointer user_data)
     g_assert_cmpint(g_settings_get_int(settings, "k12345678901234567890123456789012"), == , 88);
     g_object_unref(settings);
 
-    settings = g_settings_new("org.gsettings.test.storage-test");
+    settings = util_settings_new("org.gsettings.test.storage-test");
     g_assert_cmpint(g_settings_get_int(settings, "k12345678901234567890123456789012"), == , 88);
 
     g_settings_reset(settings, "k12345678901234567890123456789012");
@@ -328,6 +416,105 @@ long_key_test(gconstpointer user_data)
     g_object_unref(settings);
 }
 
+static GVariant *
+capture (GSettings *settings)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, SETTINGS_SNAPSHOT_TYPE);
+  settings_snapshot_add (&builder, settings);
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static gboolean
+count_change_events (GSettings    *settings,
+                     const GQuark *keys,
+                     gint          n_keys,
+                     guint        *n_change_events)
+{
+  (*n_change_events)++;
+
+  return FALSE;
+}
+
+/* A restored snapshot must bring back both the stored values and the
+ * defaults of the keys that had none */
+static void
+snapshot_test (gconstpointer user_data)
+{
+  GSettings *settings;
+  GVariantBuilder builder;
+  GVariant *clean, *changed, *loaded, *bad;
+  GError *error = NULL;
+  guint n_change_events = 0;
+  gchar *tmpdir, *filename, *string;
+  gint x, y, z;
+
+  settings = util_settings_new ("org.gsettings.test.storage-test");
+  g_signal_connect (settings, "change-event", G_CALLBACK (count_change_events), &n_change_events);
+  g_settings_reset (settings, "string");
+  g_settings_reset (settings, "box");
+  clean = capture (settings);
+
+  g_settings_set_string (settings, "string", "Snapshot");
+  g_settings_set (settings, "box", "(iii)", 1, 2, 3);
+  changed = capture (settings);
+
+  tmpdir = g_dir_make_tmp ("storage-test-XXXXXX", &error);
+  g_assert_no_error (error);
+  filename = g_build_filename (tmpdir, "snapshot", NULL);
+
+  g_assert (settings_snapshot_save (changed, filename, &error));
+  g_assert_no_error (error);
+
+  /* After the two resets and two writes, each restore is one write_tree
+   * and so one change-event */
+  g_assert (settings_snapshot_restore (clean, util_settings_backend_get ()));
+  g_assert (util_main_wait_for (&n_change_events, 5));
+
+  string = g_settings_get_string (settings, "string");
+  g_assert_cmpstr (string, ==, "Hello world");
+  g_free (string);
+  g_settings_get (settings, "box", "(iii)", &x, &y, &z);
+  g_assert (x == 20 && y == 30 && z == 30);
+
+  loaded = settings_snapshot_load (filename, &error);
+  g_assert_no_error (error);
+  g_assert (g_variant_equal (loaded, changed));
+
+  g_assert (settings_snapshot_restore (loaded, util_settings_backend_get ()));
+  g_assert (util_main_wait_for (&n_change_events, 6));
+
+  string = g_settings_get_string (settings, "string");
+  g_assert_cmpstr (string, ==, "Snapshot");
+  g_free (string);
+  g_settings_get (settings, "box", "(iii)", &x, &y, &z);
+  g_assert (x == 1 && y == 2 && z == 3);
+
+  g_assert (settings_snapshot_restore (clean, util_settings_backend_get ()));
+
+  /* A file could hold anything, but the backend must only get keys */
+  g_variant_builder_init (&builder, SETTINGS_SNAPSHOT_TYPE);
+  g_variant_builder_add (&builder, "{smv}", "/tests/storage//string", NULL);
+  bad = g_variant_ref_sink (g_variant_builder_end (&builder));
+  g_assert (!settings_snapshot_restore (bad, util_settings_backend_get ()));
+  g_assert (settings_snapshot_save (bad, filename, NULL));
+  g_assert (settings_snapshot_load (filename, &error) == NULL);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_clear_error (&error);
+  g_variant_unref (bad);
+
+  g_remove (filename);
+  g_rmdir (tmpdir);
+  g_free (filename);
+  g_free (tmpdir);
+  g_variant_unref (loaded);
+  g_variant_unref (changed);
+  g_variant_unref (clean);
+  g_object_unref (settings);
+}
+
 static void
 delete_old_keys (void)
 {
@@ -347,20 +534,24 @@ main (int    argc,
 {
   gint test_result;
 
-  g_test_init (&argc, &argv, NULL);
+  util_test_init (&argc, &argv);
 
   delete_old_keys ();
 
-  g_test_add_data_func ("/gsettings/Simple Types", NULL, simple_test);
-  g_test_add_data_func ("/gsettings/Hard Types", NULL, hard_test);
-  g_test_add_data_func ("/gsettings/Complex Types", NULL, complex_test);
-  g_test_add_data_func ("/gsettings/Delay apply", NULL, delay_apply_test);
-  g_test_add_data_func ("/gsettings/Relocation", NULL, relocation_test);
-  g_test_add_data_func ("/gsettings/Breakage", NULL, breakage_test);
-  g_test_add_data_func ("/gsettings/Escapes", NULL, escape_test);
-  g_test_add_data_func ("/gsettings/Long Key", NULL, long_key_test);
-
-  test_result = g_test_run ();
+  util_test_add ("/gsettings/Simple Types", NULL, simple_test);
+  util_test_add ("/gsettings/Hard Types", NULL, hard_test);
+  util_test_add ("/gsettings/Complex Types", NULL, complex_test);
+#ifndef G_OS_WIN32
+  util_test_add ("/gsettings/Binary Values", NULL, binary_test);
+#endif
+  util_test_add ("/gsettings/Delay apply", NULL, delay_apply_test);
+  util_test_add ("/gsettings/Relocation", NULL, relocation_test);
+  util_test_add ("/gsettings/Breakage", NULL, breakage_test);
+  util_test_add ("/gsettings/Escapes", NULL, escape_test);
+  util_test_add ("/gsettings/Long Key", NULL, long_key_test);
+  util_test_add ("/gsettings/Snapshot", NULL, snapshot_test);
+
+  test_result = util_test_run ();
 
   delete_old_keys ();
 
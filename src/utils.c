@@ -10,8 +10,51 @@
  * Authors: Sam Thursfield <ssssam@gmail.com>
  */
 
+#include <string.h>
+
+#define G_SETTINGS_ENABLE_BACKEND
+#include <gio/gsettingsbackend.h>
+
 #include "utils.h"
 
+#ifndef G_OS_WIN32
+#include <time.h>
+#include <unistd.h>
+
+#include "emulated-registry-backend.h"
+#endif
+
+#define SHARED_ROOT           "/tests/storage/"
+#define SHARED_REGISTRY_ROOT  "tests\\storage"
+
+/* Where the running util_test_add() case keeps what would otherwise go
+ * under SHARED_ROOT, as a settings path and as a registry key; NULL
+ * outside such cases */
+static gchar *test_root = NULL;
+static gchar *test_registry_root = NULL;
+
+static gchar *
+isolate_path (const gchar *path)
+{
+  if (test_root != NULL && g_str_has_prefix (path, SHARED_ROOT))
+    return g_strconcat (test_root, path + strlen (SHARED_ROOT), NULL);
+
+  return g_strdup (path);
+}
+
+static gchar *
+isolate_registry_path (const gchar *key_name)
+{
+  gsize length = strlen (SHARED_REGISTRY_ROOT);
+
+  if (test_registry_root != NULL && key_name != NULL &&
+      strncmp (key_name, SHARED_REGISTRY_ROOT, length) == 0 &&
+      (key_name[length] == '\0' || key_name[length] == '\\'))
+    return g_strconcat (test_registry_root, key_name + length, NULL);
+
+  return g_strdup (key_name);
+}
+
 void
 g_warning_win32_error (DWORD        result_code,
                        const gchar *format,
@@ -26,7 +69,11 @@ g_warning_win32_error (DWORD        result_code,
 
   va_start (va, format);
   message = g_strdup_vprintf (format, va);
+#ifdef G_OS_WIN32
   win32_error = g_win32_error_message (result_code);
+#else
+  win32_error = registry_emulator_error_message (result_code);
+#endif
   win32_message = g_strdup_printf ("%s: %s", message, win32_error);
   g_free (message);
   g_free (win32_error);
@@ -40,15 +87,46 @@ g_warning_win32_error (DWORD        result_code,
   if ((_r) != ERROR_SUCCESS)                         \
     g_warning_win32_error ((_r), (_m));  G_STMT_END
 
+/* Monotonic, with the finest resolution the platform offers */
+guint64
+util_get_time_ns (void)
+{
+#ifdef G_OS_WIN32
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+
+  if (frequency.QuadPart == 0)
+    QueryPerformanceFrequency (&frequency);
+
+  QueryPerformanceCounter (&counter);
+
+  return (guint64) ((gdouble) counter.QuadPart * 1e9 / frequency.QuadPart);
+#else
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (guint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 gboolean
 util_registry_open_path (const gchar *key_name,
                          HKEY        *hkey)
 {
-  gchar *path;
+  gchar *isolated, *path;
   gunichar2 *pathw;
   LONG result;
- 
-  path = g_build_path ("\\", "Software\\GSettings", key_name, NULL);
+
+#ifndef G_OS_WIN32
+  /* The emulated registry starts out empty; the backend creates the
+   * Software\GSettings key just as GSettings has on any Windows machine */
+  util_settings_backend_get ();
+#endif
+
+  isolated = isolate_registry_path (key_name);
+  path = g_build_path ("\\", "Software\\GSettings", isolated, NULL);
+  g_free (isolated);
   pathw = g_utf8_to_utf16 (path, -1, NULL, NULL, NULL);
 
   result = RegOpenKeyExW (HKEY_CURRENT_USER, pathw, 0, KEY_ALL_ACCESS, hkey);
@@ -62,18 +140,1040 @@ util_registry_open_path (const gchar *key_name,
   return (result == ERROR_SUCCESS);
 }
 
+#define WAIT_TIMEOUT_MS  5000
+#define WAIT_QUIET_MS    50
+
+static gboolean
+wait_expired (gpointer user_data)
+{
+  gboolean *expired = user_data;
+
+  *expired = TRUE;
+
+  return FALSE;
+}
+
+/* Blocks until a source is dispatched or @timeout_ms passes, and returns
+ * FALSE in the latter case */
+static gboolean
+iterate_with_timeout (GMainContext *context,
+                      guint         timeout_ms)
+{
+  GSource *timeout;
+  gboolean expired = FALSE;
+
+  timeout = g_timeout_source_new (timeout_ms);
+  g_source_set_callback (timeout, wait_expired, &expired, NULL);
+  g_source_attach (timeout, context);
+
+  g_main_context_iteration (context, TRUE);
+
+  g_source_destroy (timeout);
+  g_source_unref (timeout);
+
+  return !expired;
+}
+
+static guint
+ms_until (gint64 end_time)
+{
+  gint64 remaining = end_time - g_get_monotonic_time ();
+
+  return remaining > 0 ? (guint) (remaining / 1000) + 1 : 0;
+}
+
+/* Runs the main loop until *@n_events reaches @n_wanted, giving up after
+ * a few seconds, and returns whether it did. For when the events are only
+ * waited for, rather than what is being tested. */
+gboolean
+util_main_wait_for (const guint *n_events,
+                    guint        n_wanted)
+{
+  GMainContext *context = g_main_context_default ();
+  gint64 end_time;
+  guint timeout_ms;
+
+  end_time = g_get_monotonic_time () + WAIT_TIMEOUT_MS * G_TIME_SPAN_MILLISECOND;
+
+  while (*n_events < n_wanted)
+    {
+      timeout_ms = ms_until (end_time);
+      if (timeout_ms == 0)
+        return FALSE;
+
+      iterate_with_timeout (context, timeout_ms);
+    }
+
+  return TRUE;
+}
+
+/* Like util_main_wait_for(), but then carries on until nothing has happened
+ * for a short while, to catch if we are getting more than one notification
+ * when only one thing has changed.
+ */
+gboolean
+util_main_wait (const guint *n_events,
+                guint        n_wanted)
+{
+  GMainContext *context = g_main_context_default ();
+  gint64 end_time, quiet_end_time;
+  guint timeout_ms;
+
+  if (n_events != NULL)
+    util_main_wait_for (n_events, n_wanted);
+
+  /* Something that never goes quiet would be a bug too, so this is
+   * bounded as well */
+  end_time = g_get_monotonic_time () + WAIT_TIMEOUT_MS * G_TIME_SPAN_MILLISECOND;
+  quiet_end_time = g_get_monotonic_time () + WAIT_QUIET_MS * G_TIME_SPAN_MILLISECOND;
+
+  while ((timeout_ms = ms_until (MIN (quiet_end_time, end_time))) > 0)
+    if (iterate_with_timeout (context, timeout_ms))
+      quiet_end_time = g_get_monotonic_time () + WAIT_QUIET_MS * G_TIME_SPAN_MILLISECOND;
+
+  return n_events == NULL || *n_events >= n_wanted;
+}
+
+/* For when no notification is expected, or only a side effect of one */
+void
+util_main_settle (void)
+{
+  util_main_wait (NULL, 0);
+}
+
+/* On Windows this is GIO's registry backend, everywhere else it is the
+ * emulated one so that the tests exercise the same storage layout */
+GSettingsBackend *
+util_settings_backend_get (void)
+{
+  static GSettingsBackend *backend = NULL;
+
+  if (g_once_init_enter (&backend))
+    {
+#ifdef G_OS_WIN32
+      GSettingsBackend *new_backend = g_settings_backend_get_default ();
+#else
+      GSettingsBackend *new_backend = emulated_registry_backend_new ();
+#endif
+      g_once_init_leave (&backend, new_backend);
+    }
+
+  return backend;
+}
+
+/* In a util_test_add() case, schemas whose path is below /tests/storage/
+ * are swapped for their relocatable twin, "<schema_id>.relocatable", at
+ * the same place under the case's own root */
+GSettings *
+util_settings_new_with_backend (const gchar      *schema_id,
+                                GSettingsBackend *backend)
+{
+  GSettingsSchema *schema = NULL;
+  GSettings *settings;
+  const gchar *path;
+
+  if (test_root != NULL)
+    schema = g_settings_schema_source_lookup (g_settings_schema_source_get_default (),
+                                              schema_id, TRUE);
+
+  path = schema != NULL ? g_settings_schema_get_path (schema) : NULL;
+
+  if (path != NULL && g_str_has_prefix (path, SHARED_ROOT))
+    {
+      gchar *relocatable_id = g_strconcat (schema_id, ".relocatable", NULL);
+      gchar *isolated = isolate_path (path);
+
+      settings = g_settings_new_with_backend_and_path (relocatable_id, backend, isolated);
+
+      g_free (isolated);
+      g_free (relocatable_id);
+    }
+  else
+    settings = g_settings_new_with_backend (schema_id, backend);
+
+  if (schema != NULL)
+    g_settings_schema_unref (schema);
+
+  return settings;
+}
+
+GSettings *
+util_settings_new_with_backend_and_path (const gchar      *schema_id,
+                                         GSettingsBackend *backend,
+                                         const gchar      *path)
+{
+  GSettings *settings;
+  gchar *isolated;
+
+  isolated = isolate_path (path);
+  settings = g_settings_new_with_backend_and_path (schema_id, backend, isolated);
+  g_free (isolated);
+
+  return settings;
+}
+
+GSettings *
+util_settings_new (const gchar *schema_id)
+{
+  return util_settings_new_with_backend (schema_id, util_settings_backend_get ());
+}
+
+GSettings *
+util_settings_new_with_path (const gchar *schema_id,
+                             const gchar *path)
+{
+  return util_settings_new_with_backend_and_path (schema_id,
+                                                  util_settings_backend_get (),
+                                                  path);
+}
+
+typedef struct {
+  GTestDataFunc  func;
+  gconstpointer  data;
+} TestCase;
+
+static gint       test_jobs = 1;
+static gchar     *test_program = NULL;
+static GPtrArray *test_paths = NULL;
+static GPtrArray *test_args = NULL;     /* passed on to the workers */
+static gboolean   test_selected = FALSE;
+
+/* Whether @arg chooses which cases run, which only GTest can apply */
+static gboolean
+is_selection_arg (const gchar *arg)
+{
+  static const gchar *options[] = { "-p", "-s", "-l", "--skip-prefix" };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (options); i++)
+    {
+      gsize len = strlen (options[i]);
+
+      if (strncmp (arg, options[i], len) == 0 &&
+          (arg[len] == '\0' || arg[len] == '='))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 void
-util_main_iterate (void)
+util_test_init (int    *argc,
+                char ***argv)
+{
+  gint i, j;
+
+  test_program = g_strdup ((*argv)[0]);
+  test_paths = g_ptr_array_new_with_free_func (g_free);
+  test_args = g_ptr_array_new_with_free_func (g_free);
+
+  /* g_test_init() rejects options it does not know, and takes away the
+   * ones it does, so keep a copy of those for the workers */
+  for (i = j = 1; i < *argc; i++)
+    {
+      if (g_str_has_prefix ((*argv)[i], "--jobs="))
+        test_jobs = g_ascii_strtoll ((*argv)[i] + strlen ("--jobs="), NULL, 10);
+      else
+        {
+          if (is_selection_arg ((*argv)[i]))
+            test_selected = TRUE;
+
+          g_ptr_array_add (test_args, g_strdup ((*argv)[i]));
+          (*argv)[j++] = (*argv)[i];
+        }
+    }
+  *argc = j;
+  (*argv)[j] = NULL;
+
+  if (test_jobs <= 0)
+    test_jobs = g_get_num_processors ();
+
+  g_test_init (argc, argv, NULL);
+}
+
+static void
+delete_test_root (void)
+{
+  gunichar2 *rootw;
+  HKEY hparent;
+
+  if (util_registry_open_path (NULL, &hparent))
+    {
+      rootw = g_utf8_to_utf16 (test_registry_root, -1, NULL, NULL, NULL);
+      SHDeleteKeyW (hparent, rootw);
+      RegCloseKey (hparent);
+      g_free (rootw);
+    }
+}
+
+static void
+run_isolated (gconstpointer data)
+{
+  static guint n_roots = 0;
+  const TestCase *test_case = data;
+  gulong pid;
+
+#ifdef G_OS_WIN32
+  pid = GetCurrentProcessId ();
+#else
+  pid = getpid ();
+#endif
+
+  /* Unique across the worker processes, which may share a registry */
+  test_root = g_strdup_printf ("/tests/isolated-%lu-%u/", pid, ++n_roots);
+  test_registry_root = g_strdup_printf ("tests\\isolated-%lu-%u", pid, n_roots);
+
+  test_case->func (test_case->data);
+
+  /* Let notifications for the case's keys go before the keys do */
+  util_main_settle ();
+  delete_test_root ();
+
+  g_clear_pointer (&test_registry_root, g_free);
+  g_clear_pointer (&test_root, g_free);
+}
+
+void
+util_test_add (const gchar   *test_path,
+               gconstpointer  test_data,
+               GTestDataFunc  test_func)
+{
+  TestCase *test_case;
+
+  g_return_if_fail (test_paths != NULL);
+
+  test_case = g_new (TestCase, 1);
+  test_case->func = test_func;
+  test_case->data = test_data;
+
+  g_ptr_array_add (test_paths, g_strdup (test_path));
+  g_test_add_data_func_full (test_path, test_case, run_isolated, g_free);
+}
+
+/* Deals the cases out round-robin to @test_jobs copies of this program,
+ * each running its share with -p and the rest of our arguments. Their
+ * output is collected and printed one worker after another. */
+static gint
+run_workers (void)
+{
+  GSubprocess **workers;
+  GError *error = NULL;
+  gint result = 0;
+  gint n_workers, w;
+  guint i;
+
+  n_workers = MIN ((guint) test_jobs, test_paths->len);
+  workers = g_new0 (GSubprocess *, n_workers);
+
+  for (w = 0; w < n_workers; w++)
+    {
+      GPtrArray *args = g_ptr_array_new ();
+
+      g_ptr_array_add (args, test_program);
+      for (i = 0; i < test_args->len; i++)
+        g_ptr_array_add (args, test_args->pdata[i]);
+      for (i = w; i < test_paths->len; i += n_workers)
+        {
+          g_ptr_array_add (args, (gpointer) "-p");
+          g_ptr_array_add (args, test_paths->pdata[i]);
+        }
+      g_ptr_array_add (args, NULL);
+
+      workers[w] = g_subprocess_newv ((const gchar * const *) args->pdata,
+                                      G_SUBPROCESS_FLAGS_STDOUT_PIPE, &error);
+      g_ptr_array_free (args, TRUE);
+
+      if (workers[w] == NULL)
+        {
+          g_warning ("Could not start worker %d: %s", w, error->message);
+          g_clear_error (&error);
+          result = 1;
+        }
+    }
+
+  /* A worker whose pipe fills up just waits until we get to it */
+  for (w = 0; w < n_workers; w++)
+    if (workers[w] != NULL)
+      {
+        gchar *output = NULL;
+
+        if (g_subprocess_communicate_utf8 (workers[w], NULL, NULL, &output, NULL, &error))
+          {
+            g_print ("# Worker %d\n%s", w, output);
+            g_free (output);
+
+            if (!g_subprocess_get_successful (workers[w]))
+              {
+                g_warning ("Worker %d failed", w);
+                result = 1;
+              }
+          }
+        else
+          {
+            g_warning ("Worker %d failed: %s", w, error->message);
+            g_clear_error (&error);
+            result = 1;
+          }
+
+        g_object_unref (workers[w]);
+      }
+
+  g_free (workers);
+
+  return result;
+}
+
+/* Runs the cases here, or across worker processes with --jobs=N where N
+ * is more than 1, or 0 for one per core. Choosing cases with -p, -s,
+ * --skip-prefix or -l keeps them here, where GTest can apply the choice. */
+gint
+util_test_run (void)
+{
+  gint result;
+
+  if (test_jobs > 1 && test_paths->len > 1 && !test_selected)
+    result = run_workers ();
+  else
+    result = g_test_run ();
+
+  g_ptr_array_unref (test_paths);
+  test_paths = NULL;
+  g_ptr_array_unref (test_args);
+  test_args = NULL;
+  g_free (test_program);
+  test_program = NULL;
+
+  return result;
+}
+
+typedef struct {
+  GVariant     *value;
+  const gchar **strv;     /* borrowed from @value, made on demand */
+} ViewEntry;
+
+struct _UtilSettingsView {
+  GSettings  *settings;
+  GHashTable *entries;   /* key -> ViewEntry */
+  gulong      change_event_id;
+};
+
+static void
+view_entry_free (ViewEntry *entry)
+{
+  g_free (entry->strv);
+  g_variant_unref (entry->value);
+  g_slice_free (ViewEntry, entry);
+}
+
+/* "change-event" comes before any "changed" handler runs, so none of them
+ * can peek at a value that is already out of date */
+static gboolean
+view_change_event (GSettings        *settings,
+                   const GQuark     *keys,
+                   gint              n_keys,
+                   UtilSettingsView *view)
 {
   gint i;
 
-  /* We iterate the main loop for a while, even after we have received the
-   * change notification, to catch if we are getting more than one when only
-   * one thing has changed.
-   */
-  for (i = 0; i < 1000; i++)
+  if (keys == NULL)
+    g_hash_table_remove_all (view->entries);
+  else
+    for (i = 0; i < n_keys; i++)
+      g_hash_table_remove (view->entries, g_quark_to_string (keys[i]));
+
+  return FALSE;
+}
+
+UtilSettingsView *
+util_settings_view_new (GSettings *settings)
+{
+  UtilSettingsView *view = g_slice_new (UtilSettingsView);
+
+  view->settings = g_object_ref (settings);
+  view->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify) view_entry_free);
+  view->change_event_id = g_signal_connect (settings, "change-event",
+                                            G_CALLBACK (view_change_event), view);
+
+  return view;
+}
+
+void
+util_settings_view_free (UtilSettingsView *view)
+{
+  g_signal_handler_disconnect (view->settings, view->change_event_id);
+  g_hash_table_unref (view->entries);
+  g_object_unref (view->settings);
+  g_slice_free (UtilSettingsView, view);
+}
+
+static ViewEntry *
+view_lookup (UtilSettingsView *view,
+             const gchar      *key)
+{
+  ViewEntry *entry = g_hash_table_lookup (view->entries, key);
+
+  if (entry == NULL)
     {
-      g_main_context_iteration (NULL, FALSE);
-      g_usleep (100);
+      entry = g_slice_new (ViewEntry);
+      entry->value = g_settings_get_value (view->settings, key);
+      entry->strv = NULL;
+      g_hash_table_insert (view->entries, g_strdup (key), entry);
     }
+
+  return entry;
+}
+
+GVariant *
+util_settings_view_peek_value (UtilSettingsView *view,
+                               const gchar      *key)
+{
+  return view_lookup (view, key)->value;
+}
+
+const gchar *
+util_settings_view_peek_string (UtilSettingsView *view,
+                                const gchar      *key)
+{
+  return g_variant_get_string (view_lookup (view, key)->value, NULL);
+}
+
+const gchar * const *
+util_settings_view_peek_strv (UtilSettingsView *view,
+                              const gchar      *key)
+{
+  ViewEntry *entry = view_lookup (view, key);
+
+  if (entry->strv == NULL)
+    entry->strv = g_variant_get_strv (entry->value, NULL);
+
+  return entry->strv;
+}
+
+typedef struct {
+  gchar     *id;          /* schema id followed by the path, if any */
+  GSettings *settings;
+} PoolEntry;
+
+struct _UtilSettingsPool {
+  GSettingsBackend *backend;
+  guint             max_size;
+  GHashTable       *entries;   /* id -> link in @lru */
+  GQueue            lru;       /* PoolEntry, most recently used first */
+};
+
+static void
+pool_entry_free (PoolEntry *entry)
+{
+  g_object_unref (entry->settings);
+  g_free (entry->id);
+  g_slice_free (PoolEntry, entry);
+}
+
+UtilSettingsPool *
+util_settings_pool_new (GSettingsBackend *backend,
+                        guint             max_size)
+{
+  UtilSettingsPool *pool;
+
+  g_return_val_if_fail (G_IS_SETTINGS_BACKEND (backend), NULL);
+  g_return_val_if_fail (max_size > 0, NULL);
+
+  pool = g_slice_new (UtilSettingsPool);
+  pool->backend = g_object_ref (backend);
+  pool->max_size = max_size;
+  pool->entries = g_hash_table_new (g_str_hash, g_str_equal);
+  g_queue_init (&pool->lru);
+
+  return pool;
+}
+
+void
+util_settings_pool_free (UtilSettingsPool *pool)
+{
+  PoolEntry *entry;
+
+  g_hash_table_unref (pool->entries);
+  while ((entry = g_queue_pop_head (&pool->lru)) != NULL)
+    pool_entry_free (entry);
+  g_object_unref (pool->backend);
+  g_slice_free (UtilSettingsPool, pool);
+}
+
+GSettings *
+util_settings_pool_get (UtilSettingsPool *pool,
+                        const gchar      *schema_id,
+                        const gchar      *path)
+{
+  PoolEntry *entry;
+  GList *link;
+  gchar *id;
+
+  /* Paths start with '/', which schema ids cannot contain */
+  id = g_strconcat (schema_id, path, NULL);
+  link = g_hash_table_lookup (pool->entries, id);
+
+  if (link != NULL)
+    {
+      g_queue_unlink (&pool->lru, link);
+      g_queue_push_head_link (&pool->lru, link);
+      g_free (id);
+
+      return g_object_ref (((PoolEntry *) link->data)->settings);
+    }
+
+  entry = g_slice_new (PoolEntry);
+  entry->id = id;
+  if (path != NULL)
+    entry->settings = util_settings_new_with_backend_and_path (schema_id, pool->backend, path);
+  else
+    entry->settings = util_settings_new_with_backend (schema_id, pool->backend);
+
+  g_queue_push_head (&pool->lru, entry);
+  g_hash_table_insert (pool->entries, entry->id, pool->lru.head);
+
+  if (pool->lru.length > pool->max_size)
+    {
+      PoolEntry *oldest = g_queue_pop_tail (&pool->lru);
+
+      g_hash_table_remove (pool->entries, oldest->id);
+      pool_entry_free (oldest);
+    }
+
+  return g_object_ref (entry->settings);
+}
+
+struct _UtilChangeAggregator {
+  GSettings       *settings;
+  guint            window_ms;
+  UtilChangesFunc  func;
+  gpointer         user_data;
+
+  gulong           change_event_id;
+  GHashTable      *pending;       /* GQuark set */
+  gboolean         all_pending;   /* a change-event without keys */
+  GSource         *flush_source;
+};
+
+static gboolean
+aggregator_flush (gpointer user_data)
+{
+  UtilChangeAggregator *aggregator = user_data;
+  GPtrArray *keys;
+
+  g_source_unref (aggregator->flush_source);
+  aggregator->flush_source = NULL;
+
+  keys = g_ptr_array_new ();
+
+  if (aggregator->all_pending)
+    {
+      GSettingsSchema *schema;
+      gchar **names;
+      guint i;
+
+      g_object_get (aggregator->settings, "settings-schema", &schema, NULL);
+      names = g_settings_schema_list_keys (schema);
+      for (i = 0; names[i] != NULL; i++)
+        g_ptr_array_add (keys, (gpointer) g_intern_string (names[i]));
+      g_strfreev (names);
+      g_settings_schema_unref (schema);
+    }
+  else
+    {
+      GHashTableIter iter;
+      gpointer quark;
+
+      g_hash_table_iter_init (&iter, aggregator->pending);
+      while (g_hash_table_iter_next (&iter, &quark, NULL))
+        g_ptr_array_add (keys, (gpointer) g_quark_to_string (GPOINTER_TO_UINT (quark)));
+    }
+
+  g_ptr_array_add (keys, NULL);
+
+  g_hash_table_remove_all (aggregator->pending);
+  aggregator->all_pending = FALSE;
+
+  aggregator->func (aggregator->settings, (const gchar * const *) keys->pdata,
+                    aggregator->user_data);
+
+  g_ptr_array_free (keys, TRUE);
+
+  return FALSE;
+}
+
+static gboolean
+aggregator_change_event (GSettings            *settings,
+                         const GQuark         *keys,
+                         gint                  n_keys,
+                         UtilChangeAggregator *aggregator)
+{
+  gint i;
+
+  if (keys == NULL)
+    aggregator->all_pending = TRUE;
+  else
+    for (i = 0; i < n_keys; i++)
+      g_hash_table_add (aggregator->pending, GUINT_TO_POINTER (keys[i]));
+
+  /* The window opens with the first change rather than moving with each
+   * one, so that a storm that never lets up is still reported */
+  if (aggregator->flush_source == NULL)
+    {
+      aggregator->flush_source = g_timeout_source_new (aggregator->window_ms);
+      g_source_set_callback (aggregator->flush_source, aggregator_flush, aggregator, NULL);
+      g_source_attach (aggregator->flush_source, g_main_context_get_thread_default ());
+    }
+
+  return FALSE;
+}
+
+UtilChangeAggregator *
+util_change_aggregator_new (GSettings       *settings,
+                            guint            window_ms,
+                            UtilChangesFunc  func,
+                            gpointer         user_data)
+{
+  UtilChangeAggregator *aggregator;
+
+  g_return_val_if_fail (G_IS_SETTINGS (settings), NULL);
+  g_return_val_if_fail (func != NULL, NULL);
+
+  aggregator = g_slice_new0 (UtilChangeAggregator);
+  aggregator->settings = g_object_ref (settings);
+  aggregator->window_ms = window_ms;
+  aggregator->func = func;
+  aggregator->user_data = user_data;
+  aggregator->pending = g_hash_table_new (NULL, NULL);
+  aggregator->change_event_id = g_signal_connect (settings, "change-event",
+                                                  G_CALLBACK (aggregator_change_event),
+                                                  aggregator);
+
+  return aggregator;
+}
+
+/* Changes still waiting for the window to close are dropped */
+void
+util_change_aggregator_free (UtilChangeAggregator *aggregator)
+{
+  if (aggregator->flush_source != NULL)
+    {
+      g_source_destroy (aggregator->flush_source);
+      g_source_unref (aggregator->flush_source);
+    }
+
+  g_signal_handler_disconnect (aggregator->settings, aggregator->change_event_id);
+  g_hash_table_unref (aggregator->pending);
+  g_object_unref (aggregator->settings);
+  g_slice_free (UtilChangeAggregator, aggregator);
+}
+
+typedef struct {
+  gint64         duration_ns;
+  GQuark         key;
+  UtilStallKind  kind;
+} UtilStall;
+
+/* A "change-event" emission that has started */
+typedef struct {
+  guint64        start_ns;
+  GQuark         key;
+  const GQuark  *keys;        /* with n_keys, tells the emission's end */
+  gint           n_keys;
+} PendingDispatch;
+
+struct _UtilStallMonitor {
+  GSettings *settings;
+
+  gulong     change_event_id;
+  gulong     change_event_after_id;
+
+  GArray    *dispatches;      /* PendingDispatch, innermost last; they
+                               * nest when a handler writes */
+  GArray    *stalls;          /* UtilStall */
+
+  /* How deep the dispatches were when the running
+   * util_stall_monitor_set_value() started, and the time spent since in
+   * dispatches that it caused */
+  guint      write_depth;
+  guint64    write_dispatch_ns;
+};
+
+static void
+stall_add (UtilStallMonitor *monitor,
+           UtilStallKind     kind,
+           GQuark            key,
+           gint64            duration_ns)
+{
+  UtilStall stall = { duration_ns, key, kind };
+
+  g_array_append_val (monitor->stalls, stall);
+}
+
+static gboolean
+stall_change_event (GSettings        *settings,
+                    const GQuark     *keys,
+                    gint              n_keys,
+                    UtilStallMonitor *monitor)
+{
+  PendingDispatch dispatch;
+
+  dispatch.start_ns = util_get_time_ns ();
+  dispatch.key = (keys != NULL && n_keys > 0) ? keys[0] : g_quark_from_static_string ("*");
+  dispatch.keys = keys;
+  dispatch.n_keys = n_keys;
+  g_array_append_val (monitor->dispatches, dispatch);
+
+  return FALSE;
+}
+
+/* Connected after the class handler, which emits "changed", so this runs
+ * once every handler of both signals has */
+static gboolean
+stall_change_event_after (GSettings        *settings,
+                          const GQuark     *keys,
+                          gint              n_keys,
+                          UtilStallMonitor *monitor)
+{
+  PendingDispatch *dispatch = NULL;
+  gint64 duration_ns;
+  guint i;
+
+  /* A handler that returns TRUE ends its emission before we get here, so
+   * anything started after this emission and still pending never ends;
+   * it is dropped along with this one */
+  i = monitor->dispatches->len;
+  while (i > 0)
+    {
+      dispatch = &g_array_index (monitor->dispatches, PendingDispatch, --i);
+      if (dispatch->keys == keys && dispatch->n_keys == n_keys)
+        break;
+      dispatch = NULL;
+    }
+
+  if (dispatch == NULL)
+    return FALSE;
+
+  duration_ns = util_get_time_ns () - dispatch->start_ns;
+  stall_add (monitor, UTIL_STALL_DISPATCH, dispatch->key, duration_ns);
+  g_array_set_size (monitor->dispatches, i);
+
+  if (i <= monitor->write_depth)
+    monitor->write_dispatch_ns += duration_ns;
+
+  return FALSE;
+}
+
+UtilStallMonitor *
+util_stall_monitor_new (GSettings *settings)
+{
+  UtilStallMonitor *monitor;
+
+  g_return_val_if_fail (G_IS_SETTINGS (settings), NULL);
+
+  monitor = g_slice_new0 (UtilStallMonitor);
+  monitor->settings = g_object_ref (settings);
+  monitor->dispatches = g_array_new (FALSE, FALSE, sizeof (PendingDispatch));
+  monitor->stalls = g_array_new (FALSE, FALSE, sizeof (UtilStall));
+  monitor->change_event_id = g_signal_connect (settings, "change-event",
+                                               G_CALLBACK (stall_change_event),
+                                               monitor);
+  monitor->change_event_after_id = g_signal_connect_after (settings, "change-event",
+                                                           G_CALLBACK (stall_change_event_after),
+                                                           monitor);
+
+  return monitor;
+}
+
+void
+util_stall_monitor_free (UtilStallMonitor *monitor)
+{
+  g_signal_handler_disconnect (monitor->settings, monitor->change_event_id);
+  g_signal_handler_disconnect (monitor->settings, monitor->change_event_after_id);
+  g_array_free (monitor->dispatches, TRUE);
+  g_array_free (monitor->stalls, TRUE);
+  g_object_unref (monitor->settings);
+  g_slice_free (UtilStallMonitor, monitor);
+}
+
+gboolean
+util_stall_monitor_set_value (UtilStallMonitor *monitor,
+                              const gchar      *key,
+                              GVariant         *value)
+{
+  guint64 start_ns, saved_dispatch_ns;
+  guint saved_depth;
+  gboolean success;
+
+  /* A handler may write too, inside our write; its dispatches are then
+   * already part of the one it is in */
+  saved_depth = monitor->write_depth;
+  saved_dispatch_ns = monitor->write_dispatch_ns;
+  monitor->write_depth = monitor->dispatches->len;
+  monitor->write_dispatch_ns = 0;
+
+  start_ns = util_get_time_ns ();
+  success = g_settings_set_value (monitor->settings, key, value);
+  stall_add (monitor, UTIL_STALL_WRITE, g_quark_from_string (key),
+             util_get_time_ns () - start_ns - monitor->write_dispatch_ns);
+
+  monitor->write_depth = saved_depth;
+  monitor->write_dispatch_ns = saved_dispatch_ns;
+
+  return success;
+}
+
+static gint
+stall_compare (gconstpointer a,
+               gconstpointer b)
+{
+  const UtilStall *stall_a = a, *stall_b = b;
+
+  return (stall_a->duration_ns > stall_b->duration_ns) - (stall_a->duration_ns < stall_b->duration_ns);
+}
+
+/* The stalls of @kind, shortest first */
+static GArray *
+stalls_sorted (UtilStallMonitor *monitor,
+               UtilStallKind     kind)
+{
+  GArray *sorted;
+  guint i;
+
+  sorted = g_array_new (FALSE, FALSE, sizeof (UtilStall));
+  for (i = 0; i < monitor->stalls->len; i++)
+    if (g_array_index (monitor->stalls, UtilStall, i).kind == kind)
+      g_array_append_val (sorted, g_array_index (monitor->stalls, UtilStall, i));
+
+  g_array_sort (sorted, stall_compare);
+
+  return sorted;
+}
+
+guint
+util_stall_monitor_get_count (UtilStallMonitor *monitor,
+                              UtilStallKind     kind)
+{
+  guint i, count = 0;
+
+  for (i = 0; i < monitor->stalls->len; i++)
+    if (g_array_index (monitor->stalls, UtilStall, i).kind == kind)
+      count++;
+
+  return count;
+}
+
+gint64
+util_stall_monitor_get_percentile (UtilStallMonitor *monitor,
+                                   UtilStallKind     kind,
+                                   gdouble           percentile)
+{
+  GArray *sorted;
+  gint64 duration_ns = 0;
+  guint index;
+
+  sorted = stalls_sorted (monitor, kind);
+
+  if (sorted->len > 0)
+    {
+      index = (guint) (percentile / 100.0 * (sorted->len - 1) + 0.5);
+      duration_ns = g_array_index (sorted, UtilStall, MIN (index, sorted->len - 1)).duration_ns;
+    }
+
+  g_array_free (sorted, TRUE);
+
+  return duration_ns;
+}
+
+const gchar *
+util_stall_monitor_get_worst_key (UtilStallMonitor *monitor,
+                                  UtilStallKind     kind)
+{
+  GArray *sorted;
+  const gchar *key = NULL;
+
+  sorted = stalls_sorted (monitor, kind);
+  if (sorted->len > 0)
+    key = g_quark_to_string (g_array_index (sorted, UtilStall, sorted->len - 1).key);
+  g_array_free (sorted, TRUE);
+
+  return key;
+}
+
+typedef struct {
+  GQuark  key;
+  guint   count[2];
+  gint64  max_ns[2];
+  gint64  total_ns[2];
+} StallSummary;
+
+static gint
+stall_summary_compare (gconstpointer a,
+                       gconstpointer b)
+{
+  const StallSummary *summary_a = a, *summary_b = b;
+  gint64 worst_a = MAX (summary_a->max_ns[0], summary_a->max_ns[1]);
+  gint64 worst_b = MAX (summary_b->max_ns[0], summary_b->max_ns[1]);
+
+  return (worst_a < worst_b) - (worst_a > worst_b);
+}
+
+gchar *
+util_stall_monitor_describe (UtilStallMonitor *monitor)
+{
+  GArray *summaries;
+  GHashTable *index;
+  GString *text;
+  guint i;
+
+  summaries = g_array_new (FALSE, TRUE, sizeof (StallSummary));
+  index = g_hash_table_new (NULL, NULL);
+
+  for (i = 0; i < monitor->stalls->len; i++)
+    {
+      UtilStall *stall = &g_array_index (monitor->stalls, UtilStall, i);
+      StallSummary *summary;
+      gpointer position;
+
+      if (!g_hash_table_lookup_extended (index, GUINT_TO_POINTER (stall->key), NULL, &position))
+        {
+          position = GUINT_TO_POINTER (summaries->len);
+          g_array_set_size (summaries, summaries->len + 1);
+          g_array_index (summaries, StallSummary, summaries->len - 1).key = stall->key;
+          g_hash_table_insert (index, GUINT_TO_POINTER (stall->key), position);
+        }
+
+      summary = &g_array_index (summaries, StallSummary, GPOINTER_TO_UINT (position));
+      summary->count[stall->kind]++;
+      summary->max_ns[stall->kind] = MAX (summary->max_ns[stall->kind], stall->duration_ns);
+      summary->total_ns[stall->kind] += stall->duration_ns;
+    }
+
+  g_array_sort (summaries, stall_summary_compare);
+
+  text = g_string_new (NULL);
+  g_string_append_printf (text, "%-24s %10s %12s %12s %10s %12s %12s\n", "Key",
+                          "dispatches", "max (us)", "mean (us)",
+                          "writes", "max (us)", "mean (us)");
+
+  for (i = 0; i < summaries->len; i++)
+    {
+      StallSummary *summary = &g_array_index (summaries, StallSummary, i);
+
+      g_string_append_printf (text, "%-24s %10u %12.1f %12.1f %10u %12.1f %12.1f\n",
+                              g_quark_to_string (summary->key),
+                              summary->count[UTIL_STALL_DISPATCH],
+                              summary->max_ns[UTIL_STALL_DISPATCH] / 1000.0,
+                              summary->count[UTIL_STALL_DISPATCH] > 0 ?
+                                summary->total_ns[UTIL_STALL_DISPATCH] / 1000.0 / summary->count[UTIL_STALL_DISPATCH] : 0,
+                              summary->count[UTIL_STALL_WRITE],
+                              summary->max_ns[UTIL_STALL_WRITE] / 1000.0,
+                              summary->count[UTIL_STALL_WRITE] > 0 ?
+                                summary->total_ns[UTIL_STALL_WRITE] / 1000.0 / summary->count[UTIL_STALL_WRITE] : 0);
+    }
+
+  g_hash_table_unref (index);
+  g_array_free (summaries, TRUE);
+
+  return g_string_free (text, FALSE);
 }
@@ -11,7 +11,13 @@
  */
 
 #include <glib.h>
+#include <gio/gio.h>
+
+#ifdef G_OS_WIN32
 #include <windows.h>
+#else
+#include "registry-emulator.h"
+#endif
 
 #ifndef __UTILS_H__
 #define __UTILS_H__
@@ -29,7 +35,121 @@ void g_warning_win32_error (DWORD        result_code,
 gboolean util_registry_open_path (const gchar *key_name,
                                   HKEY        *hkey);
 
-void util_main_iterate (void);
+guint64  util_get_time_ns        (void);
+
+gboolean util_main_wait     (const guint *n_events,
+                             guint        n_wanted);
+gboolean util_main_wait_for (const guint *n_events,
+                             guint        n_wanted);
+void     util_main_settle   (void);
+
+GSettingsBackend *util_settings_backend_get (void);
+
+GSettings *util_settings_new                       (const gchar      *schema_id);
+GSettings *util_settings_new_with_path             (const gchar      *schema_id,
+                                                    const gchar      *path);
+GSettings *util_settings_new_with_backend          (const gchar      *schema_id,
+                                                    GSettingsBackend *backend);
+GSettings *util_settings_new_with_backend_and_path (const gchar      *schema_id,
+                                                    GSettingsBackend *backend,
+                                                    const gchar      *path);
+
+/* Each case added with util_test_add() runs under a root of its own in
+ * place of /tests/storage/, which the functions above and
+ * util_registry_open_path() substitute without the case knowing, and
+ * which is deleted once the case is over. With cases unable to see each
+ * other's keys, util_test_run() can spread them across worker processes
+ * when the program is given --jobs=N. */
+void util_test_init (int            *argc,
+                     char         ***argv);
+void util_test_add  (const gchar    *test_path,
+                     gconstpointer   test_data,
+                     GTestDataFunc   test_func);
+gint util_test_run  (void);
+
+/* Read access to a GSettings without copying. Everything the peek
+ * functions return belongs to the view and stays valid until the next
+ * "changed" signal for that key, or until the view is freed. Like the
+ * signal, the view must only be used from the GSettings' main context. */
+typedef struct _UtilSettingsView UtilSettingsView;
+
+UtilSettingsView    *util_settings_view_new         (GSettings        *settings);
+void                 util_settings_view_free        (UtilSettingsView *view);
+
+GVariant            *util_settings_view_peek_value  (UtilSettingsView *view,
+                                                     const gchar      *key);
+const gchar         *util_settings_view_peek_string (UtilSettingsView *view,
+                                                     const gchar      *key);
+const gchar * const *util_settings_view_peek_strv   (UtilSettingsView *view,
+                                                     const gchar      *key);
+
+/* Shares GSettings objects by schema id and path, since creating one costs
+ * a schema lookup, path checks and a backend subscription. The pool keeps
+ * the @max_size most recently requested objects alive; an object evicted
+ * meanwhile lives on for as long as its callers hold it. Like GSettings
+ * signals, a pool belongs to one thread. */
+typedef struct _UtilSettingsPool UtilSettingsPool;
+
+UtilSettingsPool    *util_settings_pool_new         (GSettingsBackend *backend,
+                                                     guint             max_size);
+void                 util_settings_pool_free        (UtilSettingsPool *pool);
+
+/* Returns a new reference; @path is NULL for schemas with a fixed path */
+GSettings           *util_settings_pool_get         (UtilSettingsPool *pool,
+                                                     const gchar      *schema_id,
+                                                     const gchar      *path);
+
+/* Collects the keys of every "change-event" on @settings for @window_ms
+ * from the first one, then hands them to @func at once, each key only
+ * once and in no particular order. A change-event that names no keys
+ * stands for all of them. The window runs in the thread-default main
+ * context of the caller. */
+typedef struct _UtilChangeAggregator UtilChangeAggregator;
+
+typedef void (*UtilChangesFunc) (GSettings           *settings,
+                                 const gchar * const *keys,
+                                 gpointer             user_data);
+
+UtilChangeAggregator *util_change_aggregator_new  (GSettings            *settings,
+                                                   guint                 window_ms,
+                                                   UtilChangesFunc       func,
+                                                   gpointer              user_data);
+void                  util_change_aggregator_free (UtilChangeAggregator *aggregator);
+
+/* Measures how long @settings holds up its thread: each dispatch of a
+ * change, from "change-event" until the last "changed" handler returns,
+ * and each write made through util_stall_monitor_set_value(). A stall is
+ * put down to the key that caused it; a change to several keys goes to
+ * the first of them, and one that names no keys to "*". */
+typedef struct _UtilStallMonitor UtilStallMonitor;
+
+typedef enum {
+  UTIL_STALL_DISPATCH,
+  UTIL_STALL_WRITE
+} UtilStallKind;
+
+UtilStallMonitor *util_stall_monitor_new            (GSettings        *settings);
+void              util_stall_monitor_free           (UtilStallMonitor *monitor);
+
+/* g_settings_set_value(), timed. A change dispatched from within the write
+ * is only counted as a dispatch. */
+gboolean          util_stall_monitor_set_value      (UtilStallMonitor *monitor,
+                                                     const gchar      *key,
+                                                     GVariant         *value);
+
+guint             util_stall_monitor_get_count      (UtilStallMonitor *monitor,
+                                                     UtilStallKind     kind);
+/* The stall that @percentile percent of the others are no longer than,
+ * so 100 gives the longest; 0 if there were none */
+gint64            util_stall_monitor_get_percentile (UtilStallMonitor *monitor,
+                                                     UtilStallKind     kind,
+                                                     gdouble           percentile);
+/* The key behind the longest stall, or NULL */
+const gchar      *util_stall_monitor_get_worst_key  (UtilStallMonitor *monitor,
+                                                     UtilStallKind     kind);
+
+/* A table of the stalls by key, worst first */
+gchar            *util_stall_monitor_describe       (UtilStallMonitor *monitor);
 
 G_END_DECLS
 
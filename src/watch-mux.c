@@ -0,0 +1,240 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+#include <string.h>
+
+#include "watch-mux.h"
+
+typedef struct _WatchMuxNode WatchMuxNode;
+
+struct _WatchMuxNode {
+  WatchMuxNode *parent;
+  gchar        *name;
+  gchar        *path;       /* "/a/b/" */
+  GHashTable   *children;   /* name -> WatchMuxNode, NULL when empty */
+  guint         count;      /* times this path has been added */
+};
+
+struct _WatchMux {
+  WatchMuxNode *root;
+  guint         n_paths;
+};
+
+static WatchMuxNode *
+watch_mux_node_new (WatchMuxNode *parent,
+                    const gchar  *name)
+{
+  WatchMuxNode *node = g_slice_new0 (WatchMuxNode);
+
+  node->parent = parent;
+
+  if (parent == NULL)
+    {
+      node->name = g_strdup ("");
+      node->path = g_strdup ("/");
+    }
+  else
+    {
+      node->name = g_strdup (name);
+      node->path = g_strconcat (parent->path, name, "/", NULL);
+    }
+
+  return node;
+}
+
+static void
+watch_mux_node_free (WatchMuxNode *node)
+{
+  if (node->children != NULL)
+    g_hash_table_unref (node->children);
+
+  g_free (node->path);
+  g_free (node->name);
+  g_slice_free (WatchMuxNode, node);
+}
+
+WatchMux *
+watch_mux_new (void)
+{
+  WatchMux *mux = g_slice_new0 (WatchMux);
+
+  mux->root = watch_mux_node_new (NULL, NULL);
+
+  return mux;
+}
+
+void
+watch_mux_free (WatchMux *mux)
+{
+  watch_mux_node_free (mux->root);
+  g_slice_free (WatchMux, mux);
+}
+
+/* Walks down to @path, creating the nodes on the way if @create is set */
+static WatchMuxNode *
+lookup_node (WatchMux    *mux,
+             const gchar *path,
+             gboolean     create)
+{
+  WatchMuxNode *node = mux->root;
+  gchar *copy, *name, *next;
+
+  copy = g_strdup (path);
+
+  for (name = copy; name != NULL && node != NULL; name = next)
+    {
+      WatchMuxNode *child = NULL;
+
+      next = strchr (name, '/');
+      if (next != NULL)
+        *next++ = '\0';
+
+      if (name[0] == '\0')
+        continue;
+
+      if (node->children != NULL)
+        child = g_hash_table_lookup (node->children, name);
+
+      if (child == NULL && create)
+        {
+          if (node->children == NULL)
+            node->children = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                                    (GDestroyNotify) watch_mux_node_free);
+
+          child = watch_mux_node_new (node, name);
+          g_hash_table_insert (node->children, child->name, child);
+        }
+
+      node = child;
+    }
+
+  g_free (copy);
+
+  return node;
+}
+
+gboolean
+watch_mux_add (WatchMux    *mux,
+               const gchar *path)
+{
+  WatchMuxNode *node = lookup_node (mux, path, TRUE);
+
+  if (node->count++ > 0)
+    return FALSE;
+
+  mux->n_paths++;
+
+  return TRUE;
+}
+
+gboolean
+watch_mux_remove (WatchMux    *mux,
+                  const gchar *path)
+{
+  WatchMuxNode *node = lookup_node (mux, path, FALSE);
+
+  g_return_val_if_fail (node != NULL && node->count > 0, FALSE);
+
+  if (--node->count > 0)
+    return FALSE;
+
+  mux->n_paths--;
+
+  /* Drop the branch if nothing else hangs off it */
+  while (node->parent != NULL && node->count == 0 &&
+         (node->children == NULL || g_hash_table_size (node->children) == 0))
+    {
+      WatchMuxNode *parent = node->parent;
+
+      g_hash_table_remove (parent->children, node->name);
+      node = parent;
+    }
+
+  return TRUE;
+}
+
+guint
+watch_mux_get_n_paths (WatchMux *mux)
+{
+  return mux->n_paths;
+}
+
+/* The deepest path that every watched path is equal to or inside of, or
+ * NULL if nothing is watched */
+gchar *
+watch_mux_get_root (WatchMux *mux)
+{
+  WatchMuxNode *node = mux->root;
+
+  if (mux->n_paths == 0)
+    return NULL;
+
+  while (node->count == 0 &&
+         node->children != NULL && g_hash_table_size (node->children) == 1)
+    {
+      GHashTableIter iter;
+
+      g_hash_table_iter_init (&iter, node->children);
+      g_hash_table_iter_next (&iter, NULL, (gpointer *) &node);
+    }
+
+  return g_strdup (node->path);
+}
+
+static guint
+dispatch_below (WatchMuxNode *node,
+                WatchMuxFunc  func,
+                gpointer      user_data)
+{
+  guint n_dispatched = 0;
+
+  if (node->count > 0)
+    {
+      func (node->path, user_data);
+      n_dispatched++;
+    }
+
+  if (node->children != NULL)
+    {
+      GHashTableIter iter;
+      WatchMuxNode *child;
+
+      g_hash_table_iter_init (&iter, node->children);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &child))
+        n_dispatched += dispatch_below (child, func, user_data);
+    }
+
+  return n_dispatched;
+}
+
+guint
+watch_mux_dispatch (WatchMux     *mux,
+                    const gchar  *path,
+                    gboolean      below,
+                    WatchMuxFunc  func,
+                    gpointer      user_data)
+{
+  WatchMuxNode *node = lookup_node (mux, path, FALSE);
+
+  if (node == NULL)
+    return 0;
+
+  if (below)
+    return dispatch_below (node, func, user_data);
+
+  if (node->count == 0)
+    return 0;
+
+  func (node->path, user_data);
+
+  return 1;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright © 2009 Sam Thursfield
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ *
+ * Authors: Sam Thursfield <ssssam@gmail.com>
+ */
+
+/* A set of watched GSettings paths, stored as a trie of path components.
+ * A backend can use it to watch the storage once, at the deepest path
+ * that all the watched paths share, and route each change to the paths
+ * it affects in time proportional to the depth of the change rather than
+ * to the number of paths being watched.
+ *
+ * Not thread-safe; the caller is expected to hold a lock.
+ */
+
+#include <glib.h>
+
+#ifndef __WATCH_MUX_H__
+#define __WATCH_MUX_H__
+
+G_BEGIN_DECLS
+
+typedef struct _WatchMux WatchMux;
+
+typedef void (*WatchMuxFunc) (const gchar *path,
+                              gpointer     user_data);
+
+WatchMux *watch_mux_new         (void);
+void      watch_mux_free        (WatchMux     *mux);
+
+/* Paths are counted, so adding one twice needs removing twice. These
+ * return TRUE when @path starts or stops being watched. */
+gboolean  watch_mux_add         (WatchMux     *mux,
+                                 const gchar  *path);
+gboolean  watch_mux_remove      (WatchMux     *mux,
+                                 const gchar  *path);
+
+guint     watch_mux_get_n_paths (WatchMux     *mux);
+gchar    *watch_mux_get_root    (WatchMux     *mux);
+
+/* Calls @func with each watched path equal to @path or, if @below is
+ * set, also inside it. Returns how many there were. */
+guint     watch_mux_dispatch    (WatchMux     *mux,
+                                 const gchar  *path,
+                                 gboolean      below,
+                                 WatchMuxFunc  func,
+                                 gpointer      user_data);
+
+G_END_DECLS
+
+#endif /* __WATCH_MUX_H__ */